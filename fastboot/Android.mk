@@ -26,6 +26,7 @@ LOCAL_CFLAGS += -std=gnu99 -Werror
 
 ifeq ($(HOST_OS),linux)
   LOCAL_SRC_FILES += usb_linux.c util_linux.c
+  LOCAL_LDLIBS += -lpthread
 endif
 
 ifeq ($(HOST_OS),darwin)
@@ -54,6 +55,7 @@ LOCAL_STATIC_LIBRARIES := \
     libzipfile \
     libunz \
     libext4_utils_host \
+    libmincrypt \
     libsparse_host \
     libz
 
@@ -32,6 +32,7 @@
 #include <errno.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -42,6 +43,7 @@
 #ifdef USE_MINGW
 #include <fcntl.h>
 #else
+#include <pthread.h>
 #include <sys/mman.h>
 #endif
 
@@ -57,6 +59,8 @@
 #define OP_NOTICE     4
 #define OP_DOWNLOAD_SPARSE 5
 #define OP_WAIT_FOR_DISCONNECT 6
+#define OP_DOWNLOAD_FD 7
+#define OP_PREPARE    8
 
 typedef struct Action Action;
 
@@ -72,6 +76,13 @@ struct Action
     void *data;
     unsigned size;
 
+    int fd;
+    int64_t offset;
+
+    int (*prepare)(void *cookie);
+    void (*queue)(void *cookie);
+    int prepare_status;
+
     const char *msg;
     int (*func)(Action *a, int status, char *resp);
 
@@ -81,6 +92,24 @@ struct Action
 static Action *action_list = 0;
 static Action *action_last = 0;
 
+#ifndef USE_MINGW
+/* Number of OP_PREPARE actions the helper thread may run ahead of the
+ * one the queue is currently waiting on.
+ */
+#define PREPARE_AHEAD 1
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    Action **list;
+    unsigned count;
+    unsigned done;
+    unsigned reached;
+} preparer = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+#endif
 
 
 
@@ -185,6 +214,21 @@ void fb_queue_flash(const char *ptn, void *data, unsigned sz)
     a->msg = mkmsg("writing '%s'", ptn);
 }
 
+/* The queue owns |fd| and closes it once the download has run. */
+void fb_queue_flash_fd(const char *ptn, int fd, int64_t offset, unsigned sz)
+{
+    Action *a;
+
+    a = queue_action(OP_DOWNLOAD_FD, "");
+    a->fd = fd;
+    a->offset = offset;
+    a->size = sz;
+    a->msg = mkmsg("sending '%s' (%d KB)", ptn, sz / 1024);
+
+    a = queue_action(OP_COMMAND, "flash:%s", ptn);
+    a->msg = mkmsg("writing '%s'", ptn);
+}
+
 void fb_queue_flash_sparse(const char *ptn, struct sparse_file *s, unsigned sz)
 {
     Action *a;
@@ -364,6 +408,119 @@ void fb_queue_wait_for_disconnect(void)
     queue_action(OP_WAIT_FOR_DISCONNECT, "");
 }
 
+/* Queues an image that prepare() produces while the actions before it run.
+ * prepare() may be called from another thread and must not talk to the
+ * device; once the queue gets here, queue() is called to queue the actions
+ * that send the result.
+ */
+void fb_queue_prepare(int (*prepare)(void *cookie),
+        void (*queue)(void *cookie), void *cookie)
+{
+    Action *a = queue_action(OP_PREPARE, "");
+    a->data = cookie;
+    a->prepare = prepare;
+    a->queue = queue;
+}
+
+/* Queues the actions produced by a prepared action directly after it,
+ * so they run next.
+ */
+static void queue_prepared(Action *a)
+{
+    Action *next = a->next;
+    Action *last = action_last;
+
+    a->next = NULL;
+    action_last = a;
+    a->queue(a->data);
+    action_last->next = next;
+    if (next) {
+        action_last = last;
+    }
+}
+
+#ifdef USE_MINGW
+static void start_preparer(void)
+{
+}
+
+static int wait_prepared(Action *a)
+{
+    return a->prepare(a->data);
+}
+#else
+static void *prepare_thread(void *arg __unused)
+{
+    unsigned i;
+
+    for (i = 0; i < preparer.count; i++) {
+        Action *a = preparer.list[i];
+        int status;
+
+        pthread_mutex_lock(&preparer.lock);
+        while (i >= preparer.reached + PREPARE_AHEAD) {
+            pthread_cond_wait(&preparer.cond, &preparer.lock);
+        }
+        pthread_mutex_unlock(&preparer.lock);
+
+        status = a->prepare(a->data);
+
+        pthread_mutex_lock(&preparer.lock);
+        a->prepare_status = status;
+        preparer.done = i + 1;
+        pthread_cond_broadcast(&preparer.cond);
+        pthread_mutex_unlock(&preparer.lock);
+    }
+
+    return NULL;
+}
+
+/* Starts a helper thread that runs the prepare step of every OP_PREPARE
+ * action in queue order, so that loading, resparsing or generating the
+ * next image overlaps with the transfer of the current one.
+ */
+static void start_preparer(void)
+{
+    pthread_t thread;
+    unsigned n = 0;
+    Action *a;
+
+    for (a = action_list; a; a = a->next) {
+        if (a->op == OP_PREPARE) n++;
+    }
+    if (n == 0) {
+        return;
+    }
+
+    preparer.list = calloc(n, sizeof(Action *));
+    if (preparer.list == 0) die("out of memory");
+    for (a = action_list; a; a = a->next) {
+        if (a->op == OP_PREPARE) preparer.list[preparer.count++] = a;
+    }
+
+    if (pthread_create(&thread, NULL, prepare_thread, NULL)) {
+        die("cannot start image preparation thread");
+    }
+    pthread_detach(thread);
+}
+
+static int wait_prepared(Action *a)
+{
+    int status;
+
+    pthread_mutex_lock(&preparer.lock);
+    preparer.reached++;
+    pthread_cond_broadcast(&preparer.cond);
+    while (preparer.done < preparer.reached) {
+        pthread_cond_wait(&preparer.cond, &preparer.lock);
+    }
+    status = a->prepare_status;
+    pthread_mutex_unlock(&preparer.lock);
+
+    return status;
+}
+#endif
+
 int fb_execute_queue(usb_handle *usb)
 {
     Action *a;
@@ -375,6 +532,8 @@ int fb_execute_queue(usb_handle *usb)
         return status;
     resp[FB_RESPONSE_SZ] = 0;
 
+    start_preparer();
+
     double start = -1;
     for (a = action_list; a; a = a->next) {
         a->start = now();
@@ -387,6 +546,11 @@ int fb_execute_queue(usb_handle *usb)
             status = fb_download_data(usb, a->data, a->size);
             status = a->func(a, status, status ? fb_get_error() : "");
             if (status) break;
+        } else if (a->op == OP_DOWNLOAD_FD) {
+            status = fb_download_data_fd(usb, a->fd, a->offset, a->size);
+            close(a->fd);
+            status = a->func(a, status, status ? fb_get_error() : "");
+            if (status) break;
         } else if (a->op == OP_COMMAND) {
             status = fb_command(usb, a->cmd);
             status = a->func(a, status, status ? fb_get_error() : "");
@@ -403,6 +567,10 @@ int fb_execute_queue(usb_handle *usb)
             if (status) break;
         } else if (a->op == OP_WAIT_FOR_DISCONNECT) {
             usb_wait_for_disconnect(usb);
+        } else if (a->op == OP_PREPARE) {
+            status = wait_prepared(a);
+            if (status) break;
+            queue_prepared(a);
         } else {
             die("bogus action");
         }
@@ -45,18 +45,26 @@
 #include <unistd.h>
 
 #include <bootimg.h>
+#include <mincrypt/sha256.h>
 #include <sparse/sparse.h>
 #include <zipfile/zipfile.h>
 
 #include "fastboot.h"
 #include "fs.h"
 
+#ifndef USE_MINGW
+#include <sys/mman.h>
+#endif
+
 #ifndef O_BINARY
 #define O_BINARY 0
 #endif
 
 #define ARRAY_SIZE(a) (sizeof(a)/sizeof(*(a)))
 
+/* Granularity at which --delta compares images with the device */
+#define DELTA_HASH_SIZE (64 * 1024)
+
 char cur_product[FB_RESPONSE_SZ + 1];
 
 void bootimg_set_cmdline(boot_img_hdr *h, const char *cmdline);
@@ -75,6 +83,7 @@ static unsigned short vendor_id = 0;
 static int long_listing = 0;
 static int64_t sparse_limit = -1;
 static int64_t target_sparse_limit = -1;
+static int delta_flash = 0;
 
 unsigned page_size = 2048;
 unsigned base_addr      = 0x10000000;
@@ -86,11 +95,13 @@ unsigned tags_offset    = 0x00000100;
 enum fb_buffer_type {
     FB_BUFFER,
     FB_BUFFER_SPARSE,
+    FB_BUFFER_FD,
 };
 
 struct fastboot_buffer {
     enum fb_buffer_type type;
     void *data;
+    int fd;
     unsigned int sz;
 };
 
@@ -200,6 +211,39 @@ static void *load_file(const char *fn, unsigned *_sz)
     return load_fd(fd, _sz);
 }
 
+/* Like load_file(), but maps the file read-only instead of copying it
+ * into the heap where the platform allows it.  Used for update archives,
+ * which can be several times larger than any single image in them.
+ */
+static void *map_file(const char *fn, unsigned *_sz)
+{
+#ifdef USE_MINGW
+    return load_file(fn, _sz);
+#else
+    int fd;
+    int64_t sz;
+    void *data;
+
+    fd = open(fn, O_RDONLY | O_BINARY);
+    if(fd < 0) return 0;
+
+    sz = file_size(fd);
+    if (sz <= 0 || sz > UINT_MAX) {
+        close(fd);
+        return load_file(fn, _sz);
+    }
+
+    data = mmap(NULL, sz, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return load_file(fn, _sz);
+    }
+
+    if(_sz) *_sz = sz;
+    return data;
+#endif
+}
+
 int match_fastboot_with_serial(usb_ifc_info *info, const char *local_serial)
 {
     if(!(vendor_id && (info->dev_vendor == vendor_id)) &&
@@ -322,6 +366,8 @@ void usage(void)
             "                                           default: 2048\n"
             "  -S <size>[K|M|G]                         automatically sparse files greater\n"
             "                                           than size.  0 to disable\n"
+            "  --delta                                  only send the blocks of each image\n"
+            "                                           that differ from the device, implies -u\n"
         );
 }
 
@@ -550,17 +596,11 @@ void queue_info_dump(void)
     fb_queue_notice("--------------------------------------------");
 }
 
-static struct sparse_file **load_sparse_files(int fd, int max_size)
+static struct sparse_file **resparse_file(struct sparse_file *s, int max_size)
 {
-    struct sparse_file *s;
     int files;
     struct sparse_file **out_s;
 
-    s = sparse_file_import_auto(fd, false);
-    if (!s) {
-        die("cannot sparse read file\n");
-    }
-
     files = sparse_file_resparse(s, max_size, NULL, 0);
     if (files < 0) {
         die("Failed to resparse\n");
@@ -579,6 +619,18 @@ static struct sparse_file **load_sparse_files(int fd, int max_size)
     return out_s;
 }
 
+static struct sparse_file **load_sparse_files(int fd, int max_size)
+{
+    struct sparse_file *s;
+
+    s = sparse_file_import_auto(fd, false);
+    if (!s) {
+        die("cannot sparse read file\n");
+    }
+
+    return resparse_file(s, max_size);
+}
+
 static int64_t get_target_sparse_limit(struct usb_handle *usb)
 {
     int64_t limit = 0;
@@ -638,10 +690,8 @@ static int load_buf_fd(usb_handle *usb, int fd,
         struct fastboot_buffer *buf)
 {
     int64_t sz64;
-    void *data;
     int64_t limit;
 
-
     sz64 = file_size(fd);
     if (sz64 < 0) {
         return -1;
@@ -656,31 +706,22 @@ static int load_buf_fd(usb_handle *usb, int fd,
         }
         buf->type = FB_BUFFER_SPARSE;
         buf->data = s;
+    } else if (sz64 > UINT_MAX) {
+        fprintf(stderr, "image too large to send without -S\n");
+        return -1;
     } else {
-        unsigned int sz;
-        data = load_fd(fd, &sz);
-        if (data == 0) return -1;
-        buf->type = FB_BUFFER;
-        buf->data = data;
-        buf->sz = sz;
+        /* The image is streamed from the fd when the queue runs rather
+         * than being read into memory here; the queue closes the fd once
+         * it has been sent.
+         */
+        buf->type = FB_BUFFER_FD;
+        buf->fd = fd;
+        buf->sz = sz64;
     }
 
     return 0;
 }
 
-static int load_buf(usb_handle *usb, const char *fname,
-        struct fastboot_buffer *buf)
-{
-    int fd;
-
-    fd = open(fname, O_RDONLY | O_BINARY);
-    if (fd < 0) {
-        return -1;
-    }
-
-    return load_buf_fd(usb, fd, buf);
-}
-
 static void flash_buf(const char *pname, struct fastboot_buffer *buf)
 {
     struct sparse_file **s;
@@ -696,21 +737,315 @@ static void flash_buf(const char *pname, struct fastboot_buffer *buf)
         case FB_BUFFER:
             fb_queue_flash(pname, buf->data, buf->sz);
             break;
+        case FB_BUFFER_FD:
+            fb_queue_flash_fd(pname, buf->fd, 0, buf->sz);
+            break;
         default:
             die("unknown buffer type: %d", buf->type);
     }
 }
 
-void do_flash(usb_handle *usb, const char *pname, const char *fname)
+/* An image whose loading is deferred until the queue runs, so that it can
+ * be read, unzipped, resparsed or generated while the image before it is
+ * being sent.
+ */
+struct flash_job {
+    const char *pname;
+    const char *name;
+    int fd;
+    zipfile_t zip;
+    const struct fs_generator *gen;
+    long long gen_size;
+    bool skip;
+    struct fastboot_buffer buf;
+
+    /* --delta: the whole image and a digest of each hash_size piece */
+    struct sparse_file *image;
+    int64_t image_len;
+    unsigned int hash_size;
+    unsigned int nhashes;
+    uint8_t *digests;
+    unsigned char *coverage;
+    SHA256_CTX ctx;
+    unsigned int hashed;
+    unsigned int in_hash;
+    bool has_data;
+    bool has_holes;
+};
+
+/* How much of each hash_size piece of a delta image is backed */
+enum {
+    DELTA_FULL,
+    DELTA_PARTIAL,
+    DELTA_EMPTY,
+};
+
+static void delta_hash_end(struct flash_job *job)
+{
+    unsigned int i = job->hashed++;
+
+    memcpy(job->digests + i * SHA256_DIGEST_SIZE, SHA256_final(&job->ctx),
+            SHA256_DIGEST_SIZE);
+    if (!job->has_holes) {
+        job->coverage[i] = DELTA_FULL;
+    } else if (job->has_data) {
+        job->coverage[i] = DELTA_PARTIAL;
+    } else {
+        job->coverage[i] = DELTA_EMPTY;
+    }
+
+    SHA256_init(&job->ctx);
+    job->in_hash = 0;
+    job->has_data = false;
+    job->has_holes = false;
+}
+
+static int delta_hash_write(void *priv, const void *data, int len)
+{
+    struct flash_job *job = priv;
+    const char *ptr = data;
+    unsigned int n;
+
+    while (len > 0) {
+        n = job->hash_size - job->in_hash;
+        if ((unsigned int)len < n) {
+            n = len;
+        }
+        if (ptr) {
+            SHA256_update(&job->ctx, ptr, n);
+            ptr += n;
+            job->has_data = true;
+        } else {
+            job->has_holes = true;
+        }
+        job->in_hash += n;
+        len -= n;
+
+        if (job->in_hash == job->hash_size) {
+            delta_hash_end(job);
+        }
+    }
+
+    return 0;
+}
+
+/* Loads the whole image and hashes it the same way the device hashes its
+ * partitions, so that queue_delta_actions() only has to compare digests.
+ * Blocks that the image leaves unbacked do not count towards a digest.
+ */
+static int prepare_delta(struct flash_job *job)
+{
+    unsigned int block_size;
+
+    lseek(job->fd, 0, SEEK_SET);
+    job->image = sparse_file_import_auto(job->fd, false);
+    if (!job->image) {
+        return -1;
+    }
+
+    block_size = sparse_file_block_size(job->image);
+    job->hash_size = DELTA_HASH_SIZE / block_size * block_size;
+    if (job->hash_size == 0) {
+        job->hash_size = block_size;
+    }
+    job->image_len = sparse_file_len(job->image, false, false);
+    job->nhashes = (job->image_len + job->hash_size - 1) / job->hash_size;
+
+    job->digests = malloc((size_t)job->nhashes * SHA256_DIGEST_SIZE);
+    job->coverage = malloc(job->nhashes);
+    if (!job->digests || !job->coverage) {
+        die("out of memory");
+    }
+
+    SHA256_init(&job->ctx);
+    if (sparse_file_callback(job->image, false, false, delta_hash_write, job)) {
+        return -1;
+    }
+    if (job->in_hash) {
+        delta_hash_end(job);
+    }
+
+    return 0;
+}
+
+static void flash_sparse_file(const char *pname, struct sparse_file *s)
 {
     struct fastboot_buffer buf;
+    int64_t limit;
 
-    if (load_buf(usb, fname, &buf)) {
-        die("cannot load '%s'", fname);
+    limit = get_sparse_limit(usb, sparse_file_len(s, true, false));
+    buf.type = FB_BUFFER_SPARSE;
+    if (limit) {
+        buf.data = resparse_file(s, limit);
+    } else {
+        struct sparse_file **files = calloc(2, sizeof(struct sparse_file *));
+        if (files == 0) die("out of memory");
+        files[0] = s;
+        buf.data = files;
     }
     flash_buf(pname, &buf);
 }
 
+/* Asks the device for the digests of the partition and flashes a sparse
+ * image that only backs the pieces that differ, or the whole image if the
+ * device cannot hash its partitions.
+ */
+static void queue_delta_actions(struct flash_job *job)
+{
+    char cmd[FB_COMMAND_SZ + 1];
+    struct sparse_file *delta;
+    unsigned int blocks_per_hash;
+    unsigned int remote_hashes;
+    unsigned int changed = 0;
+    unsigned int start;
+    unsigned int i;
+    uint8_t *remote;
+    int size;
+
+    snprintf(cmd, sizeof(cmd), "blockhash:%s:%x:%" PRIx64,
+            job->pname, job->hash_size, job->image_len);
+    size = fb_command_upload(usb, cmd, (void **)&remote,
+            job->nhashes * SHA256_DIGEST_SIZE);
+    if (size < 0) {
+        fprintf(stderr, "cannot compare '%s' with the device (%s), sending it all\n",
+                job->pname, fb_get_error());
+        flash_sparse_file(job->pname, job->image);
+        return;
+    }
+    remote_hashes = size / SHA256_DIGEST_SIZE;
+
+    delta = sparse_file_new(sparse_file_block_size(job->image), job->image_len);
+    if (!delta) die("out of memory");
+
+    blocks_per_hash = job->hash_size / sparse_file_block_size(job->image);
+    for (i = 0; i < job->nhashes; i = start) {
+        for (start = i; start < job->nhashes; start++) {
+            if (job->coverage[start] == DELTA_EMPTY) {
+                break;
+            }
+            if (job->coverage[start] == DELTA_FULL && start < remote_hashes &&
+                    !memcmp(job->digests + start * SHA256_DIGEST_SIZE,
+                            remote + start * SHA256_DIGEST_SIZE,
+                            SHA256_DIGEST_SIZE)) {
+                break;
+            }
+        }
+        if (start == i) {
+            start++;
+            continue;
+        }
+        if (sparse_file_add_region(delta, job->image, i * blocks_per_hash,
+                (start - i) * blocks_per_hash)) {
+            die("cannot build delta image for '%s'", job->pname);
+        }
+        changed += start - i;
+    }
+    free(remote);
+
+    fprintf(stderr, "'%s': %u of %u blocks changed\n", job->pname, changed,
+            job->nhashes);
+    if (changed) {
+        flash_sparse_file(job->pname, delta);
+    }
+}
+
+static struct flash_job *new_flash_job(const char *pname, const char *name)
+{
+    struct flash_job *job = calloc(1, sizeof(*job));
+    if (job == 0) die("out of memory");
+
+    job->pname = pname;
+    job->name = name;
+    job->fd = -1;
+    return job;
+}
+
+static int prepare_flash_job(void *cookie)
+{
+    struct flash_job *job = cookie;
+
+    if (job->zip) {
+        job->fd = unzip_to_file(job->zip, (char *)job->name);
+        if (job->fd < 0) {
+            fprintf(stderr, "cannot load %s from update package\n", job->name);
+            return -1;
+        }
+    } else if (job->gen) {
+        job->fd = fileno(tmpfile());
+        if (fs_generator_generate(job->gen, job->fd, job->gen_size)) {
+            close(job->fd);
+            fprintf(stderr, "Cannot generate image.\n");
+            job->skip = true;
+            return 0;
+        }
+    }
+
+    if (delta_flash && !job->skip) {
+        if (!prepare_delta(job)) {
+            return 0;
+        }
+        fprintf(stderr, "cannot hash '%s', sending it all\n", job->name);
+        if (job->image) {
+            sparse_file_destroy(job->image);
+            job->image = NULL;
+        }
+    }
+
+    if (load_buf_fd(usb, job->fd, &job->buf)) {
+        if (job->gen) {
+            fprintf(stderr, "Cannot read image.\n");
+            close(job->fd);
+            job->skip = true;
+            return 0;
+        }
+        fprintf(stderr, "cannot load '%s'\n", job->name);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void queue_flash_job_actions(void *cookie)
+{
+    struct flash_job *job = cookie;
+
+    if (job->skip) {
+        return;
+    }
+
+    if (job->image) {
+        queue_delta_actions(job);
+    } else {
+        flash_buf(job->pname, &job->buf);
+    }
+}
+
+static void queue_flash_job(struct flash_job *job)
+{
+    /* load_buf_fd() runs on the preparation thread, which must not talk
+     * to the device, so ask for the download limit now.
+     */
+    if (sparse_limit < 0 && target_sparse_limit == -1) {
+        target_sparse_limit = get_target_sparse_limit(usb);
+    }
+    fb_queue_prepare(prepare_flash_job, queue_flash_job_actions, job);
+}
+
+void do_flash(usb_handle *usb, const char *pname, const char *fname)
+{
+    struct flash_job *job;
+    int fd;
+
+    fd = open(fname, O_RDONLY | O_BINARY);
+    if (fd < 0) {
+        die("cannot load '%s'", fname);
+    }
+
+    job = new_flash_job(pname, fname);
+    job->fd = fd;
+    queue_flash_job(job);
+}
+
 void do_update_signature(zipfile_t zip, char *fn)
 {
     void *data;
@@ -728,16 +1063,14 @@ void do_update(usb_handle *usb, char *fn, int erase_first)
     void *data;
     unsigned sz;
     zipfile_t zip;
-    int fd;
-    int rc;
-    struct fastboot_buffer buf;
+    struct flash_job *jobs[ARRAY_SIZE(images)];
     size_t i;
 
     queue_info_dump();
 
     fb_queue_query_save("product", cur_product, sizeof(cur_product));
 
-    zdata = load_file(fn, &zsize);
+    zdata = map_file(fn, &zsize);
     if (zdata == 0) die("failed to load '%s': %s", fn, strerror(errno));
 
     zip = init_zipfile(zdata, zsize);
@@ -760,24 +1093,32 @@ void do_update(usb_handle *usb, char *fn, int erase_first)
 
     setup_requirements(data, sz);
 
+    /* Erases are queued ahead of all the images so the device works
+     * through them while the first image is being unzipped.
+     */
     for (i = 0; i < ARRAY_SIZE(images); i++) {
-        fd = unzip_to_file(zip, images[i].img_name);
-        if (fd < 0) {
+        jobs[i] = NULL;
+        if (lookup_zipentry(zip, images[i].img_name) == NULL) {
             if (images[i].is_optional)
                 continue;
             die("update package missing %s", images[i].img_name);
         }
-        rc = load_buf_fd(usb, fd, &buf);
-        if (rc) die("cannot load %s from flash", images[i].img_name);
-        do_update_signature(zip, images[i].sig_name);
         if (erase_first && needs_erase(images[i].part_name)) {
             fb_queue_erase(images[i].part_name);
         }
-        flash_buf(images[i].part_name, &buf);
-        /* not closing the fd here since the sparse code keeps the fd around
-         * but hasn't mmaped data yet. The tmpfile will get cleaned up when the
-         * program exits.
+        jobs[i] = new_flash_job(images[i].part_name, images[i].img_name);
+        jobs[i]->zip = zip;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(images); i++) {
+        if (jobs[i] == NULL)
+            continue;
+        do_update_signature(zip, images[i].sig_name);
+        /* not closing the unzipped fd since the sparse code keeps the fd
+         * around but hasn't mmaped data yet. The tmpfile will get cleaned
+         * up when the program exits.
          */
+        queue_flash_job(jobs[i]);
     }
 }
 
@@ -804,7 +1145,8 @@ void do_flashall(usb_handle *usb, int erase_first)
     char *fname;
     void *data;
     unsigned sz;
-    struct fastboot_buffer buf;
+    struct flash_job *jobs[ARRAY_SIZE(images)];
+    int fd;
     size_t i;
 
     queue_info_dump();
@@ -817,18 +1159,30 @@ void do_flashall(usb_handle *usb, int erase_first)
     if (data == 0) die("could not load android-info.txt: %s", strerror(errno));
     setup_requirements(data, sz);
 
+    /* Erases are queued ahead of all the images so the device works
+     * through them while the first image is being loaded.
+     */
     for (i = 0; i < ARRAY_SIZE(images); i++) {
+        jobs[i] = NULL;
         fname = find_item(images[i].part_name, product);
-        if (load_buf(usb, fname, &buf)) {
+        fd = open(fname, O_RDONLY | O_BINARY);
+        if (fd < 0) {
             if (images[i].is_optional)
                 continue;
             die("could not load %s\n", images[i].img_name);
         }
-        do_send_signature(fname);
         if (erase_first && needs_erase(images[i].part_name)) {
             fb_queue_erase(images[i].part_name);
         }
-        flash_buf(images[i].part_name, &buf);
+        jobs[i] = new_flash_job(images[i].part_name, fname);
+        jobs[i]->fd = fd;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(images); i++) {
+        if (jobs[i] == NULL)
+            continue;
+        do_send_signature((char *)jobs[i]->name);
+        queue_flash_job(jobs[i]);
     }
 }
 
@@ -900,12 +1254,11 @@ void fb_perform_format(const char *partition, int skip_if_not_supported,
     char *pType = pTypeBuff;
     char *pSize = pSizeBuff;
     unsigned int limit = INT_MAX;
-    struct fastboot_buffer buf;
     const char *errMsg = NULL;
     const struct fs_generator *gen;
+    struct flash_job *job;
     uint64_t pSz;
     int status;
-    int fd;
 
     if (target_sparse_limit > 0 && target_sparse_limit < limit)
         limit = target_sparse_limit;
@@ -953,19 +1306,10 @@ void fb_perform_format(const char *partition, int skip_if_not_supported,
 
     pSz = strtoll(pSize, (char **)NULL, 16);
 
-    fd = fileno(tmpfile());
-    if (fs_generator_generate(gen, fd, pSz)) {
-        close(fd);
-        fprintf(stderr, "Cannot generate image.\n");
-        return;
-    }
-
-    if (load_buf_fd(usb, fd, &buf)) {
-        fprintf(stderr, "Cannot read image.\n");
-        close(fd);
-        return;
-    }
-    flash_buf(partition, &buf);
+    job = new_flash_job(partition, partition);
+    job->gen = gen;
+    job->gen_size = pSz;
+    queue_flash_job(job);
 
     return;
 
@@ -997,6 +1341,7 @@ int main(int argc, char **argv)
         {"ramdisk_offset", required_argument, 0, 'r'},
         {"tags_offset", required_argument, 0, 't'},
         {"help", 0, 0, 'h'},
+        {"delta", 0, 0, 'd'},
         {0, 0, 0, 0}
     };
 
@@ -1015,6 +1360,9 @@ int main(int argc, char **argv)
         case 'c':
             cmdline = optarg;
             break;
+        case 'd':
+            delta_flash = 1;
+            break;
         case 'h':
             usage();
             return 1;
@@ -1072,6 +1420,11 @@ int main(int argc, char **argv)
     argc -= optind;
     argv += optind;
 
+    /* An erase would throw away the blocks a delta flash relies on */
+    if (delta_flash) {
+        erase_first = 0;
+    }
+
     if (argc == 0 && !wants_wipe) {
         usage();
         return 1;
@@ -1230,8 +1583,8 @@ int main(int argc, char **argv)
 
     if (wants_wipe) {
         fb_queue_erase("userdata");
-        fb_perform_format("userdata", 1, NULL, NULL);
         fb_queue_erase("cache");
+        fb_perform_format("userdata", 1, NULL, NULL);
         fb_perform_format("cache", 1, NULL, NULL);
     }
     if (wants_reboot) {
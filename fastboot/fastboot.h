@@ -29,6 +29,8 @@
 #ifndef _FASTBOOT_H_
 #define _FASTBOOT_H_
 
+#include <stdint.h>
+
 #include "usb.h"
 
 struct sparse_file;
@@ -37,7 +39,10 @@ struct sparse_file;
 int fb_command(usb_handle *usb, const char *cmd);
 int fb_command_response(usb_handle *usb, const char *cmd, char *response);
 int fb_download_data(usb_handle *usb, const void *data, unsigned size);
+int fb_download_data_fd(usb_handle *usb, int fd, int64_t offset, unsigned size);
 int fb_download_data_sparse(usb_handle *usb, struct sparse_file *s);
+int fb_command_upload(usb_handle *usb, const char *cmd, void **data,
+        unsigned max_size);
 char *fb_get_error(void);
 
 #define FB_COMMAND_SZ 64
@@ -47,6 +52,7 @@ char *fb_get_error(void);
 int fb_getvar(struct usb_handle *usb, char *response, const char *fmt, ...);
 int fb_format_supported(usb_handle *usb, const char *partition, const char *type_override);
 void fb_queue_flash(const char *ptn, void *data, unsigned sz);
+void fb_queue_flash_fd(const char *ptn, int fd, int64_t offset, unsigned sz);
 void fb_queue_flash_sparse(const char *ptn, struct sparse_file *s, unsigned sz);
 void fb_queue_erase(const char *ptn);
 void fb_queue_format(const char *ptn, int skip_if_not_supported, unsigned int max_chunk_sz);
@@ -59,6 +65,8 @@ void fb_queue_command(const char *cmd, const char *msg);
 void fb_queue_download(const char *name, void *data, unsigned size);
 void fb_queue_notice(const char *notice);
 void fb_queue_wait_for_disconnect(void);
+void fb_queue_prepare(int (*prepare)(void *cookie),
+        void (*queue)(void *cookie), void *cookie);
 int fb_execute_queue(usb_handle *usb);
 int fb_queue_is_empty(void);
 
@@ -35,6 +35,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#ifndef USE_MINGW
+#include <pthread.h>
+#endif
 
 #include <sparse/sparse.h>
 
@@ -216,6 +222,356 @@ int fb_download_data(usb_handle *usb, const void *data, unsigned size)
     }
 }
 
+#define FD_CHUNK_SIZE (1024 * 1024)
+
+static int read_all(int fd, char *data, unsigned size)
+{
+    unsigned done = 0;
+    int r;
+
+    while (done < size) {
+        r = read(fd, data + done, size - done);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (r == 0) {
+            errno = EIO;
+            return -1;
+        }
+        done += r;
+    }
+
+    return 0;
+}
+
+#ifndef USE_MINGW
+
+/* A ring of transfer buffers shared between a producer thread, which
+ * fills them from an image file or from the sparse chunk generator, and
+ * the calling thread, which writes them to the device.  This overlaps
+ * disk I/O and chunk generation with the USB transfer while keeping at
+ * most RING_SLOTS * RING_BUF_SIZE bytes resident.
+ */
+#define RING_SLOTS 4
+#define RING_BUF_SIZE FD_CHUNK_SIZE
+#define RING_BUF_ALIGN 4096
+
+struct data_ring {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char *buf[RING_SLOTS];
+    unsigned len[RING_SLOTS];   /* 0 when the slot is free */
+
+    unsigned head;              /* next slot the producer fills */
+    unsigned tail;              /* next slot the consumer sends */
+    unsigned fill;              /* bytes already in buf[head] */
+
+    int done;                   /* producer has queued its last slot */
+    int status;                 /* producer result, valid once done */
+    int cancelled;              /* consumer gave up, producer must stop */
+
+    /* Why the producer failed; ring_send() copies it into ERROR once the
+     * producer has exited, so that only one thread writes ERROR.
+     */
+    char error[sizeof(ERROR)];
+
+    int (*produce)(struct data_ring *ring, void *priv);
+    void *priv;
+};
+
+static int ring_init(struct data_ring *ring)
+{
+    int i;
+
+    memset(ring, 0, sizeof(*ring));
+    for (i = 0; i < RING_SLOTS; i++) {
+        if (posix_memalign((void **) &ring->buf[i], RING_BUF_ALIGN,
+                           RING_BUF_SIZE)) {
+            while (i-- > 0) {
+                free(ring->buf[i]);
+            }
+            sprintf(ERROR, "out of memory");
+            return -1;
+        }
+    }
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->cond, NULL);
+
+    return 0;
+}
+
+static void ring_destroy(struct data_ring *ring)
+{
+    int i;
+
+    pthread_cond_destroy(&ring->cond);
+    pthread_mutex_destroy(&ring->lock);
+    for (i = 0; i < RING_SLOTS; i++) {
+        free(ring->buf[i]);
+    }
+}
+
+/* Producer side: returns the slot to fill, or NULL if the consumer has
+ * cancelled the transfer.
+ */
+static char *ring_get_slot(struct data_ring *ring)
+{
+    char *buf = NULL;
+
+    pthread_mutex_lock(&ring->lock);
+    while (ring->len[ring->head] != 0 && !ring->cancelled) {
+        pthread_cond_wait(&ring->cond, &ring->lock);
+    }
+    if (!ring->cancelled) {
+        buf = ring->buf[ring->head];
+    }
+    pthread_mutex_unlock(&ring->lock);
+
+    return buf;
+}
+
+static int ring_cancelled(struct data_ring *ring)
+{
+    int cancelled;
+
+    pthread_mutex_lock(&ring->lock);
+    cancelled = ring->cancelled;
+    pthread_mutex_unlock(&ring->lock);
+
+    return cancelled;
+}
+
+static void ring_put_slot(struct data_ring *ring, unsigned len)
+{
+    pthread_mutex_lock(&ring->lock);
+    ring->len[ring->head] = len;
+    ring->head = (ring->head + 1) % RING_SLOTS;
+    ring->fill = 0;
+    pthread_cond_broadcast(&ring->cond);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+static void *ring_thread(void *arg)
+{
+    struct data_ring *ring = arg;
+    int status;
+
+    status = ring->produce(ring, ring->priv);
+
+    pthread_mutex_lock(&ring->lock);
+    ring->status = status;
+    ring->done = 1;
+    pthread_cond_broadcast(&ring->cond);
+    pthread_mutex_unlock(&ring->lock);
+
+    return NULL;
+}
+
+/* Consumer side: starts the producer and sends every slot it fills until
+ * it is done.  ERROR describes whichever side failed first.
+ */
+static int ring_send(usb_handle *usb, struct data_ring *ring)
+{
+    pthread_t thread;
+    unsigned len;
+    int r = 0;
+
+    if (pthread_create(&thread, NULL, ring_thread, ring)) {
+        sprintf(ERROR, "cannot start transfer thread");
+        return -1;
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&ring->lock);
+        while (ring->len[ring->tail] == 0 && !ring->done) {
+            pthread_cond_wait(&ring->cond, &ring->lock);
+        }
+        len = ring->len[ring->tail];
+        if (ring->done && ring->status < 0) {
+            len = 0;
+        }
+        pthread_mutex_unlock(&ring->lock);
+
+        if (len == 0) {
+            break;
+        }
+        if (_command_data(usb, ring->buf[ring->tail], len) < 0) {
+            r = -1;
+            break;
+        }
+
+        pthread_mutex_lock(&ring->lock);
+        ring->len[ring->tail] = 0;
+        ring->tail = (ring->tail + 1) % RING_SLOTS;
+        pthread_cond_broadcast(&ring->cond);
+        pthread_mutex_unlock(&ring->lock);
+    }
+
+    pthread_mutex_lock(&ring->lock);
+    ring->cancelled = 1;
+    pthread_cond_broadcast(&ring->cond);
+    pthread_mutex_unlock(&ring->lock);
+    pthread_join(thread, NULL);
+
+    if (r == 0 && ring->status < 0) {
+        strcpy(ERROR, ring->error);
+        r = -1;
+    }
+
+    return r;
+}
+
+struct fd_source {
+    int fd;
+    unsigned size;
+};
+
+static int fd_source_produce(struct data_ring *ring, void *priv)
+{
+    struct fd_source *src = priv;
+    unsigned remaining = src->size;
+    unsigned len;
+    char *buf;
+
+    while (remaining > 0) {
+        buf = ring_get_slot(ring);
+        if (buf == NULL) {
+            return -1;
+        }
+        len = min(remaining, (unsigned) RING_BUF_SIZE);
+        if (read_all(src->fd, buf, len)) {
+            sprintf(ring->error, "read failed (%s)", strerror(errno));
+            return -1;
+        }
+        ring_put_slot(ring, len);
+        remaining -= len;
+    }
+
+    return 0;
+}
+
+static int send_fd_chunks(usb_handle *usb, int fd, unsigned size)
+{
+    struct data_ring ring;
+    struct fd_source src;
+    int r;
+
+    if (ring_init(&ring)) {
+        return -1;
+    }
+
+    src.fd = fd;
+    src.size = size;
+    ring.produce = fd_source_produce;
+    ring.priv = &src;
+
+    r = ring_send(usb, &ring);
+    ring_destroy(&ring);
+
+    return r;
+}
+
+/* sparse_file_callback() hands us chunk headers and data of arbitrary
+ * length; pack them into full ring slots so that the device sees large
+ * transfers regardless of how the image is fragmented.
+ */
+static int sparse_source_write(void *priv, const void *data, int len)
+{
+    struct data_ring *ring = priv;
+    const char *ptr = data;
+    unsigned to_copy;
+    char *buf;
+
+    while (len > 0) {
+        buf = ring_get_slot(ring);
+        if (buf == NULL) {
+            return -1;
+        }
+        to_copy = min((unsigned) len, RING_BUF_SIZE - ring->fill);
+        memcpy(buf + ring->fill, ptr, to_copy);
+        ring->fill += to_copy;
+        ptr += to_copy;
+        len -= to_copy;
+
+        if (ring->fill == RING_BUF_SIZE) {
+            ring_put_slot(ring, RING_BUF_SIZE);
+        }
+    }
+
+    return 0;
+}
+
+static int sparse_source_produce(struct data_ring *ring, void *priv)
+{
+    struct sparse_file *s = priv;
+    int r;
+
+    r = sparse_file_callback(s, true, false, sparse_source_write, ring);
+    if (r < 0) {
+        if (!ring_cancelled(ring)) {
+            sprintf(ring->error, "failed to generate sparse image");
+        }
+        return -1;
+    }
+
+    if (ring->fill > 0) {
+        ring_put_slot(ring, ring->fill);
+    }
+
+    return 0;
+}
+
+static int send_sparse_chunks(usb_handle *usb, struct sparse_file *s)
+{
+    struct data_ring ring;
+    int r;
+
+    if (ring_init(&ring)) {
+        return -1;
+    }
+
+    ring.produce = sparse_source_produce;
+    ring.priv = s;
+
+    r = ring_send(usb, &ring);
+    ring_destroy(&ring);
+
+    return r;
+}
+
+#else
+
+static int send_fd_chunks(usb_handle *usb, int fd, unsigned size)
+{
+    char *buf;
+    unsigned len;
+    int r = 0;
+
+    buf = malloc(FD_CHUNK_SIZE);
+    if (buf == 0) {
+        sprintf(ERROR, "out of memory");
+        return -1;
+    }
+
+    while (size > 0) {
+        len = min(size, (unsigned) FD_CHUNK_SIZE);
+        if (read_all(fd, buf, len)) {
+            sprintf(ERROR, "read failed (%s)", strerror(errno));
+            r = -1;
+            break;
+        }
+        if (_command_data(usb, buf, len) < 0) {
+            r = -1;
+            break;
+        }
+        size -= len;
+    }
+
+    free(buf);
+    return r;
+}
+
 #define USB_BUF_SIZE 1024
 static char usb_buf[USB_BUF_SIZE];
 static int usb_buf_len;
@@ -285,6 +641,92 @@ static int fb_download_data_sparse_flush(usb_handle *usb)
     return 0;
 }
 
+static int send_sparse_chunks(usb_handle *usb, struct sparse_file *s)
+{
+    int r;
+
+    r = sparse_file_callback(s, true, false, fb_download_data_sparse_write, usb);
+    if (r < 0) {
+        return -1;
+    }
+
+    return fb_download_data_sparse_flush(usb);
+}
+
+#endif
+
+int fb_command_upload(usb_handle *usb, const char *cmd, void **data,
+        unsigned max_size)
+{
+    unsigned char *buf;
+    int size;
+    int n;
+    int r;
+
+    size = _command_start(usb, cmd, max_size, 0);
+    if (size < 0) {
+        return -1;
+    }
+    if (size == 0) {
+        sprintf(ERROR, "no data");
+        return -1;
+    }
+
+    buf = malloc(size);
+    if (buf == NULL) {
+        sprintf(ERROR, "out of memory");
+        usb_close(usb);
+        return -1;
+    }
+
+    for (n = 0; n < size; n += r) {
+        r = usb_read(usb, buf + n, size - n);
+        if (r <= 0) {
+            sprintf(ERROR, "data transfer failure (%s)", strerror(errno));
+            usb_close(usb);
+            free(buf);
+            return -1;
+        }
+    }
+
+    if (_command_end(usb) < 0) {
+        free(buf);
+        return -1;
+    }
+
+    *data = buf;
+    return size;
+}
+
+int fb_download_data_fd(usb_handle *usb, int fd, int64_t offset, unsigned size)
+{
+    char cmd[64];
+    int r;
+
+    if (size == 0) {
+        sprintf(ERROR, "cannot send an empty image");
+        return -1;
+    }
+
+    if (lseek(fd, offset, SEEK_SET) != offset) {
+        sprintf(ERROR, "seek failed (%s)", strerror(errno));
+        return -1;
+    }
+
+    sprintf(cmd, "download:%08x", size);
+    r = _command_start(usb, cmd, size, 0);
+    if (r < 0) {
+        return -1;
+    }
+
+    r = send_fd_chunks(usb, fd, size);
+    if (r < 0) {
+        return -1;
+    }
+
+    return _command_end(usb);
+}
+
 int fb_download_data_sparse(usb_handle *usb, struct sparse_file *s)
 {
     char cmd[64];
@@ -300,12 +742,10 @@ int fb_download_data_sparse(usb_handle *usb, struct sparse_file *s)
         return -1;
     }
 
-    r = sparse_file_callback(s, true, false, fb_download_data_sparse_write, usb);
+    r = send_sparse_chunks(usb, s);
     if (r < 0) {
         return -1;
     }
 
-    fb_download_data_sparse_flush(usb);
-
     return _command_end(usb);
 }
@@ -20,6 +20,7 @@ LOCAL_C_INCLUDES := \
     external/openssl/include \
     external/mdnsresponder/mDNSShared \
     $(LOCAL_PATH)/include \
+    $(LOCAL_PATH)/../libsparse \
     external/zlib/ \
 
 LOCAL_SRC_FILES := \
@@ -50,6 +51,7 @@ LOCAL_STATIC_LIBRARIES := \
     libcrypto_static \
     libcutils \
     libmdnssd \
+    libmincrypt \
     libsparse_static \
     libz
 
@@ -39,6 +39,8 @@
 #include <sys/reboot.h>
 #include <fcntl.h>
 
+#include <mincrypt/sha256.h>
+
 #include "bootimg.h"
 #include "commands/boot.h"
 #include "commands/flash.h"
@@ -51,6 +53,9 @@
 
 #define ATAGS_LOCATION "/proc/atags"
 
+#define MAX_DOWNLOAD_SIZE (256 * 1024 * 1024)
+#define MAX_DOWNLOAD_SIZE_STR "0x10000000"
+
 static void cmd_boot(struct protocol_handle *phandle, const char *arg)
 {
     int sz, atags_sz, new_atags_sz;
@@ -334,6 +339,90 @@ static void cmd_flash(struct protocol_handle *phandle, const char *arg)
     fastboot_okay(phandle, "");
 }
 
+/*
+ * blockhash:<partition>:<block size>:<length>, sizes in hex
+ *
+ * Sends back the SHA-256 of each block of the first length bytes of the
+ * partition, so the host can flash only the blocks that changed.
+ */
+static void cmd_blockhash(struct protocol_handle *phandle, const char *arg)
+{
+    char name[64];
+    char path[PATH_MAX];
+    const char *sep;
+    char *end;
+    unsigned int block_size;
+    uint64_t len;
+    uint64_t count;
+    uint8_t *digests;
+    int partition;
+
+    sep = strchr(arg, ':');
+    if (sep == NULL || sep - arg >= (int) sizeof(name)) {
+        fastboot_fail(phandle, "bad arguments");
+        return;
+    }
+    memcpy(name, arg, sep - arg);
+    name[sep - arg] = '\0';
+
+    block_size = strtoul(sep + 1, &end, 16);
+    if (*end != ':' || block_size == 0) {
+        fastboot_fail(phandle, "bad block size");
+        return;
+    }
+    len = strtoull(end + 1, &end, 16);
+    if (*end != '\0' || len == 0) {
+        fastboot_fail(phandle, "bad length");
+        return;
+    }
+
+    if (flash_find_entry(name, path, PATH_MAX)) {
+        fastboot_fail(phandle, "partition table doesn't exist");
+        return;
+    }
+
+    partition = open(path, O_RDONLY);
+    if (partition < 0) {
+        fastboot_fail(phandle, "cannot open partition");
+        return;
+    }
+
+    if (len > get_file_size64(partition)) {
+        len = get_file_size64(partition);
+    }
+
+    count = (len + block_size - 1) / block_size;
+    if (count > MAX_DOWNLOAD_SIZE / SHA256_DIGEST_SIZE) {
+        close(partition);
+        fastboot_fail(phandle, "too many blocks");
+        return;
+    }
+
+    digests = malloc(count * SHA256_DIGEST_SIZE);
+    if (digests == NULL) {
+        close(partition);
+        fastboot_fail(phandle, "out of memory");
+        return;
+    }
+
+    if (flash_hash(partition, len, block_size, digests)) {
+        free(digests);
+        close(partition);
+        fastboot_fail(phandle, "partition read failure");
+        return;
+    }
+    close(partition);
+
+    if (protocol_handle_upload(phandle, (char *) digests, count * SHA256_DIGEST_SIZE)) {
+        free(digests);
+        fastboot_fail(phandle, "upload failure");
+        return;
+    }
+    free(digests);
+
+    fastboot_okay(phandle, "");
+}
+
 static void cmd_continue(struct protocol_handle *phandle, const char *arg)
 {
     fastboot_okay(phandle, "");
@@ -359,7 +448,7 @@ static void cmd_download(struct protocol_handle *phandle, const char *arg)
     unsigned len = strtoul(arg, NULL, 16);
     int old_fd;
 
-    if (len > 256 * 1024 * 1024) {
+    if (len > MAX_DOWNLOAD_SIZE) {
         fastboot_fail(phandle, "data too large");
         return;
     }
@@ -399,10 +488,17 @@ void commands_init()
     fastboot_register("boot", cmd_boot);
     fastboot_register("erase:", cmd_erase);
     fastboot_register("flash:", cmd_flash);
+    fastboot_register("blockhash:", cmd_blockhash);
     fastboot_register("continue", cmd_continue);
     fastboot_register("getvar:", cmd_getvar);
     fastboot_register("download:", cmd_download);
     fastboot_register("oem", cmd_oem);
+
+    // Lets the host split larger images into sparse pieces that are
+    // unpacked straight into the partition by flash_write
+    if (!strcmp(fastboot_getvar("max-download-size"), "")) {
+        fastboot_publish("max-download-size", MAX_DOWNLOAD_SIZE_STR);
+    }
     //fastboot_publish("version", "0.5");
     //fastboot_publish("product", "swordfish");
     //fastboot_publish("kernel", "lk");
@@ -30,9 +30,15 @@
  */
 
 #include <sys/stat.h>
+#include <sys/ioctl.h>
 #include <fcntl.h>
 #include <inttypes.h>
-#include <sys/mman.h>
+#include <linux/fs.h>
+#include <stdlib.h>
+
+#include <mincrypt/sha256.h>
+
+#include "sparse_format.h"
 
 #include "flash.h"
 #include "protocol.h"
@@ -48,6 +54,10 @@
 #define BUFFER_SIZE 1024 * 1024
 #define MIN(a, b) (a > b ? b : a)
 
+#ifndef BLKZEROOUT
+#define BLKZEROOUT _IO(0x12,127)
+#endif
+
 
 int flash_find_entry(const char *name, char *out, size_t outlen)
 {
@@ -88,32 +98,396 @@ int flash_erase(int fd)
     return wipe_block_device(fd, size);
 }
 
+static int write_all_at(int fd, const char *buf, size_t len, uint64_t offset)
+{
+    ssize_t ret;
+
+    while (len > 0) {
+        ret = TEMP_FAILURE_RETRY(pwrite64(fd, buf, len, offset));
+        if (ret <= 0) {
+            D(ERR, "write to partition at %"PRIu64" failed: %s", offset, strerror(errno));
+            return -1;
+        }
+        buf += ret;
+        len -= ret;
+        offset += ret;
+    }
+
+    return 0;
+}
+
+/*
+ * Incremental decoder for Android sparse images.  Input may be fed in
+ * pieces of any size; chunks are applied to the partition as soon as
+ * their bytes arrive, so the expanded image is never held in memory.
+ */
+enum sparse_state {
+    SPARSE_FILE_HEADER,
+    SPARSE_CHUNK_HEADER,
+    SPARSE_SKIP,            /* header bytes beyond the structs we know */
+    SPARSE_CHUNK_DATA,
+    SPARSE_DONE,
+};
+
+struct sparse_writer {
+    int fd;
+    uint64_t partition_size;
+    uint64_t offset;
+
+    enum sparse_state state;
+    enum sparse_state after_skip;
+    sparse_header_t header;
+    chunk_header_t chunk;
+    char hdr_buf[sizeof(sparse_header_t)];
+    size_t hdr_len;         /* bytes of the current header collected */
+    size_t skip;            /* bytes left to skip in SPARSE_SKIP */
+    uint64_t data_left;     /* bytes of chunk data still expected */
+    uint32_t value;         /* fill value or crc being collected */
+    unsigned chunks_left;
+    char *fill_buf;
+};
+
+/* Fills len bytes at the current offset with a 32 bit pattern.  Zero
+ * fills are handed to the block layer, which can usually satisfy them
+ * without transferring any data. */
+static int sparse_writer_fill(struct sparse_writer *w, uint32_t value, uint64_t len)
+{
+    uint64_t range[2];
+    uint32_t *p;
+    size_t n;
+    unsigned i;
+
+    if (value == 0) {
+        range[0] = w->offset;
+        range[1] = len;
+        if (ioctl(w->fd, BLKZEROOUT, &range) == 0) {
+            w->offset += len;
+            return 0;
+        }
+        D(VERBOSE, "BLKZEROOUT failed, writing zeros: %s", strerror(errno));
+    }
+
+    if (w->fill_buf == NULL) {
+        w->fill_buf = malloc(BUFFER_SIZE);
+        if (w->fill_buf == NULL) {
+            D(ERR, "out of memory");
+            return -1;
+        }
+    }
+
+    p = (uint32_t *) w->fill_buf;
+    for (i = 0; i < BUFFER_SIZE / sizeof(value); i++) {
+        p[i] = value;
+    }
+
+    while (len > 0) {
+        n = MIN(len, (uint64_t) BUFFER_SIZE);
+        if (write_all_at(w->fd, w->fill_buf, n, w->offset)) {
+            return -1;
+        }
+        w->offset += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+static void sparse_writer_skip(struct sparse_writer *w, size_t skip,
+        enum sparse_state next)
+{
+    w->hdr_len = 0;
+    w->skip = skip;
+    w->after_skip = next;
+    w->state = SPARSE_SKIP;
+}
+
+static int sparse_writer_parse_header(struct sparse_writer *w)
+{
+    sparse_header_t *h = &w->header;
+
+    memcpy(h, w->hdr_buf, sizeof(*h));
+    if (h->magic != SPARSE_HEADER_MAGIC ||
+            h->file_hdr_sz < sizeof(sparse_header_t) ||
+            h->chunk_hdr_sz < sizeof(chunk_header_t) ||
+            h->blk_sz == 0 || h->blk_sz % 4) {
+        D(ERR, "invalid sparse image header");
+        return -1;
+    }
+
+    w->chunks_left = h->total_chunks;
+    sparse_writer_skip(w, h->file_hdr_sz - sizeof(sparse_header_t),
+            w->chunks_left ? SPARSE_CHUNK_HEADER : SPARSE_DONE);
+
+    return 0;
+}
+
+static int sparse_writer_parse_chunk(struct sparse_writer *w)
+{
+    chunk_header_t *c = &w->chunk;
+    uint64_t out_len;
+
+    memcpy(c, w->hdr_buf, sizeof(*c));
+    out_len = (uint64_t) c->chunk_sz * w->header.blk_sz;
+
+    if (c->total_sz < w->header.chunk_hdr_sz) {
+        D(ERR, "sparse chunk size %u too small", c->total_sz);
+        return -1;
+    }
+    w->data_left = c->total_sz - w->header.chunk_hdr_sz;
+
+    if (c->chunk_type != CHUNK_TYPE_CRC32 &&
+            w->offset + out_len > w->partition_size) {
+        D(ERR, "sparse image exceeds partition size");
+        return -1;
+    }
+
+    switch (c->chunk_type) {
+    case CHUNK_TYPE_RAW:
+        if (w->data_left != out_len) {
+            D(ERR, "bad raw chunk size %u", c->total_sz);
+            return -1;
+        }
+        break;
+    case CHUNK_TYPE_FILL:
+    case CHUNK_TYPE_CRC32:
+        if (w->data_left != sizeof(w->value)) {
+            D(ERR, "bad chunk size %u for type %x", c->total_sz, c->chunk_type);
+            return -1;
+        }
+        w->value = 0;
+        break;
+    case CHUNK_TYPE_DONT_CARE:
+        if (w->data_left != 0) {
+            D(ERR, "bad don't care chunk size %u", c->total_sz);
+            return -1;
+        }
+        w->offset += out_len;
+        break;
+    default:
+        D(ERR, "unknown sparse chunk type %x", c->chunk_type);
+        return -1;
+    }
+
+    sparse_writer_skip(w, w->header.chunk_hdr_sz - sizeof(chunk_header_t),
+            SPARSE_CHUNK_DATA);
+
+    return 0;
+}
+
+static int sparse_writer_end_chunk(struct sparse_writer *w)
+{
+    if (w->chunk.chunk_type == CHUNK_TYPE_FILL) {
+        if (sparse_writer_fill(w, w->value,
+                    (uint64_t) w->chunk.chunk_sz * w->header.blk_sz)) {
+            return -1;
+        }
+    }
+
+    w->chunks_left--;
+    w->hdr_len = 0;
+    w->state = w->chunks_left ? SPARSE_CHUNK_HEADER : SPARSE_DONE;
+
+    return 0;
+}
+
+/* Takes the state transitions that need no further input */
+static int sparse_writer_settle(struct sparse_writer *w)
+{
+    for (;;) {
+        if (w->state == SPARSE_SKIP && w->skip == 0) {
+            w->state = w->after_skip;
+        } else if (w->state == SPARSE_CHUNK_DATA && w->data_left == 0) {
+            if (sparse_writer_end_chunk(w)) {
+                return -1;
+            }
+        } else {
+            return 0;
+        }
+    }
+}
+
+static int sparse_writer_write(struct sparse_writer *w, const char *buf, size_t len)
+{
+    size_t want;
+    size_t n;
+    size_t i;
+    int ret = 0;
+
+    while (len > 0 && ret == 0) {
+        switch (w->state) {
+        case SPARSE_FILE_HEADER:
+        case SPARSE_CHUNK_HEADER:
+            want = (w->state == SPARSE_FILE_HEADER) ?
+                    sizeof(sparse_header_t) : sizeof(chunk_header_t);
+            n = MIN(len, want - w->hdr_len);
+            memcpy(w->hdr_buf + w->hdr_len, buf, n);
+            w->hdr_len += n;
+            if (w->hdr_len == want) {
+                ret = (w->state == SPARSE_FILE_HEADER) ?
+                        sparse_writer_parse_header(w) :
+                        sparse_writer_parse_chunk(w);
+            }
+            break;
+        case SPARSE_SKIP:
+            n = MIN(len, w->skip);
+            w->skip -= n;
+            break;
+        case SPARSE_CHUNK_DATA:
+            n = MIN((uint64_t) len, w->data_left);
+            if (w->chunk.chunk_type == CHUNK_TYPE_RAW) {
+                ret = write_all_at(w->fd, buf, n, w->offset);
+                w->offset += n;
+            } else {
+                /* fill value or crc, possibly split across calls */
+                for (i = 0; i < n; i++) {
+                    size_t pos = sizeof(w->value) - w->data_left + i;
+                    w->value |= (uint32_t)(unsigned char) buf[i] << (8 * pos);
+                }
+            }
+            w->data_left -= n;
+            break;
+        case SPARSE_DONE:
+        default:
+            D(WARN, "ignoring %zu bytes after end of sparse image", len);
+            return 0;
+        }
+
+        if (ret == 0) {
+            ret = sparse_writer_settle(w);
+        }
+        buf += n;
+        len -= n;
+    }
+
+    return ret;
+}
+
+static int is_sparse_image(int data_fd, ssize_t skip)
+{
+    uint32_t magic;
+
+    if (pread64(data_fd, &magic, sizeof(magic), skip) != sizeof(magic)) {
+        return 0;
+    }
+
+    return magic == SPARSE_HEADER_MAGIC;
+}
+
 int flash_write(int partition_fd, int data_fd, ssize_t size, ssize_t skip)
 {
     ssize_t written = 0;
-    struct GPT_mapping input;
-    struct GPT_mapping output;
+    ssize_t ret;
+    struct sparse_writer writer;
+    int sparse;
+    char *buffer;
+
+    buffer = malloc(BUFFER_SIZE);
+    if (buffer == NULL) {
+        D(ERR, "out of memory");
+        return -1;
+    }
+
+    memset(&writer, 0, sizeof(writer));
+    sparse = is_sparse_image(data_fd, skip);
+    if (sparse) {
+        writer.fd = partition_fd;
+        writer.partition_size = get_file_size64(partition_fd);
+        writer.state = SPARSE_FILE_HEADER;
+        D(INFO, "unpacking sparse image");
+    }
 
     while (written < size) {
         int current_size = MIN(size - written, BUFFER_SIZE);
 
-        if (gpt_mmap(&input, written + skip, current_size, data_fd)) {
-            D(ERR, "Error in writing data, unable to map data file %zd at %zd size %d", size, skip, current_size);
-            return -1;
+        ret = TEMP_FAILURE_RETRY(pread64(data_fd, buffer, current_size, written + skip));
+        if (ret <= 0) {
+            D(ERR, "Error in writing data, unable to read data file %zd at %zd size %d",
+                    size, written + skip, current_size);
+            goto err;
+        }
+
+        if (sparse) {
+            if (sparse_writer_write(&writer, buffer, ret)) {
+                goto err;
+            }
+        } else if (write_all_at(partition_fd, buffer, ret, written)) {
+            goto err;
         }
-        if (gpt_mmap(&output, written, current_size, partition_fd)) {
-            D(ERR, "Error in writing data, unable to map output partition");
+
+        written += ret;
+    }
+
+    if (sparse && writer.state != SPARSE_DONE) {
+        D(ERR, "truncated sparse image");
+        goto err;
+    }
+
+    if (fsync(partition_fd)) {
+        D(WARN, "fsync of partition failed: %s", strerror(errno));
+    }
+
+    free(writer.fill_buf);
+    free(buffer);
+    return 0;
+
+err:
+    free(writer.fill_buf);
+    free(buffer);
+    return -1;
+}
+
+/* Stores the SHA-256 of each block_size piece of the first size bytes of the
+ * partition in digests, the last piece may be short.  Used by the host to
+ * send only the blocks of an image that differ from what is already there.
+ */
+int flash_hash(int partition_fd, uint64_t size, unsigned int block_size,
+        uint8_t *digests)
+{
+    SHA256_CTX ctx;
+    uint64_t offset = 0;
+    unsigned int in_block = 0;
+    ssize_t ret;
+    char *buffer;
+
+    buffer = malloc(BUFFER_SIZE);
+    if (buffer == NULL) {
+        D(ERR, "out of memory");
+        return -1;
+    }
+
+    SHA256_init(&ctx);
+    while (offset < size) {
+        int current_size = MIN(size - offset, BUFFER_SIZE);
+        int pos = 0;
+
+        ret = TEMP_FAILURE_RETRY(pread64(partition_fd, buffer, current_size, offset));
+        if (ret <= 0) {
+            D(ERR, "unable to read partition at %"PRIu64, offset);
+            free(buffer);
             return -1;
         }
+        offset += ret;
 
-        memcpy(output.ptr, input.ptr, current_size);
+        while (pos < ret) {
+            int n = MIN((unsigned int)(ret - pos), block_size - in_block);
 
-        gpt_unmap(&input);
-        gpt_unmap(&output);
+            SHA256_update(&ctx, buffer + pos, n);
+            pos += n;
+            in_block += n;
+            if (in_block == block_size) {
+                memcpy(digests, SHA256_final(&ctx), SHA256_DIGEST_SIZE);
+                digests += SHA256_DIGEST_SIZE;
+                SHA256_init(&ctx);
+                in_block = 0;
+            }
+        }
+    }
 
-        written += current_size;
+    if (in_block) {
+        memcpy(digests, SHA256_final(&ctx), SHA256_DIGEST_SIZE);
     }
 
+    free(buffer);
     return 0;
 }
 
@@ -34,6 +34,7 @@
 
 #include <unistd.h>
 #include <errno.h>
+#include <stdint.h>
 #include <string.h>
 #include "debug.h"
 
@@ -49,6 +50,8 @@ static inline int flash_close(int fd) {
 }
 
 int flash_write(int partition, int data, ssize_t size, ssize_t skip);
+int flash_hash(int partition, uint64_t size, unsigned int block_size,
+        uint8_t *digests);
 
 static inline ssize_t read_data_once(int fd, char *buffer, ssize_t size) {
     ssize_t readcount = 0;
@@ -148,6 +148,26 @@ void fastboot_data(struct protocol_handle *phandle, size_t len)
         return;
 }
 
+int protocol_handle_upload(struct protocol_handle *phandle, const char *data,
+        size_t len)
+{
+    ssize_t ret;
+
+    fastboot_data(phandle, len);
+
+    while (len > 0) {
+        ret = protocol_handle_write(phandle, (char *)data, len);
+        if (ret <= 0) {
+            D(ERR, "upload failed with %zu bytes left", len);
+            return -1;
+        }
+        data += ret;
+        len -= ret;
+    }
+
+    return 0;
+}
+
 void protocol_handle_command(struct protocol_handle *phandle, char *buffer)
 {
     D(INFO,"fastboot: %s\n", buffer);
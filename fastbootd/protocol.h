@@ -53,6 +53,8 @@ struct protocol_handle *create_protocol_handle(struct transport_handle *t);
 void protocol_handle_command(struct protocol_handle *handle, char *buffer);
 int protocol_handle_download(struct protocol_handle *phandle, size_t len);
 int protocol_get_download(struct protocol_handle *phandle);
+int protocol_handle_upload(struct protocol_handle *phandle, const char *data,
+        size_t len);
 
 void fastboot_fail(struct protocol_handle *handle, const char *reason);
 void fastboot_okay(struct protocol_handle *handle, const char *reason);
@@ -106,6 +106,14 @@ int32_t property_get_int32(const char *key, int32_t default_value);
 /* property_set: returns 0 on success, < 0 on failure
 */
 int property_set(const char *key, const char *value);
+
+/* property_set_batch: sets keys[i] to values[i] for each of the count
+** properties, over a single connection to the property service.  If
+** results is not NULL, results[i] receives 0 or < 0 for each property.
+** Returns 0 if every property was set, < 0 otherwise.
+*/
+int property_set_batch(const char * const *keys, const char * const *values,
+                       size_t count, int *results);
     
 int property_list(void (*propfn)(const char *key, const char *value, void *cookie), void *cookie);    
 
@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SYSTEM_CORE_INCLUDE_PRIVATE_ANDROID_PROPERTY_BATCH_H
+#define _SYSTEM_CORE_INCLUDE_PRIVATE_ANDROID_PROPERTY_BATCH_H
+
+/*
+ * Batched property sets, spoken between property_set_batch() in libcutils
+ * and init's property service.
+ *
+ * The client opens one connection and sends a prop_msg whose cmd is
+ * PROP_MSG_SETPROP_BATCH and whose value holds, in decimal, the number of
+ * properties that follow.  Each property is then sent as an ordinary
+ * PROP_MSG_SETPROP prop_msg, and the service answers each one, once it has
+ * been handled, with an int32_t that is 0 on success and < 0 on failure.
+ * The caller's credentials and security context are looked up once for
+ * the whole batch.
+ *
+ * A service that predates batching closes the connection after the first
+ * message, which tells the client to fall back to one property per
+ * connection.
+ */
+#define PROP_MSG_SETPROP_BATCH  0x100
+
+/* Largest number of properties in a single batch */
+#define PROP_BATCH_MAX          256
+
+#endif
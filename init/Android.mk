@@ -23,9 +23,11 @@ LOCAL_PATH:= $(call my-dir)
 include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES:= \
+	boottrace.c \
 	builtins.c \
 	init.c \
 	devices.c \
+	event_loop.c \
 	property_service.c \
 	util.c \
 	parser.c \
@@ -39,10 +41,10 @@ LOCAL_SRC_FILES:= \
 
 LOCAL_CFLAGS    += -Wno-unused-parameter
 
-#ifeq ($(strip $(INIT_BOOTCHART)),true)
+ifeq ($(strip $(INIT_BOOTCHART)),true)
 LOCAL_SRC_FILES += bootchart.c
 LOCAL_CFLAGS    += -DBOOTCHART=1
-#endif
+endif
 
 ifneq (,$(filter userdebug eng,$(TARGET_BUILD_VARIANT)))
 LOCAL_CFLAGS += -DALLOW_LOCAL_PROP_OVERRIDE=1 -DALLOW_DISABLE_SELINUX=1
@@ -101,3 +103,10 @@ ALL_DEFAULT_INSTALLED_MODULES += $(SYMLINKS)
 # local module name
 ALL_MODULES.$(LOCAL_MODULE).INSTALLED := \
     $(ALL_MODULES.$(LOCAL_MODULE).INSTALLED) $(SYMLINKS)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := boottrace2bootchart.py
+LOCAL_SRC_FILES := boottrace2bootchart.py
+LOCAL_MODULE_CLASS := EXECUTABLES
+LOCAL_IS_HOST_MODULE := true
+include $(BUILD_PREBUILT)
@@ -0,0 +1,153 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Boot tracing records what init does as it does it -- services starting
+ * and exiting, actions and the time their commands take, property
+ * triggers and the coldboot walk -- into a fixed ring of small records.
+ * Nothing is sampled and nothing is written out until the trace is
+ * dumped, so the boot being measured is barely disturbed.
+ *
+ * boottrace2bootchart.py turns a dump into a bootchart tarball.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "boottrace.h"
+#include "log.h"
+
+#define BOOTTRACE_EVENTS    4096
+
+static struct boottrace_event events[BOOTTRACE_EVENTS];
+static unsigned int next_event;     /* total ever recorded */
+
+uint64_t boottrace_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void boottrace_event(int type, const char *name, uint32_t arg)
+{
+    struct boottrace_event *ev = &events[next_event++ % BOOTTRACE_EVENTS];
+
+    ev->time_ns = boottrace_now();
+    ev->arg = arg;
+    ev->type = type;
+    ev->reserved = 0;
+    strncpy(ev->name, name ? name : "", sizeof(ev->name));
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    ssize_t n;
+
+    while (len > 0) {
+        n = TEMP_FAILURE_RETRY(write(fd, p, len));
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Writes the events of another trace file, such as the one ueventd leaves
+ * behind, after our own; returns how many there were.
+ */
+static int merge_trace(int fd, const char *merge_path)
+{
+    struct boottrace_header hdr;
+    struct boottrace_event ev;
+    unsigned int i;
+    int count = 0;
+    int in;
+
+    in = open(merge_path, O_RDONLY | O_CLOEXEC);
+    if (in < 0)
+        return 0;
+
+    if (TEMP_FAILURE_RETRY(read(in, &hdr, sizeof(hdr))) == sizeof(hdr) &&
+            hdr.magic == BOOTTRACE_MAGIC && hdr.version == BOOTTRACE_VERSION &&
+            hdr.event_size == sizeof(ev)) {
+        for (i = 0; i < hdr.count; i++) {
+            if (TEMP_FAILURE_RETRY(read(in, &ev, sizeof(ev))) != sizeof(ev) ||
+                    write_all(fd, &ev, sizeof(ev)) < 0)
+                break;
+            count++;
+        }
+    }
+
+    close(in);
+    return count;
+}
+
+int boottrace_write(const char *path, const char *merge_path)
+{
+    struct boottrace_header hdr;
+    unsigned int first;
+    unsigned int count;
+    unsigned int i;
+    int fd;
+
+    count = next_event < BOOTTRACE_EVENTS ? next_event : BOOTTRACE_EVENTS;
+    first = next_event - count;
+
+    if (!strncmp(path, BOOTTRACE_DIR "/", strlen(BOOTTRACE_DIR "/")))
+        mkdir(BOOTTRACE_DIR, 0700);
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        ERROR("cannot write boot trace %s errno: %d\n", path, errno);
+        return -1;
+    }
+
+    hdr.magic = BOOTTRACE_MAGIC;
+    hdr.version = BOOTTRACE_VERSION;
+    hdr.event_size = sizeof(struct boottrace_event);
+    hdr.count = count;
+    if (write_all(fd, &hdr, sizeof(hdr)) < 0)
+        goto err;
+
+    /* the ring, oldest event first */
+    for (i = 0; i < count; i++) {
+        if (write_all(fd, &events[(first + i) % BOOTTRACE_EVENTS],
+                      sizeof(struct boottrace_event)) < 0)
+            goto err;
+    }
+
+    if (merge_path) {
+        hdr.count += merge_trace(fd, merge_path);
+        if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+            goto err;
+    }
+
+    close(fd);
+    NOTICE("boot trace of %u events written to %s\n", hdr.count, path);
+    return 0;
+
+err:
+    ERROR("cannot write boot trace %s errno: %d\n", path, errno);
+    close(fd);
+    return -1;
+}
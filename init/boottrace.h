@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _INIT_BOOTTRACE_H
+#define _INIT_BOOTTRACE_H
+
+#include <stdint.h>
+
+/* Kinds of boot trace events, and what their name and arg hold */
+enum {
+    BOOTTRACE_SERVICE_START = 1,    /* service name, pid */
+    BOOTTRACE_SERVICE_EXIT  = 2,    /* service name, pid */
+    BOOTTRACE_ACTION        = 3,    /* trigger of the action, 0 */
+    BOOTTRACE_COMMAND       = 4,    /* command and first argument, duration in us */
+    BOOTTRACE_PROPERTY      = 5,    /* property name, number of actions queued */
+    BOOTTRACE_COLDBOOT      = 6,    /* /sys tree walked, duration in us */
+};
+
+#define BOOTTRACE_NAME_LEN  40
+
+/* One record of a trace file; the file starts with a boottrace_header */
+struct boottrace_event {
+    uint64_t time_ns;               /* CLOCK_MONOTONIC */
+    uint32_t arg;
+    uint16_t type;
+    uint16_t reserved;
+    char name[BOOTTRACE_NAME_LEN];  /* NUL padded, may fill the array */
+};
+
+#define BOOTTRACE_MAGIC     0x43525442  /* "BTRC" */
+#define BOOTTRACE_VERSION   1
+
+struct boottrace_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t event_size;
+    uint32_t count;
+};
+
+#define BOOTTRACE_DIR           "/data/boottrace"
+#define BOOTTRACE_FILE          BOOTTRACE_DIR "/trace"
+#define BOOTTRACE_UEVENTD_FILE  "/dev/.boottrace-ueventd"
+
+extern uint64_t boottrace_now(void);
+extern void boottrace_event(int type, const char *name, uint32_t arg);
+extern int boottrace_write(const char *path, const char *merge_path);
+
+#endif /* _INIT_BOOTTRACE_H */
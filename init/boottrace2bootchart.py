@@ -0,0 +1,207 @@
+#! /usr/bin/env python
+
+# Copyright (C) 2014 The Android Open Source Project
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Converts a boot trace written by init (see boottrace.h) into the
+# bootchart.tgz layout read by the bootchart renderer. Services become
+# processes that live from their start event to their exit event, and
+# the CPU graph shows how much of each sample period init spent running
+# commands.
+
+from __future__ import print_function
+import getopt, io, posixpath, signal, struct, sys, tarfile
+
+BOOTTRACE_MAGIC = 0x43525442
+BOOTTRACE_VERSION = 1
+
+SERVICE_START = 1
+SERVICE_EXIT = 2
+ACTION = 3
+COMMAND = 4
+PROPERTY = 5
+COLDBOOT = 6
+
+TYPE_NAMES = {
+  SERVICE_START: "start",
+  SERVICE_EXIT: "exit",
+  ACTION: "action",
+  COMMAND: "command",
+  PROPERTY: "property",
+  COLDBOOT: "coldboot",
+}
+
+HEADER = struct.Struct("<IIII")
+EVENT = struct.Struct("<QIHH40s")
+
+def usage(argv0):
+  print("""
+Usage: %s [-v] [-p period_ms] [-o bootchart.tgz] trace_file
+ -v             print the events as they are read
+ -p period_ms   sample period of the generated chart (default 200)
+ -o file        output file (default bootchart.tgz)
+""" % ( argv0 ))
+  sys.exit(2)
+
+def read_trace(path):
+  with open(path, "rb") as f:
+    data = f.read()
+  if len(data) < HEADER.size:
+    raise ValueError("%s: truncated header" % path)
+  magic, version, event_size, count = HEADER.unpack_from(data, 0)
+  if magic != BOOTTRACE_MAGIC or version != BOOTTRACE_VERSION:
+    raise ValueError("%s: not a boot trace" % path)
+  if event_size != EVENT.size:
+    raise ValueError("%s: unexpected event size %d" % (path, event_size))
+
+  events = []
+  offset = HEADER.size
+  for i in range(count):
+    if offset + EVENT.size > len(data):
+      break
+    time_ns, arg, type, _, name = EVENT.unpack_from(data, offset)
+    offset += EVENT.size
+    name = name.split(b"\0", 1)[0].decode("utf-8", "replace")
+    events.append((time_ns, type, name, arg))
+
+  # ueventd's events are appended after init's; put them in time order
+  events.sort(key=lambda e: e[0])
+  return events
+
+def jiffies(ns):
+  return ns // 10000000
+
+def build_chart(events, period_ns):
+  first = events[0][0]
+  last = events[-1][0]
+
+  # processes: pid -> [name, start, end]
+  procs = {}
+  for time_ns, type, name, arg in events:
+    if type == SERVICE_START:
+      procs[arg] = [name, time_ns, None]
+    elif type == SERVICE_EXIT and arg in procs:
+      procs[arg][2] = time_ns
+
+  # command time, attributed to the sample period in which it ended
+  busy = {}
+  for time_ns, type, name, arg in events:
+    if type in (COMMAND, COLDBOOT):
+      slot = (time_ns - first) // period_ns
+      busy[slot] = busy.get(slot, 0) + arg * 1000
+
+  stat = []
+  ps = []
+  disk = []
+  user = idle = 0
+  samples = (last - first) // period_ns + 2
+  for slot in range(samples):
+    now = first + slot * period_ns
+    stamp = "%d\n" % jiffies(now)
+
+    used = min(busy.get(slot, 0), period_ns)
+    user += jiffies(used)
+    idle += jiffies(period_ns - used)
+    stat.append(stamp)
+    stat.append("cpu  %d 0 0 %d 0 0 0 0 0 0\n\n" % (user, idle))
+
+    ps.append(stamp)
+    ps.append("1 (init) S 0 0 0 0 -1 0 0 0 0 0 %d 0 0 0 20 0 1 0 0 0 0\n" %
+              user)
+    for pid in sorted(procs):
+      name, start, end = procs[pid]
+      if start > now or (end is not None and end < now):
+        continue
+      ps.append("%d (%s) S 1 0 0 0 -1 0 0 0 0 0 0 0 0 0 20 0 1 0 %d 0 0\n" %
+                (pid, name[:15], jiffies(start)))
+    ps.append("\n")
+
+    disk.append(stamp)
+    disk.append("\n")
+
+  return "".join(stat), "".join(ps), "".join(disk)
+
+def add_file(tar, name, text):
+  data = text.encode("utf-8")
+  info = tarfile.TarInfo(name)
+  info.size = len(data)
+  tar.addfile(info, io.BytesIO(data))
+
+def main():
+
+  signal.signal(signal.SIGPIPE, signal.SIG_DFL)
+
+  me = posixpath.basename(sys.argv[0])
+
+  # Parse the command line
+  verbose = 0                   # -v
+  period_ms = 200               # -p
+  output = "bootchart.tgz"      # -o
+  try:
+    opts, args = getopt.getopt(sys.argv[1:],
+                               "vp:o:",
+                               ["verbose", "period=", "output="])
+  except getopt.GetoptError as e:
+    print(e)
+    usage(me)
+  for o, a in opts:
+    if o in ("-v", "--verbose"):
+      verbose += 1
+    elif o in ("-p", "--period"):
+      period_ms = int(a)
+    elif o in ("-o", "--output"):
+      output = a
+    else:
+      print("Unrecognized option \"%s\"" % (o))
+      usage(me)
+
+  if len(args) != 1 or period_ms <= 0:
+    print("Expected one trace file and a positive period")
+    usage(me)
+
+  try:
+    events = read_trace(args[0])
+  except (IOError, ValueError) as e:
+    print(e)
+    sys.exit(1)
+  if not events:
+    print("%s: no events" % args[0])
+    sys.exit(1)
+
+  if verbose:
+    for time_ns, type, name, arg in events:
+      print("%12.6f %-8s %-40s %d" % ((time_ns - events[0][0]) / 1e9,
+            TYPE_NAMES.get(type, str(type)), name, arg))
+
+  stat, ps, disk = build_chart(events, period_ms * 1000000)
+
+  header = ("version = Android boot trace\n"
+            "title = Boot chart (from boot trace)\n"
+            "system.uname = Android\n"
+            "system.release = \n"
+            "system.cpu = \n"
+            "system.kernel.options = \n")
+
+  tar = tarfile.open(output, "w:gz")
+  add_file(tar, "header", header)
+  add_file(tar, "proc_stat.log", stat)
+  add_file(tar, "proc_ps.log", ps)
+  add_file(tar, "proc_diskstats.log", disk)
+  tar.close()
+
+  print("%s: %d events, %d services" %
+        (output, len(events), len([e for e in events if e[1] == SERVICE_START])))
+
+if __name__ == "__main__":
+  main()
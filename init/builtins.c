@@ -194,7 +194,7 @@ done:
 static void service_start_if_not_disabled(struct service *svc)
 {
     if (!(svc->flags & SVC_DISABLED)) {
-        service_start(svc, NULL);
+        service_request_start(svc);
     } else {
         svc->flags |= SVC_DISABLED_START;
     }
@@ -219,6 +219,7 @@ int do_class_start(int nargs, char **args)
          * be started individually.
          */
     service_for_each_class(args[1], service_start_if_not_disabled);
+    service_start_waiting();
     return 0;
 }
 
@@ -698,6 +699,9 @@ int do_powerctl(int nargs, char **args)
         return -EINVAL;
     }
 
+    /* don't lose persistent properties still waiting to be written */
+    flush_persistent_properties();
+
     return android_reboot(cmd, 0, reboot_target);
 }
 
@@ -860,14 +864,10 @@ int do_restorecon(int nargs, char **args) {
 }
 
 int do_restorecon_recursive(int nargs, char **args) {
-    int i;
-    int ret = 0;
-
-    for (i = 1; i < nargs; i++) {
-        if (restorecon_recursive(args[i]) < 0)
-            ret = -errno;
-    }
-    return ret;
+    /* nested or repeated paths are only walked once */
+    if (restorecon_recursive_batch((const char **) &args[1], nargs - 1) < 0)
+        return -errno;
+    return 0;
 }
 
 int do_setsebool(int nargs, char **args) {
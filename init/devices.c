@@ -24,9 +24,13 @@
 
 #include <fcntl.h>
 #include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <poll.h>
 #include <unistd.h>
 #include <string.h>
 
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <linux/netlink.h>
@@ -43,6 +47,7 @@
 #include <cutils/list.h>
 #include <cutils/uevent.h>
 
+#include "boottrace.h"
 #include "devices.h"
 #include "ueventd_parser.h"
 #include "util.h"
@@ -85,7 +90,27 @@ struct perms_ {
 
 struct perm_node {
     struct perms_ dp;
-    struct listnode plist;
+    const char *key;            /* name that paths are matched against */
+    unsigned int index;         /* later rules override earlier ones */
+    struct perm_node *next;
+};
+
+/* Prefix and wildcard rules hang off the node for the literal text that
+ * their name starts with, so only rules whose literal part matches the
+ * path ever get compared with it.
+ */
+struct perm_trie {
+    char c;
+    struct perm_trie *child;
+    struct perm_trie *sibling;
+    struct perm_node *rules;
+};
+
+#define PERM_HASH_SIZE 256
+
+struct perm_table {
+    struct perm_node *exact[PERM_HASH_SIZE];
+    struct perm_trie root;
 };
 
 struct platform_node {
@@ -95,10 +120,93 @@ struct platform_node {
     struct listnode list;
 };
 
-static list_declare(sys_perms);
-static list_declare(dev_perms);
+static struct perm_table sys_perms;
+static struct perm_table dev_perms;
+static unsigned int perm_count;
 static list_declare(platform_names);
 
+static unsigned int perm_hash(const char *key)
+{
+    unsigned int hash = 5381;
+
+    while (*key)
+        hash = hash * 33 + (unsigned char)*key++;
+    return hash % PERM_HASH_SIZE;
+}
+
+static void perm_append(struct perm_node **head, struct perm_node *node)
+{
+    while (*head)
+        head = &(*head)->next;
+    *head = node;
+}
+
+static int perm_table_add(struct perm_table *table, struct perm_node *node)
+{
+    struct perm_trie *trie = &table->root;
+    struct perm_trie **child;
+    const char *key = node->key;
+    size_t len;
+
+    if (!node->dp.prefix && !node->dp.wildcard) {
+        perm_append(&table->exact[perm_hash(key)], node);
+        return 0;
+    }
+
+    len = node->dp.prefix ? strlen(key) : strcspn(key, "*?[\\");
+    while (len--) {
+        for (child = &trie->child; *child; child = &(*child)->sibling) {
+            if ((*child)->c == *key)
+                break;
+        }
+        if (!*child) {
+            *child = calloc(1, sizeof(**child));
+            if (!*child)
+                return -ENOMEM;
+            (*child)->c = *key;
+        }
+        trie = *child;
+        key++;
+    }
+
+    perm_append(&trie->rules, node);
+    return 0;
+}
+
+/* Calls func for every rule in table that matches path, in no particular
+ * order; callers that care use the rules' index.
+ */
+static void perm_table_match(struct perm_table *table, const char *path,
+                             void (*func)(struct perm_node *node, void *cookie),
+                             void *cookie)
+{
+    struct perm_trie *trie = &table->root;
+    struct perm_node *node;
+    const char *p = path;
+
+    for (node = table->exact[perm_hash(path)]; node; node = node->next) {
+        if (!strcmp(path, node->key))
+            func(node, cookie);
+    }
+
+    for (;;) {
+        for (node = trie->rules; node; node = node->next) {
+            if (node->dp.prefix ||
+                    fnmatch(node->key, path, FNM_PATHNAME) == 0)
+                func(node, cookie);
+        }
+        if (!*p)
+            break;
+        for (trie = trie->child; trie; trie = trie->sibling) {
+            if (trie->c == *p)
+                break;
+        }
+        if (!trie)
+            break;
+        p++;
+    }
+}
+
 int add_dev_perms(const char *name, const char *attr,
                   mode_t perm, unsigned int uid, unsigned int gid,
                   unsigned short prefix,
@@ -122,36 +230,115 @@ int add_dev_perms(const char *name, const char *attr,
     node->dp.gid = gid;
     node->dp.prefix = prefix;
     node->dp.wildcard = wildcard;
+    node->index = perm_count++;
 
-    if (attr)
-        list_add_tail(&sys_perms, &node->plist);
-    else
-        list_add_tail(&dev_perms, &node->plist);
+    /* upaths omit the "/sys" that /sys rules contain */
+    if (attr) {
+        node->key = node->dp.name + 4;
+        return perm_table_add(&sys_perms, node);
+    } else {
+        node->key = node->dp.name;
+        return perm_table_add(&dev_perms, node);
+    }
+}
 
-    return 0;
+struct perm_matches {
+    struct perm_node **nodes;
+    int count;
+    int size;
+};
+
+static void collect_perm_match(struct perm_node *node, void *cookie)
+{
+    struct perm_matches *matches = cookie;
+    struct perm_node **nodes;
+
+    if (matches->count == matches->size) {
+        matches->size = matches->size ? matches->size * 2 : 8;
+        nodes = realloc(matches->nodes, matches->size * sizeof(*nodes));
+        if (!nodes) {
+            matches->size = matches->count;
+            return;
+        }
+        matches->nodes = nodes;
+    }
+    matches->nodes[matches->count++] = node;
+}
+
+static int compare_perm_index(const void *a, const void *b)
+{
+    const struct perm_node *na = *(struct perm_node * const *)a;
+    const struct perm_node *nb = *(struct perm_node * const *)b;
+
+    return na->index < nb->index ? -1 : na->index > nb->index;
+}
+
+/* While coldboot runs, the sysfs trees to relabel are only collected, and
+ * relabeled together once it is done: the uevents of a device and of all
+ * the devices below it would otherwise each walk the same subtree again.
+ */
+static struct {
+    bool deferred;
+    int count;
+    int size;
+    char **paths;
+} sys_relabel;
+
+static void defer_sys_relabel(const char *path)
+{
+    char **paths;
+    char *copy;
+
+    if (sys_relabel.count == sys_relabel.size) {
+        int size = sys_relabel.size ? sys_relabel.size * 2 : 256;
+        paths = realloc(sys_relabel.paths, size * sizeof(*paths));
+        if (!paths)
+            goto fallback;
+        sys_relabel.paths = paths;
+        sys_relabel.size = size;
+    }
+
+    copy = strdup(path);
+    if (!copy)
+        goto fallback;
+    sys_relabel.paths[sys_relabel.count++] = copy;
+    return;
+
+fallback:
+    restorecon_recursive(path);
+}
+
+static void relabel_deferred_sys(void)
+{
+    int i;
+
+    sys_relabel.deferred = false;
+    INFO("restorecon_recursive: %d sysfs trees\n", sys_relabel.count);
+    restorecon_recursive_batch((const char **) sys_relabel.paths,
+                               sys_relabel.count);
+
+    for (i = 0; i < sys_relabel.count; i++)
+        free(sys_relabel.paths[i]);
+    free(sys_relabel.paths);
+    sys_relabel.paths = NULL;
+    sys_relabel.count = 0;
+    sys_relabel.size = 0;
 }
 
 void fixup_sys_perms(const char *upath)
 {
     char buf[512];
-    struct listnode *node;
+    struct perm_matches matches = { NULL, 0, 0 };
     struct perms_ *dp;
+    int i;
 
-    /* upaths omit the "/sys" that paths in this list
-     * contain, so we add 4 when comparing...
-     */
-    list_for_each(node, &sys_perms) {
-        dp = &(node_to_item(node, struct perm_node, plist))->dp;
-        if (dp->prefix) {
-            if (strncmp(upath, dp->name + 4, strlen(dp->name + 4)))
-                continue;
-        } else if (dp->wildcard) {
-            if (fnmatch(dp->name + 4, upath, FNM_PATHNAME) != 0)
-                continue;
-        } else {
-            if (strcmp(upath, dp->name + 4))
-                continue;
-        }
+    /* apply every matching rule, in the order they were added */
+    perm_table_match(&sys_perms, upath, collect_perm_match, &matches);
+    qsort(matches.nodes, matches.count, sizeof(*matches.nodes),
+          compare_perm_index);
+
+    for (i = 0; i < matches.count; i++) {
+        dp = &matches.nodes[i]->dp;
 
         if ((strlen(upath) + strlen(dp->attr) + 6) > sizeof(buf))
             break;
@@ -161,6 +348,7 @@ void fixup_sys_perms(const char *upath)
         chown(buf, dp->uid, dp->gid);
         chmod(buf, dp->perm);
     }
+    free(matches.nodes);
 
     // Now fixup SELinux file labels
     int len = snprintf(buf, sizeof(buf), "/sys%s", upath);
@@ -169,70 +357,49 @@ void fixup_sys_perms(const char *upath)
         return;
     }
     if (access(buf, F_OK) == 0) {
-        INFO("restorecon_recursive: %s\n", buf);
 #ifdef _PLATFORM_BASE
-        if(!strcmp(upath, DEVICES_BASE))
+        if(!strcmp(upath, DEVICES_BASE)) {
+            INFO("restorecon: %s\n", buf);
             restorecon(buf);
-        else
-            restorecon_recursive(buf);
-#else
-        restorecon_recursive(buf);
+            return;
+        }
 #endif
+        if (sys_relabel.deferred) {
+            defer_sys_relabel(buf);
+        } else {
+            INFO("restorecon_recursive: %s\n", buf);
+            restorecon_recursive(buf);
+        }
     }
 }
 
-static bool perm_path_matches(const char *path, struct perms_ *dp)
+static void latest_perm_match(struct perm_node *node, void *cookie)
 {
-    if (dp->prefix) {
-        if (strncmp(path, dp->name, strlen(dp->name)) == 0)
-            return true;
-    } else if (dp->wildcard) {
-        if (fnmatch(dp->name, path, FNM_PATHNAME) == 0)
-            return true;
-    } else {
-        if (strcmp(path, dp->name) == 0)
-            return true;
-    }
+    struct perm_node **latest = cookie;
 
-    return false;
+    if (!*latest || node->index > (*latest)->index)
+        *latest = node;
 }
 
 static mode_t get_device_perm(const char *path, const char **links,
                 unsigned *uid, unsigned *gid)
 {
-    mode_t perm;
-    struct listnode *node;
-    struct perm_node *perm_node;
-    struct perms_ *dp;
+    struct perm_node *latest = NULL;
+    int i;
 
-    /* search the perms list in reverse so that ueventd.$hardware can
+    /* the rule added last wins, so that ueventd.$hardware can
      * override ueventd.rc
      */
-    list_for_each_reverse(node, &dev_perms) {
-        bool match = false;
-
-        perm_node = node_to_item(node, struct perm_node, plist);
-        dp = &perm_node->dp;
-
-        if (perm_path_matches(path, dp)) {
-            match = true;
-        } else {
-            if (links) {
-                int i;
-                for (i = 0; links[i]; i++) {
-                    if (perm_path_matches(links[i], dp)) {
-                        match = true;
-                        break;
-                    }
-                }
-            }
-        }
+    perm_table_match(&dev_perms, path, latest_perm_match, &latest);
+    if (links) {
+        for (i = 0; links[i]; i++)
+            perm_table_match(&dev_perms, links[i], latest_perm_match, &latest);
+    }
 
-        if (match) {
-            *uid = dp->uid;
-            *gid = dp->gid;
-            return dp->perm;
-        }
+    if (latest) {
+        *uid = latest->dp.uid;
+        *gid = latest->dp.gid;
+        return latest->dp.perm;
     }
     /* Default if nothing found. */
     *uid = 0;
@@ -249,14 +416,13 @@ static void make_device(const char *path,
     unsigned gid;
     mode_t mode;
     dev_t dev;
-    char *secontext = NULL;
+    char *secontext;
 
     mode = get_device_perm(path, links, &uid, &gid) | (block ? S_IFBLK : S_IFCHR);
 
-    if (sehandle) {
-        selabel_lookup_best_match(sehandle, &secontext, path, links, mode);
+    secontext = lookup_label(path, links, mode);
+    if (secontext)
         setfscreatecon(secontext);
-    }
 
     dev = makedev(major, minor);
     /* Temporarily change egid to avoid race condition setting the gid of the
@@ -269,10 +435,8 @@ static void make_device(const char *path,
     chown(path, uid, -1);
     setegid(AID_ROOT);
 
-    if (secontext) {
-        freecon(secontext);
+    if (secontext)
         setfscreatecon(NULL);
-    }
 }
 
 static void add_platform_device(const char *path)
@@ -383,8 +547,6 @@ static int find_pci_device_prefix(const char *path, char *buf, ssize_t buf_sz)
     return 0;
 }
 
-#if LOG_UEVENTS
-
 static inline suseconds_t get_usecs(void)
 {
     struct timeval tv;
@@ -392,12 +554,13 @@ static inline suseconds_t get_usecs(void)
     return tv.tv_sec * (suseconds_t) 1000000 + tv.tv_usec;
 }
 
+#if LOG_UEVENTS
+
 #define log_event_print(x...) INFO(x)
 
 #else
 
 #define log_event_print(fmt, args...)   do { } while (0)
-#define get_usecs()                     0
 
 #endif
 
@@ -881,60 +1044,198 @@ static void handle_device_event(struct uevent *uevent)
     }
 }
 
-static int load_firmware(int fw_fd, int loading_fd, int data_fd)
+/* Firmware requests are served by a small pool of threads, so that a large
+ * blob being copied for one device doesn't hold up the uevents, or the
+ * firmware, of the others. Requests whose file can't be found yet while
+ * booting are put back on the queue to be retried, rather than blocking a
+ * thread while the filesystem holding it gets mounted.
+ */
+#define FIRMWARE_THREADS    4
+#define FIRMWARE_RETRY_MS   100
+
+static const char *firmware_dirs[] = {
+    FIRMWARE_DIR1,
+    FIRMWARE_DIR2,
+    FIRMWARE_DIR3,
+};
+
+struct firmware_request {
+    struct listnode list;
+    uint64_t not_before;    /* gettime_ms() to retry at */
+    bool prefetch;          /* only bring the file into the page cache */
+    char *path;             /* devpath of the device asking for it */
+    char firmware[];
+};
+
+/* remembers which directory each firmware was found in */
+struct firmware_location {
+    struct firmware_location *next;
+    unsigned int dir;
+    char name[];
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct listnode requests;
+    struct firmware_location *locations;
+    int threads;
+} firmware_state = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .requests = { &firmware_state.requests, &firmware_state.requests },
+};
+
+static list_declare(firmware_prefetch);
+
+struct firmware_name {
+    struct listnode list;
+    char name[];
+};
+
+static int firmware_location(const char *name)
 {
-    struct stat st;
-    long len_to_copy;
-    int ret = 0;
+    struct firmware_location *loc;
+    int dir = -1;
 
-    if(fstat(fw_fd, &st) < 0)
-        return -1;
-    len_to_copy = st.st_size;
-
-    if (S_ISBLK(st.st_mode)) {
-        //File points to a block device.Need to calculate its size
-        //manually
-        len_to_copy = lseek64(fw_fd, 0, SEEK_END);
-        if (len_to_copy < 0) {
-            ERROR("Failed to get size of block device partition: %s\n",
-                            strerror(errno));
-            return -1;
+    pthread_mutex_lock(&firmware_state.lock);
+    for (loc = firmware_state.locations; loc; loc = loc->next) {
+        if (!strcmp(loc->name, name)) {
+            dir = loc->dir;
+            break;
         }
-        if (lseek64(fw_fd, 0, SEEK_SET) < 0) {
-            ERROR("Failed to set r/w offset for block device partition: %s\n",
-                            strerror(errno));
-            return -1;
+    }
+    pthread_mutex_unlock(&firmware_state.lock);
+    return dir;
+}
+
+static void set_firmware_location(const char *name, unsigned int dir)
+{
+    struct firmware_location *loc;
+
+    pthread_mutex_lock(&firmware_state.lock);
+    for (loc = firmware_state.locations; loc; loc = loc->next) {
+        if (!strcmp(loc->name, name)) {
+            loc->dir = dir;
+            goto out;
         }
     }
+    loc = malloc(sizeof(*loc) + strlen(name) + 1);
+    if (loc) {
+        loc->dir = dir;
+        strcpy(loc->name, name);
+        loc->next = firmware_state.locations;
+        firmware_state.locations = loc;
+    }
+out:
+    pthread_mutex_unlock(&firmware_state.lock);
+}
 
-    write(loading_fd, "1", 1);  /* start transfer */
+static int open_firmware_dir(unsigned int dir, const char *name)
+{
+    char path[PATH_MAX];
+
+    if (snprintf(path, sizeof(path), "%s/%s", firmware_dirs[dir], name) >= (int) sizeof(path))
+        return -1;
+    return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+/* Opens firmware from the directory it was last found in, or else the
+ * first directory that has it.
+ */
+static int open_firmware(const char *name)
+{
+    int cached = firmware_location(name);
+    unsigned int dir;
+    int fd;
 
-    while (len_to_copy > 0) {
-        char buf[PAGE_SIZE];
-        ssize_t nr;
+    if (cached >= 0) {
+        fd = open_firmware_dir(cached, name);
+        if (fd >= 0)
+            return fd;
+    }
 
-        nr = read(fw_fd, buf, sizeof(buf));
-        if(!nr)
+    for (dir = 0; dir < ARRAY_SIZE(firmware_dirs); dir++) {
+        if ((int) dir == cached)
+            continue;
+        fd = open_firmware_dir(dir, name);
+        if (fd >= 0) {
+            set_firmware_location(name, dir);
+            return fd;
+        }
+    }
+    return -1;
+}
+
+/* Copies len bytes with sendfile, so that the firmware goes from the page
+ * cache to the device without a trip through a user buffer; falls back to
+ * read and write where the target can't take it.
+ */
+static int copy_firmware(int fw_fd, int out_fd, off64_t len)
+{
+    char buf[PAGE_SIZE];
+    ssize_t nr, nw, done;
+
+    while (len > 0) {
+        nr = sendfile(out_fd, fw_fd, NULL, len > SSIZE_MAX ? SSIZE_MAX : len);
+        if (nr < 0 && errno == EINTR)
+            continue;
+        if (nr < 0 && (errno == EINVAL || errno == ENOSYS))
             break;
-        if(nr < 0) {
-            ret = -1;
+        if (nr <= 0)
+            return nr == 0 ? 0 : -1;
+        len -= nr;
+    }
+
+    while (len > 0) {
+        nr = TEMP_FAILURE_RETRY(read(fw_fd, buf, sizeof(buf)));
+        if (nr == 0)
             break;
+        if (nr < 0)
+            return -1;
+
+        len -= nr;
+        for (done = 0; done < nr; done += nw) {
+            nw = TEMP_FAILURE_RETRY(write(out_fd, buf + done, nr - done));
+            if (nw <= 0)
+                return -1;
         }
+    }
+    return 0;
+}
 
-        len_to_copy -= nr;
-        while (nr > 0) {
-            ssize_t nw = 0;
+static off64_t firmware_size(int fw_fd)
+{
+    struct stat st;
+    off64_t len;
 
-            nw = write(data_fd, buf + nw, nr);
-            if(nw <= 0) {
-                ret = -1;
-                goto out;
-            }
-            nr -= nw;
-        }
+    if (fstat(fw_fd, &st) < 0)
+        return -1;
+    if (!S_ISBLK(st.st_mode))
+        return st.st_size;
+
+    //File points to a block device.Need to calculate its size
+    //manually
+    len = lseek64(fw_fd, 0, SEEK_END);
+    if (len < 0 || lseek64(fw_fd, 0, SEEK_SET) < 0) {
+        ERROR("Failed to get size of block device partition: %s\n",
+                        strerror(errno));
+        return -1;
     }
+    return len;
+}
 
-out:
+static int load_firmware(int fw_fd, int loading_fd, int data_fd)
+{
+    off64_t len_to_copy;
+    int ret;
+
+    len_to_copy = firmware_size(fw_fd);
+    if (len_to_copy < 0)
+        return -1;
+
+    write(loading_fd, "1", 1);  /* start transfer */
+
+    ret = copy_firmware(fw_fd, data_fd, len_to_copy);
     if(!ret)
         write(loading_fd, "0", 1);  /* successful end of transfer */
     else
@@ -943,23 +1244,45 @@ out:
     return ret;
 }
 
+/* Reads a firmware file into the page cache ahead of the request for it,
+ * by sending it to /dev/null.
+ */
+static void prefetch_firmware(const char *name)
+{
+    off64_t len;
+    int fw_fd, null_fd;
+
+    fw_fd = open_firmware(name);
+    if (fw_fd < 0) {
+        INFO("firmware: nothing to prefetch for '%s'\n", name);
+        return;
+    }
+
+    len = firmware_size(fw_fd);
+    null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (len > 0 && null_fd >= 0 && !copy_firmware(fw_fd, null_fd, len))
+        INFO("firmware: prefetched '%s', %lld bytes\n", name, (long long) len);
+
+    if (null_fd >= 0)
+        close(null_fd);
+    close(fw_fd);
+}
+
 static int is_booting(void)
 {
     return access("/dev/.booting", F_OK) == 0;
 }
 
-static void process_firmware_event(struct uevent *uevent)
+/* Returns -EAGAIN if the firmware isn't there yet but may still appear. */
+static int process_firmware_event(const char *path, const char *firmware)
 {
-    char *root, *loading, *data, *file1 = NULL, *file2 = NULL, *file3 = NULL;
+    char *root, *loading, *data;
     int l, loading_fd, data_fd, fw_fd;
-    int booting = is_booting();
-
-    INFO("firmware: loading '%s' for '%s'\n",
-         uevent->firmware, uevent->path);
+    int ret = 0;
 
-    l = asprintf(&root, SYSFS_PREFIX"%s/", uevent->path);
+    l = asprintf(&root, SYSFS_PREFIX"%s/", path);
     if (l == -1)
-        return;
+        return 0;
 
     l = asprintf(&loading, "%sloading", root);
     if (l == -1)
@@ -969,74 +1292,169 @@ static void process_firmware_event(struct uevent *uevent)
     if (l == -1)
         goto loading_free_out;
 
-    l = asprintf(&file1, FIRMWARE_DIR1"/%s", uevent->firmware);
-    if (l == -1)
-        goto data_free_out;
-
-    l = asprintf(&file2, FIRMWARE_DIR2"/%s", uevent->firmware);
-    if (l == -1)
-        goto data_free_out;
-
-    l = asprintf(&file3, FIRMWARE_DIR3"/%s", uevent->firmware);
-    if (l == -1)
-        goto data_free_out;
+    fw_fd = open_firmware(firmware);
+    if (fw_fd < 0) {
+        if (is_booting()) {
+                /* If we're not fully booted, we may be missing
+                 * filesystems needed for firmware, wait and retry.
+                 */
+            ret = -EAGAIN;
+            goto data_free_out;
+        }
+        INFO("firmware: could not open '%s' %d\n", firmware, errno);
+    }
 
-    loading_fd = open(loading, O_WRONLY);
+    loading_fd = open(loading, O_WRONLY | O_CLOEXEC);
     if(loading_fd < 0)
-        goto file_free_out;
+        goto fw_close_out;
 
-    data_fd = open(data, O_WRONLY);
+    data_fd = open(data, O_WRONLY | O_CLOEXEC);
     if(data_fd < 0)
         goto loading_close_out;
 
-try_loading_again:
-    fw_fd = open(file1, O_RDONLY);
-    if(fw_fd < 0) {
-        fw_fd = open(file2, O_RDONLY);
-        if (fw_fd < 0) {
-            fw_fd = open(file3, O_RDONLY);
-            if (fw_fd < 0) {
-                if (booting) {
-                        /* If we're not fully booted, we may be missing
-                         * filesystems needed for firmware, wait and retry.
-                         */
-                    usleep(100000);
-                    booting = is_booting();
-                    goto try_loading_again;
-                }
-                INFO("firmware: could not open '%s' %d\n", uevent->firmware, errno);
-                write(loading_fd, "-1", 2);
-                goto data_close_out;
-            }
-        }
-    }
-
-    if(!load_firmware(fw_fd, loading_fd, data_fd))
-        INFO("firmware: copy success { '%s', '%s' }\n", root, uevent->firmware);
+    if (fw_fd < 0)
+        write(loading_fd, "-1", 2);
+    else if(!load_firmware(fw_fd, loading_fd, data_fd))
+        INFO("firmware: copy success { '%s', '%s' }\n", root, firmware);
     else
-        INFO("firmware: copy failure { '%s', '%s' }\n", root, uevent->firmware);
+        INFO("firmware: copy failure { '%s', '%s' }\n", root, firmware);
 
-    close(fw_fd);
-data_close_out:
     close(data_fd);
 loading_close_out:
     close(loading_fd);
-file_free_out:
-    free(file1);
-    free(file2);
-    free(file3);
+fw_close_out:
+    if (fw_fd >= 0)
+        close(fw_fd);
 data_free_out:
     free(data);
 loading_free_out:
     free(loading);
 root_free_out:
     free(root);
+    return ret;
+}
+
+static void free_firmware_request(struct firmware_request *req)
+{
+    free(req->path);
+    free(req);
+}
+
+/* Takes the first request that is due, waiting for one if needed. */
+static struct firmware_request *next_firmware_request(void)
+{
+    struct listnode *node;
+    struct firmware_request *req;
+    uint64_t now, wake;
+    struct timespec ts;
+
+    pthread_mutex_lock(&firmware_state.lock);
+    for (;;) {
+        now = gettime_ms();
+        wake = 0;
+        list_for_each(node, &firmware_state.requests) {
+            req = node_to_item(node, struct firmware_request, list);
+            if (req->not_before <= now) {
+                list_remove(node);
+                pthread_mutex_unlock(&firmware_state.lock);
+                return req;
+            }
+            if (!wake || req->not_before < wake)
+                wake = req->not_before;
+        }
+
+        if (!wake) {
+            pthread_cond_wait(&firmware_state.cond, &firmware_state.lock);
+        } else {
+            /* cond waits on CLOCK_MONOTONIC, like gettime_ms(). */
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            ts.tv_sec += (wake - now) / 1000;
+            ts.tv_nsec += ((wake - now) % 1000) * 1000000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&firmware_state.cond, &firmware_state.lock, &ts);
+        }
+    }
+}
+
+static void queue_firmware_request(struct firmware_request *req)
+{
+    pthread_mutex_lock(&firmware_state.lock);
+    list_add_tail(&firmware_state.requests, &req->list);
+    pthread_cond_signal(&firmware_state.cond);
+    pthread_mutex_unlock(&firmware_state.lock);
+}
+
+static void *firmware_thread(void *arg UNUSED)
+{
+    struct firmware_request *req;
+
+    for (;;) {
+        req = next_firmware_request();
+
+        if (req->prefetch) {
+            prefetch_firmware(req->firmware);
+        } else if (process_firmware_event(req->path, req->firmware) == -EAGAIN) {
+            req->not_before = gettime_ms() + FIRMWARE_RETRY_MS;
+            queue_firmware_request(req);
+            continue;
+        }
+        free_firmware_request(req);
+    }
+    return NULL;
+}
+
+static void start_firmware_threads(void)
+{
+    pthread_condattr_t condattr;
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    /* Retry deadlines must not move when the wall clock is set. */
+    pthread_condattr_init(&condattr);
+    pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&firmware_state.cond, &condattr);
+    pthread_condattr_destroy(&condattr);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    while (firmware_state.threads < FIRMWARE_THREADS) {
+        if (pthread_create(&thread, &attr, firmware_thread, NULL))
+            break;
+        firmware_state.threads++;
+    }
+    pthread_attr_destroy(&attr);
+
+    if (!firmware_state.threads)
+        ERROR("cannot start firmware threads, loading firmware inline\n");
+}
+
+static struct firmware_request *new_firmware_request(const char *path,
+                                                     const char *firmware)
+{
+    struct firmware_request *req;
+
+    req = calloc(1, sizeof(*req) + strlen(firmware) + 1);
+    if (!req)
+        return NULL;
+    strcpy(req->firmware, firmware);
+    if (path) {
+        req->path = strdup(path);
+        if (!req->path) {
+            free(req);
+            return NULL;
+        }
+    } else {
+        req->prefetch = true;
+    }
+    return req;
 }
 
 static void handle_firmware_event(struct uevent *uevent)
 {
-    pid_t pid;
-    int ret;
+    struct firmware_request *req;
 
     if(strcmp(uevent->subsystem, "firmware"))
         return;
@@ -1044,14 +1462,60 @@ static void handle_firmware_event(struct uevent *uevent)
     if(strcmp(uevent->action, "add"))
         return;
 
-    /* we fork, to avoid making large memory allocations in init proper */
-    pid = fork();
-    if (!pid) {
-        process_firmware_event(uevent);
-        exit(EXIT_SUCCESS);
+    INFO("firmware: loading '%s' for '%s'\n",
+         uevent->firmware, uevent->path);
+
+    req = new_firmware_request(uevent->path, uevent->firmware);
+    if (!req) {
+        ERROR("dropping firmware request for %s\n", uevent->firmware);
+        return;
+    }
+
+    if (firmware_state.threads) {
+        queue_firmware_request(req);
+        return;
+    }
+
+    while (process_firmware_event(req->path, req->firmware) == -EAGAIN)
+        usleep(FIRMWARE_RETRY_MS * 1000);
+    free_firmware_request(req);
+}
+
+/* Firmware named with "firmware_prefetch" in ueventd.rc is read into the
+ * page cache as soon as ueventd starts, so that it is at hand when the
+ * driver asks for it.
+ */
+void add_firmware_prefetch(const char *name)
+{
+    struct firmware_name *fw;
+
+    fw = malloc(sizeof(*fw) + strlen(name) + 1);
+    if (!fw)
+        return;
+    strcpy(fw->name, name);
+    list_add_tail(&firmware_prefetch, &fw->list);
+}
+
+static void queue_firmware_prefetch(void)
+{
+    struct listnode *node, *n;
+    struct firmware_name *fw;
+    struct firmware_request *req;
+
+    list_for_each_safe(node, n, &firmware_prefetch) {
+        fw = node_to_item(node, struct firmware_name, list);
+        list_remove(node);
+        if (firmware_state.threads) {
+            req = new_firmware_request(NULL, fw->name);
+            if (req)
+                queue_firmware_request(req);
+        }
+        free(fw);
     }
 }
 
+static unsigned int device_events;
+
 #define UEVENT_MSG_LEN  2048
 void handle_device_fd()
 {
@@ -1071,11 +1535,13 @@ void handle_device_fd()
             struct selabel_handle *sehandle2;
             sehandle2 = selinux_android_file_context_handle();
             if (sehandle2) {
+                label_cache_flush();
                 selabel_close(sehandle);
                 sehandle = sehandle2;
             }
         }
 
+        device_events++;
         handle_device_event(&uevent);
         handle_firmware_event(&uevent);
     }
@@ -1085,57 +1551,233 @@ void handle_device_fd()
 ** to cause the kernel to regenerate device add events that happened
 ** before init's device manager was started
 **
-** We drain any pending events from the netlink socket every time
-** we poke another uevent file to make sure we don't overrun the
-** socket's buffer.  
+** The walk is spread over a pool of threads that share a stack of
+** directories still to visit.  A directory's uevent file is always
+** poked before its subdirectories are queued, so a device's add event
+** still reaches us ahead of the events of its children, which is what
+** platform device and by-name symlink handling relies on.  Meanwhile
+** the main thread drains the netlink socket and creates the device
+** nodes, in the order the kernel sends the events.
 */
 
-static void do_coldboot(DIR *d)
+#define COLDBOOT_MAX_THREADS 8
+
+struct coldboot_dir {
+    struct listnode list;
+    char path[];
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct listnode dirs;
+    int busy;
+    bool quit;
+    unsigned int dirs_walked;
+    unsigned int uevents;
+} coldboot_state = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .dirs = { &coldboot_state.dirs, &coldboot_state.dirs },
+};
+
+static struct coldboot_dir *coldboot_dir_new(const char *parent,
+                                             const char *name)
+{
+    struct coldboot_dir *dir;
+    size_t len = strlen(parent) + 1 + strlen(name) + 1;
+
+    if (len > PATH_MAX)
+        return NULL;
+
+    dir = malloc(sizeof(*dir) + len);
+    if (dir)
+        snprintf(dir->path, len, "%s/%s", parent, name);
+    return dir;
+}
+
+/* Pokes the uevent file of one directory and returns its subdirectories */
+static unsigned int coldboot_walk_dir(const char *path,
+                                      struct listnode *subdirs)
 {
+    struct coldboot_dir *sub;
     struct dirent *de;
-    int dfd, fd;
+    unsigned int uevents = 0;
+    DIR *d;
+    int fd;
 
-    dfd = dirfd(d);
+    d = opendir(path);
+    if (!d)
+        return 0;
 
-    fd = openat(dfd, "uevent", O_WRONLY);
-    if(fd >= 0) {
+    fd = openat(dirfd(d), "uevent", O_WRONLY | O_CLOEXEC);
+    if (fd >= 0) {
         write(fd, "add\n", 4);
         close(fd);
-        handle_device_fd();
+        uevents++;
     }
 
-    while((de = readdir(d))) {
-        DIR *d2;
-
-        if(de->d_type != DT_DIR || de->d_name[0] == '.')
+    while ((de = readdir(d))) {
+        if (de->d_type != DT_DIR || de->d_name[0] == '.')
             continue;
 
-        fd = openat(dfd, de->d_name, O_RDONLY | O_DIRECTORY);
-        if(fd < 0)
-            continue;
+        sub = coldboot_dir_new(path, de->d_name);
+        if (sub)
+            list_add_tail(subdirs, &sub->list);
+    }
+
+    closedir(d);
+    return uevents;
+}
 
-        d2 = fdopendir(fd);
-        if(d2 == 0)
-            close(fd);
-        else {
-            do_coldboot(d2);
-            closedir(d2);
+static void *coldboot_thread(void *arg UNUSED)
+{
+    struct coldboot_dir *dir;
+    struct listnode subdirs;
+    struct listnode *node;
+    unsigned int uevents;
+
+    pthread_mutex_lock(&coldboot_state.lock);
+    for (;;) {
+        while (list_empty(&coldboot_state.dirs) && !coldboot_state.quit)
+            pthread_cond_wait(&coldboot_state.cond, &coldboot_state.lock);
+        if (list_empty(&coldboot_state.dirs))
+            break;
+
+        node = coldboot_state.dirs.next;
+        list_remove(node);
+        coldboot_state.busy++;
+        pthread_mutex_unlock(&coldboot_state.lock);
+
+        dir = node_to_item(node, struct coldboot_dir, list);
+        list_init(&subdirs);
+        uevents = coldboot_walk_dir(dir->path, &subdirs);
+        free(dir);
+
+        pthread_mutex_lock(&coldboot_state.lock);
+        coldboot_state.busy--;
+        coldboot_state.dirs_walked++;
+        coldboot_state.uevents += uevents;
+        if (!list_empty(&subdirs)) {
+            /* Push the whole batch on top of the stack, keeping the
+             * walk depth first so the stack stays small. */
+            subdirs.prev->next = coldboot_state.dirs.next;
+            coldboot_state.dirs.next->prev = subdirs.prev;
+            coldboot_state.dirs.next = subdirs.next;
+            subdirs.next->prev = &coldboot_state.dirs;
+            pthread_cond_broadcast(&coldboot_state.cond);
+        } else if (coldboot_state.busy == 0 &&
+                   list_empty(&coldboot_state.dirs)) {
+            pthread_cond_broadcast(&coldboot_state.cond);
         }
     }
+    pthread_mutex_unlock(&coldboot_state.lock);
+
+    return NULL;
+}
+
+static bool coldboot_idle(void)
+{
+    bool idle;
+
+    pthread_mutex_lock(&coldboot_state.lock);
+    idle = coldboot_state.busy == 0 && list_empty(&coldboot_state.dirs);
+    pthread_mutex_unlock(&coldboot_state.lock);
+    return idle;
 }
 
+/* Walks one /sys tree, handling the events it generates as they arrive */
 static void coldboot(const char *path)
 {
-    DIR *d = opendir(path);
-    if(d) {
-        do_coldboot(d);
-        closedir(d);
+    struct coldboot_dir *dir;
+    struct pollfd ufd;
+    uint64_t start = boottrace_now();
+
+    dir = malloc(sizeof(*dir) + strlen(path) + 1);
+    if (!dir)
+        return;
+    strcpy(dir->path, path);
+
+    pthread_mutex_lock(&coldboot_state.lock);
+    list_add_head(&coldboot_state.dirs, &dir->list);
+    pthread_cond_broadcast(&coldboot_state.cond);
+    pthread_mutex_unlock(&coldboot_state.lock);
+
+    if (coldboot_state.quit) {
+        /* there are no threads to hand the walk to */
+        coldboot_thread(NULL);
+    } else {
+        ufd.fd = device_fd;
+        ufd.events = POLLIN;
+        do {
+            ufd.revents = 0;
+            if (poll(&ufd, 1, 10) > 0)
+                handle_device_fd();
+        } while (!coldboot_idle());
     }
+
+    /* pick up whatever the last uevent writes generated */
+    handle_device_fd();
+
+    boottrace_event(BOOTTRACE_COLDBOOT, path, (boottrace_now() - start) / 1000);
 }
 
-void device_init(void)
+static int coldboot_threads(void)
 {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (cpus < 1)
+        return 1;
+    if (cpus > COLDBOOT_MAX_THREADS)
+        return COLDBOOT_MAX_THREADS;
+    return cpus;
+}
+
+static void do_coldboot(void)
+{
+    pthread_t threads[COLDBOOT_MAX_THREADS];
     suseconds_t t0, t1;
+    int nthreads = 0;
+    int count = coldboot_threads();
+    unsigned int events;
+    int i;
+
+    t0 = get_usecs();
+    events = device_events;
+    sys_relabel.deferred = true;
+
+    while (nthreads < count) {
+        if (pthread_create(&threads[nthreads], NULL, coldboot_thread, NULL))
+            break;
+        nthreads++;
+    }
+
+    if (nthreads == 0) {
+        ERROR("cannot start coldboot threads, walking /sys inline\n");
+        coldboot_state.quit = true;
+    }
+
+    coldboot("/sys/class");
+    coldboot("/sys/block");
+    coldboot("/sys/devices");
+
+    pthread_mutex_lock(&coldboot_state.lock);
+    coldboot_state.quit = true;
+    pthread_cond_broadcast(&coldboot_state.cond);
+    pthread_mutex_unlock(&coldboot_state.lock);
+    for (i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+
+    relabel_deferred_sys();
+
+    t1 = get_usecs();
+    NOTICE("coldboot %ld uS: %u dirs, %u uevents written, %u events handled, %d threads\n",
+           (long) (t1 - t0), coldboot_state.dirs_walked, coldboot_state.uevents,
+           device_events - events, nthreads);
+}
+
+void device_init(void)
+{
     struct stat info;
     int fd;
 
@@ -1156,15 +1798,15 @@ void device_init(void)
     fcntl(device_fd, F_SETFD, FD_CLOEXEC);
     fcntl(device_fd, F_SETFL, O_NONBLOCK);
 
+    start_firmware_threads();
+    queue_firmware_prefetch();
+
     if (stat(coldboot_done, &info) < 0) {
-        t0 = get_usecs();
-        coldboot("/sys/class");
-        coldboot("/sys/block");
-        coldboot("/sys/devices");
-        t1 = get_usecs();
+        do_coldboot();
+        /* init picks this up when it dumps its own trace */
+        boottrace_write(BOOTTRACE_UEVENTD_FILE, NULL);
         fd = open(coldboot_done, O_WRONLY|O_CREAT, 0000);
         close(fd);
-        log_event_print("coldboot %ld uS\n", ((long) (t1 - t0)));
     } else {
         log_event_print("skipping coldboot, already done\n");
     }
@@ -25,5 +25,6 @@ extern int add_dev_perms(const char *name, const char *attr,
                          mode_t perm, unsigned int uid,
                          unsigned int gid, unsigned short prefix,
                          unsigned short wildcard);
+extern void add_firmware_prefetch(const char *name);
 int get_device_fd();
 #endif	/* _INIT_DEVICES_H */
@@ -0,0 +1,169 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include <cutils/list.h>
+
+#include "event_loop.h"
+#include "log.h"
+#include "util.h"
+
+#define EVENT_LOOP_MAX_EVENTS 8
+
+struct fd_handler {
+    struct listnode list;
+    int fd;
+    void (*func)(void);
+};
+
+static int epoll_fd = -1;
+static list_declare(fd_handlers);
+
+/* pending timers, soonest first; init only ever has a handful */
+static list_declare(timers);
+
+int event_loop_init(void)
+{
+    /* the size argument is only a hint */
+    epoll_fd = epoll_create(EVENT_LOOP_MAX_EVENTS);
+    if (epoll_fd < 0) {
+        ERROR("epoll_create failed: %s\n", strerror(errno));
+        return -1;
+    }
+    fcntl(epoll_fd, F_SETFD, FD_CLOEXEC);
+    return 0;
+}
+
+int register_fd_handler(int fd, void (*func)(void))
+{
+    struct epoll_event ev;
+    struct fd_handler *handler;
+
+    handler = calloc(1, sizeof(*handler));
+    if (!handler)
+        return -1;
+    handler->fd = fd;
+    handler->func = func;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = handler;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        ERROR("epoll_ctl(%d) failed: %s\n", fd, strerror(errno));
+        free(handler);
+        return -1;
+    }
+
+    list_add_tail(&fd_handlers, &handler->list);
+    return 0;
+}
+
+void unregister_fd_handler(int fd)
+{
+    struct listnode *node;
+    struct fd_handler *handler;
+
+    list_for_each(node, &fd_handlers) {
+        handler = node_to_item(node, struct fd_handler, list);
+        if (handler->fd == fd) {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+            list_remove(&handler->list);
+            free(handler);
+            return;
+        }
+    }
+}
+
+int timer_pending(const struct timer *timer)
+{
+    return timer->list.next != NULL;
+}
+
+void timer_cancel(struct timer *timer)
+{
+    if (!timer_pending(timer))
+        return;
+    list_remove(&timer->list);
+    timer->list.next = timer->list.prev = NULL;
+}
+
+void timer_schedule(struct timer *timer, uint64_t expires,
+                    void (*func)(struct timer *timer))
+{
+    struct listnode *node;
+    struct timer *t;
+
+    timer_cancel(timer);
+    timer->expires = expires;
+    timer->func = func;
+
+    /* insert after every timer due no later, keeping the list ordered */
+    list_for_each(node, &timers) {
+        t = node_to_item(node, struct timer, list);
+        if (t->expires > expires)
+            break;
+    }
+    /* node is either the first later timer or the list head itself */
+    list_add_tail(node, &timer->list);
+}
+
+/* Returns the ms until the next pending timer is due, or -1 if none is. */
+static int run_timers(void)
+{
+    struct timer *timer;
+    uint64_t now = gettime_ms();
+
+    while (!list_empty(&timers)) {
+        timer = node_to_item(list_head(&timers), struct timer, list);
+        if (timer->expires > now) {
+            uint64_t wait = timer->expires - now;
+            return wait > INT32_MAX ? INT32_MAX : (int) wait;
+        }
+
+        timer_cancel(timer);
+        timer->func(timer);
+        now = gettime_ms();
+    }
+    return -1;
+}
+
+void event_loop_wait(int timeout)
+{
+    struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+    struct fd_handler *handler;
+    int timer_timeout;
+    int nr, i;
+
+    timer_timeout = run_timers();
+    if (timer_timeout >= 0 && (timeout < 0 || timer_timeout < timeout))
+        timeout = timer_timeout;
+
+    nr = epoll_wait(epoll_fd, events, EVENT_LOOP_MAX_EVENTS, timeout);
+    if (nr < 0 && errno != EINTR)
+        ERROR("epoll_wait failed: %s\n", strerror(errno));
+
+    for (i = 0; i < nr; i++) {
+        handler = events[i].data.ptr;
+        handler->func();
+    }
+
+    run_timers();
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _INIT_EVENT_LOOP_H_
+#define _INIT_EVENT_LOOP_H_
+
+#include <stdint.h>
+
+#include <cutils/list.h>
+
+/* A one-shot timer; a zeroed struct timer is valid and not pending. */
+struct timer {
+    struct listnode list;
+    uint64_t expires;               /* gettime_ms() deadline */
+    void (*func)(struct timer *timer);
+};
+
+int event_loop_init(void);
+int register_fd_handler(int fd, void (*handler)(void));
+void unregister_fd_handler(int fd);
+
+void timer_schedule(struct timer *timer, uint64_t expires,
+                    void (*func)(struct timer *timer));
+void timer_cancel(struct timer *timer);
+int timer_pending(const struct timer *timer);
+
+/* Runs expired timers, then waits up to timeout ms (-1 for ever), or until
+ * the next timer is due, for registered fds and calls their handlers. */
+void event_loop_wait(int timeout);
+
+#endif
@@ -24,7 +24,6 @@
 #include <sys/wait.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
-#include <sys/poll.h>
 #include <errno.h>
 #include <stdarg.h>
 #include <mtd/mtd-user.h>
@@ -51,6 +50,7 @@
 #include "log.h"
 #include "property_service.h"
 #include "bootchart.h"
+#include "boottrace.h"
 #include "signal_handler.h"
 #include "keychords.h"
 #include "init_parser.h"
@@ -89,7 +89,6 @@ void notify_service_state(const char *name, const char *state)
 
 static int have_console;
 static char console_name[PROP_VALUE_MAX] = "/dev/console";
-static time_t process_needs_restart;
 
 static const char *ENV[32];
 
@@ -164,7 +163,42 @@ static void publish_socket(const char *name, int fd)
     fcntl(fd, F_SETFD, 0);
 }
 
-void service_start(struct service *svc, const char *dynamic_args)
+/* What a service that starts after others is still waiting for */
+enum {
+    DEPS_READY,         /* nothing, it can start */
+    DEPS_STARTING,      /* a service that is on its way up or running once */
+    DEPS_WAITING,       /* only services that are themselves waiting */
+};
+
+static bool have_waiting_services;
+
+static int service_waits_for(struct service *svc)
+{
+    struct service *dep;
+    int ret = DEPS_READY;
+    int i;
+
+    for (i = 0; i < svc->nr_after; i++) {
+        dep = service_find_by_name(svc->after[i]);
+        if (!dep || dep == svc)
+            continue;
+
+        /* services that nobody is starting are not waited for */
+        if (dep->flags & SVC_ONESHOT) {
+            if (dep->flags & SVC_RUNNING)
+                return DEPS_STARTING;
+        } else if (dep->flags & SVC_RESTARTING) {
+            return DEPS_STARTING;
+        }
+        if (dep->flags & SVC_WAITING)
+            ret = DEPS_WAITING;
+    }
+
+    return ret;
+}
+
+static void service_launch(struct service *svc, const char *dynamic_args,
+                           bool wait)
 {
     struct stat s;
     pid_t pid;
@@ -177,7 +211,8 @@ void service_start(struct service *svc, const char *dynamic_args)
          * state and immediately takes it out of the restarting
          * state if it was in there
          */
-    svc->flags &= (~(SVC_DISABLED|SVC_RESTARTING|SVC_RESET|SVC_RESTART|SVC_DISABLED_START));
+    svc->flags &= (~(SVC_DISABLED|SVC_RESTARTING|SVC_RESET|SVC_RESTART|SVC_DISABLED_START|SVC_WAITING));
+    timer_cancel(&svc->restart_timer);
     svc->time_started = 0;
 
         /* running processes require no additional work -- if
@@ -189,6 +224,13 @@ void service_start(struct service *svc, const char *dynamic_args)
         return;
     }
 
+    if (wait && !dynamic_args && service_waits_for(svc) != DEPS_READY) {
+        INFO("service '%s' is waiting for the services it starts after\n", svc->name);
+        svc->flags |= SVC_WAITING;
+        have_waiting_services = true;
+        return;
+    }
+
     needs_console = (svc->flags & SVC_CONSOLE) ? 1 : 0;
     if (needs_console && (!have_console)) {
         ERROR("service '%s' requires console\n", svc->name);
@@ -364,20 +406,91 @@ void service_start(struct service *svc, const char *dynamic_args)
         return;
     }
 
-    svc->time_started = gettime();
+    svc->time_started = gettime_ms();
     svc->pid = pid;
     svc->flags |= SVC_RUNNING;
+    boottrace_event(BOOTTRACE_SERVICE_START, svc->name, pid);
 
     if (properties_inited())
         notify_service_state(svc->name, "running");
 }
 
+void service_start(struct service *svc, const char *dynamic_args)
+{
+    service_launch(svc, dynamic_args, true);
+}
+
+/* Marks a service to be started by service_start_waiting(), so that the
+ * services it starts after are known to be on their way up first.
+ */
+void service_request_start(struct service *svc)
+{
+    /* clears the reset and restart states as a start always has */
+    if (svc->flags & SVC_RUNNING) {
+        service_launch(svc, NULL, false);
+        return;
+    }
+    svc->flags |= SVC_WAITING;
+    have_waiting_services = true;
+}
+
+static int wave_started;
+static int wave_waiting;
+static int wave_starting;
+
+static void start_if_ready(struct service *svc)
+{
+    switch (service_waits_for(svc)) {
+    case DEPS_READY:
+        service_launch(svc, NULL, false);
+        wave_started++;
+        break;
+    case DEPS_STARTING:
+        wave_starting++;
+        /* fall through */
+    default:
+        wave_waiting++;
+        break;
+    }
+}
+
+static void start_regardless(struct service *svc)
+{
+    ERROR("service '%s' is part of a dependency cycle, starting it anyway\n",
+          svc->name);
+    service_launch(svc, NULL, false);
+}
+
+/* Starts, in waves, every waiting service whose dependencies are ready,
+ * which in turn releases the services that start after those.  The waves
+ * only order the starts; each is still a fork on the main loop.
+ */
+void service_start_waiting(void)
+{
+    if (!have_waiting_services)
+        return;
+
+    do {
+        wave_started = wave_waiting = wave_starting = 0;
+        service_for_each_flags(SVC_WAITING, start_if_ready);
+    } while (wave_started && wave_waiting);
+
+    /* waiting only on each other, nothing is ever going to change */
+    if (wave_waiting && !wave_started && !wave_starting) {
+        service_for_each_flags(SVC_WAITING, start_regardless);
+        wave_waiting = 0;
+    }
+
+    have_waiting_services = wave_waiting > 0;
+}
+
 /* The how field should be either SVC_DISABLED, SVC_RESET, or SVC_RESTART */
 static void service_stop_or_reset(struct service *svc, int how)
 {
     /* The service is still SVC_RUNNING until its process exits, but if it has
      * already exited it shoudn't attempt a restart yet. */
-    svc->flags &= ~(SVC_RESTARTING | SVC_DISABLED_START);
+    svc->flags &= ~(SVC_RESTARTING | SVC_DISABLED_START | SVC_WAITING);
+    timer_cancel(&svc->restart_timer);
 
     if ((how != SVC_DISABLED) && (how != SVC_RESET) && (how != SVC_RESTART)) {
         /* Hrm, an illegal flag.  Default to SVC_DISABLED */
@@ -426,29 +539,28 @@ void property_changed(const char *name, const char *value)
 {
     if (property_triggers_enabled)
         queue_property_triggers(name, value);
+
+    if ((!strcmp(name, "sys.boottrace") && !strcmp(value, "dump")) ||
+        (!strcmp(name, "sys.boot_completed") && !strcmp(value, "1")))
+        boottrace_write(BOOTTRACE_FILE, BOOTTRACE_UEVENTD_FILE);
 }
 
-static void restart_service_if_needed(struct service *svc)
+static void restart_service(struct timer *timer)
 {
-    time_t next_start_time = svc->time_started + 5;
+    struct service *svc = node_to_item(timer, struct service, restart_timer);
 
-    if (next_start_time <= gettime()) {
-        svc->flags &= (~SVC_RESTARTING);
-        service_start(svc, NULL);
-        return;
-    }
-
-    if ((next_start_time < process_needs_restart) ||
-        (process_needs_restart == 0)) {
-        process_needs_restart = next_start_time;
-    }
+    svc->flags &= (~SVC_RESTARTING);
+    service_start(svc, NULL);
 }
 
-static void restart_processes()
+/* Restarts a service that exited once it was started SERVICE_RESTART_DELAY_MS
+ * ago, so that one which keeps crashing doesn't spin.
+ */
+void service_schedule_restart(struct service *svc)
 {
-    process_needs_restart = 0;
-    service_for_each_flags(SVC_RESTARTING,
-                           restart_service_if_needed);
+    timer_schedule(&svc->restart_timer,
+                   svc->time_started + SERVICE_RESTART_DELAY_MS,
+                   restart_service);
 }
 
 static void msg_start(const char *name)
@@ -545,6 +657,8 @@ void execute_one_command(void)
 {
     int ret, i;
     char cmd_str[256] = "";
+    char trace_name[BOOTTRACE_NAME_LEN];
+    uint64_t start;
 
     if (!cur_action || !cur_command || is_last_command(cur_action, cur_command)) {
         cur_action = action_remove_queue_head();
@@ -552,6 +666,7 @@ void execute_one_command(void)
         if (!cur_action)
             return;
         INFO("processing action %p (%s)\n", cur_action, cur_action->name);
+        boottrace_event(BOOTTRACE_ACTION, cur_action->name, 0);
         cur_command = get_first_command(cur_action);
     } else {
         cur_command = get_next_command(cur_action, cur_command);
@@ -560,7 +675,13 @@ void execute_one_command(void)
     if (!cur_command)
         return;
 
+    start = boottrace_now();
     ret = cur_command->func(cur_command->nargs, cur_command->args);
+    snprintf(trace_name, sizeof(trace_name), "%s%s%s", cur_command->args[0],
+             cur_command->nargs > 1 ? " " : "",
+             cur_command->nargs > 1 ? cur_command->args[1] : "");
+    boottrace_event(BOOTTRACE_COMMAND, trace_name,
+                    (boottrace_now() - start) / 1000);
     if (klog_get_level() >= KLOG_INFO_LEVEL) {
         for (i = 0; i < cur_command->nargs; i++) {
             strlcat(cmd_str, cur_command->args[i], sizeof(cmd_str));
@@ -665,6 +786,8 @@ ret:
 static int keychord_init_action(int nargs, char **args)
 {
     keychord_init();
+    if (get_keychord_fd() > 0)
+        register_fd_handler(get_keychord_fd(), handle_keychord);
     return 0;
 }
 
@@ -821,6 +944,7 @@ static int property_service_init_action(int nargs, char **args)
         ERROR("start_property_service() failed\n");
         exit(1);
     }
+    register_fd_handler(get_property_set_fd(), handle_property_set_fd);
 
     return 0;
 }
@@ -832,6 +956,7 @@ static int signal_init_action(int nargs, char **args)
         ERROR("signal_init() failed\n");
         exit(1);
     }
+    register_fd_handler(get_signal_fd(), handle_signal);
     return 0;
 }
 
@@ -942,6 +1067,7 @@ int selinux_reload_policy(void)
         return -1;
     }
 
+    label_cache_flush();
     if (sehandle)
         selabel_close(sehandle);
 
@@ -1000,14 +1126,9 @@ static void selinux_initialize(void)
 
 int main(int argc, char **argv)
 {
-    int fd_count = 0;
-    struct pollfd ufds[4];
     char *tmpdev;
     char* debuggable;
     char tmp[32];
-    int property_set_fd_init = 0;
-    int signal_fd_init = 0;
-    int keychord_fd_init = 0;
     bool is_charger = false;
     bool is_ffbm = false;
 
@@ -1046,6 +1167,8 @@ int main(int argc, char **argv)
          */
     open_devnull_stdio();
     klog_init();
+    if (event_loop_init() < 0)
+        exit(1);
     property_init();
 
     get_hardware_name(hardware, &revision);
@@ -1116,42 +1239,21 @@ int main(int argc, char **argv)
 #endif
 
     for(;;) {
-        int nr, i, timeout = -1;
+        int timeout = -1;
+        int persist_timeout;
 
         execute_one_command();
-        restart_processes();
-
-        if (!property_set_fd_init && get_property_set_fd() > 0) {
-            ufds[fd_count].fd = get_property_set_fd();
-            ufds[fd_count].events = POLLIN;
-            ufds[fd_count].revents = 0;
-            fd_count++;
-            property_set_fd_init = 1;
-        }
-        if (!signal_fd_init && get_signal_fd() > 0) {
-            ufds[fd_count].fd = get_signal_fd();
-            ufds[fd_count].events = POLLIN;
-            ufds[fd_count].revents = 0;
-            fd_count++;
-            signal_fd_init = 1;
-        }
-        if (!keychord_fd_init && get_keychord_fd() > 0) {
-            ufds[fd_count].fd = get_keychord_fd();
-            ufds[fd_count].events = POLLIN;
-            ufds[fd_count].revents = 0;
-            fd_count++;
-            keychord_fd_init = 1;
-        }
-
-        if (process_needs_restart) {
-            timeout = (process_needs_restart - gettime()) * 1000;
-            if (timeout < 0)
-                timeout = 0;
-        }
+        service_start_waiting();
 
         if (!action_queue_empty() || cur_action)
             timeout = 0;
 
+        persist_timeout = persistent_properties_timeout();
+        if (persist_timeout == 0)
+            flush_persistent_properties();
+        else if (persist_timeout > 0 && (timeout < 0 || persist_timeout < timeout))
+            timeout = persist_timeout;
+
 #if BOOTCHART
         if (bootchart_count > 0) {
             if (timeout < 0 || timeout > BOOTCHART_POLLING_MS)
@@ -1163,20 +1265,7 @@ int main(int argc, char **argv)
         }
 #endif
 
-        nr = poll(ufds, fd_count, timeout);
-        if (nr <= 0)
-            continue;
-
-        for (i = 0; i < fd_count; i++) {
-            if (ufds[i].revents & POLLIN) {
-                if (ufds[i].fd == get_property_set_fd())
-                    handle_property_set_fd();
-                else if (ufds[i].fd == get_keychord_fd())
-                    handle_keychord();
-                else if (ufds[i].fd == get_signal_fd())
-                    handle_signal();
-            }
-        }
+        event_loop_wait(timeout);
     }
 
     return 0;
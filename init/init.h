@@ -19,6 +19,8 @@
 
 #include <cutils/list.h>
 
+#include "event_loop.h"
+
 #include <sys/stat.h>
 
 void handle_control_message(const char *msg, const char *arg);
@@ -48,6 +50,10 @@ struct action {
     unsigned hash;
     const char *name;
 
+        /* for property:<name>=<value> triggers, set at parse time */
+    char *prop_name;
+    const char *prop_value;
+
     struct listnode commands;
     struct command *current;
 };
@@ -79,11 +85,14 @@ struct svcenvinfo {
 #define SVC_RC_DISABLED 0x80  /* Remember if the disabled flag was set in the rc script */
 #define SVC_RESTART     0x100 /* Use to safely restart (stop, wait, start) a service */
 #define SVC_DISABLED_START 0x200 /* a start was requested but it was disabled at the time */
+#define SVC_WAITING     0x400 /* a start was requested but waits for services it runs after */
 
 #define NR_SVC_SUPP_GIDS 12    /* twelve supplementary groups */
 
 #define COMMAND_RETRY_TIMEOUT 5
 
+#define SERVICE_RESTART_DELAY_MS 5000
+
 #define COLDBOOT_RETRY_TIMEOUT 10
 
 struct service {
@@ -95,7 +104,8 @@ struct service {
 
     unsigned flags;
     pid_t pid;
-    time_t time_started;    /* time of last start */
+    uint64_t time_started;  /* gettime_ms() of last start */
+    struct timer restart_timer;
     time_t time_crashed;    /* first crash within inspection window */
     int nr_crashed;         /* number of times crashed within window */
     
@@ -119,6 +129,10 @@ struct service {
     int ioprio_class;
     int ioprio_pri;
 
+    /* services that must be running, or for oneshots have run, first */
+    char **after;
+    int nr_after;
+
     int nargs;
     /* "MUST BE AT THE END OF THE STRUCT" */
     char *args[1];
@@ -137,7 +151,10 @@ void service_for_each_flags(unsigned matchflags,
 void service_stop(struct service *svc);
 void service_reset(struct service *svc);
 void service_restart(struct service *svc);
+void service_schedule_restart(struct service *svc);
 void service_start(struct service *svc, const char *dynamic_args);
+void service_request_start(struct service *svc);
+void service_start_waiting(void);
 void property_changed(const char *name, const char *value);
 
 extern struct selabel_handle *sehandle;
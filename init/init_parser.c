@@ -23,6 +23,7 @@
 #include <stddef.h>
 #include <ctype.h>
 
+#include "boottrace.h"
 #include "init.h"
 #include "parser.h"
 #include "init_parser.h"
@@ -37,6 +38,30 @@ static list_declare(service_list);
 static list_declare(action_list);
 static list_declare(action_queue);
 
+/* Property triggers, hashed by property name, so that a property change
+ * only has to look at the actions that trigger on that property.
+ */
+#define PROP_TRIGGER_BUCKETS 256
+static struct listnode prop_triggers[PROP_TRIGGER_BUCKETS];
+
+static unsigned prop_trigger_hash(const char *name)
+{
+    unsigned hash = 5381;
+
+    while (*name)
+        hash = hash * 33 + (unsigned char)*name++;
+    return hash;
+}
+
+static struct listnode *prop_trigger_bucket(unsigned hash)
+{
+    struct listnode *bucket = &prop_triggers[hash % PROP_TRIGGER_BUCKETS];
+
+    if (!bucket->next)
+        list_init(bucket);
+    return bucket;
+}
+
 struct import {
     struct listnode list;
     const char *filename;
@@ -76,6 +101,9 @@ static struct {
 static int lookup_keyword(const char *s)
 {
     switch (*s++) {
+    case 'a':
+        if (!strcmp(s, "fter")) return K_after;
+        break;
     case 'c':
     if (!strcmp(s, "opy")) return K_copy;
         if (!strcmp(s, "apability")) return K_capability;
@@ -516,54 +544,44 @@ void action_for_each_trigger(const char *trigger,
 
 void queue_property_triggers(const char *name, const char *value)
 {
+    struct listnode *bucket;
     struct listnode *node;
     struct action *act;
-    list_for_each(node, &action_list) {
-        act = node_to_item(node, struct action, alist);
-        if (!strncmp(act->name, "property:", strlen("property:"))) {
-            const char *test = act->name + strlen("property:");
-            int name_length = strlen(name);
-
-            if (!strncmp(name, test, name_length) &&
-                    test[name_length] == '=' &&
-                    (!strcmp(test + name_length + 1, value) ||
-                     !strcmp(test + name_length + 1, "*"))) {
-                action_add_queue_tail(act);
-            }
+    unsigned hash = prop_trigger_hash(name);
+    uint32_t queued = 0;
+
+    bucket = prop_trigger_bucket(hash);
+    list_for_each(node, bucket) {
+        act = node_to_item(node, struct action, tlist);
+        if (act->hash == hash && !strcmp(act->prop_name, name) &&
+                (!strcmp(act->prop_value, value) ||
+                 !strcmp(act->prop_value, "*"))) {
+            action_add_queue_tail(act);
+            queued++;
         }
     }
+
+    if (queued)
+        boottrace_event(BOOTTRACE_PROPERTY, name, queued);
 }
 
 void queue_all_property_triggers()
 {
     struct listnode *node;
     struct action *act;
+    char value[PROP_VALUE_MAX];
+    int ret;
+
     list_for_each(node, &action_list) {
         act = node_to_item(node, struct action, alist);
-        if (!strncmp(act->name, "property:", strlen("property:"))) {
-            /* parse property name and value
-               syntax is property:<name>=<value> */
-            const char* name = act->name + strlen("property:");
-            const char* equals = strchr(name, '=');
-            if (equals) {
-                char prop_name[PROP_NAME_MAX + 1];
-                char value[PROP_VALUE_MAX];
-                int length = equals - name;
-                if (length > PROP_NAME_MAX) {
-                    ERROR("property name too long in trigger %s", act->name);
-                } else {
-                    int ret;
-                    memcpy(prop_name, name, length);
-                    prop_name[length] = 0;
-
-                    /* does the property exist, and match the trigger value? */
-                    ret = property_get(prop_name, value);
-                    if (ret > 0 && (!strcmp(equals + 1, value) ||
-                                    !strcmp(equals + 1, "*"))) {
-                        action_add_queue_tail(act);
-                    }
-                }
-            }
+        if (!act->prop_name)
+            continue;
+
+        /* does the property exist, and match the trigger value? */
+        ret = property_get(act->prop_name, value);
+        if (ret > 0 && (!strcmp(act->prop_value, value) ||
+                        !strcmp(act->prop_value, "*"))) {
+            action_add_queue_tail(act);
         }
     }
 }
@@ -662,6 +680,21 @@ static void parse_line_service(struct parse_state *state, int nargs, char **args
 
     kw = lookup_keyword(args[0]);
     switch (kw) {
+    case K_after:
+        if (nargs < 2) {
+            parse_error(state, "after option requires at least one service\n");
+        } else {
+            char **after = realloc(svc->after,
+                    (svc->nr_after + nargs - 1) * sizeof(*after));
+            if (!after) {
+                parse_error(state, "out of memory\n");
+                break;
+            }
+            for (i = 1; i < nargs; i++)
+                after[svc->nr_after++] = args[i];
+            svc->after = after;
+        }
+        break;
     case K_capability:
         break;
     case K_class:
@@ -823,6 +856,28 @@ static void parse_line_service(struct parse_state *state, int nargs, char **args
     }
 }
 
+static void add_prop_trigger(struct parse_state *state, struct action *act)
+{
+    const char *name = act->name + strlen("property:");
+    const char *equals = strchr(name, '=');
+    int length;
+
+    /* syntax is property:<name>=<value> */
+    if (!equals)
+        return;
+
+    length = equals - name;
+    if (length > PROP_NAME_MAX) {
+        parse_error(state, "property name too long in trigger %s\n", act->name);
+        return;
+    }
+
+    act->prop_name = strndup(name, length);
+    act->prop_value = equals + 1;
+    act->hash = prop_trigger_hash(act->prop_name);
+    list_add_tail(prop_trigger_bucket(act->hash), &act->tlist);
+}
+
 static void *parse_action(struct parse_state *state, int nargs, char **args)
 {
     struct action *act;
@@ -839,7 +894,8 @@ static void *parse_action(struct parse_state *state, int nargs, char **args)
     list_init(&act->commands);
     list_init(&act->qlist);
     list_add_tail(&action_list, &act->alist);
-        /* XXX add to hash */
+    if (!strncmp(act->name, "property:", strlen("property:")))
+        add_prop_trigger(state, act);
     return act;
 }
 
@@ -46,6 +46,7 @@ int do_wait(int nargs, char **args);
 enum {
     K_UNKNOWN,
 #endif
+    KEYWORD(after,       OPTION,  0, 0)
     KEYWORD(capability,  OPTION,  0, 0)
     KEYWORD(chdir,       COMMAND, 1, do_chdir)
     KEYWORD(chroot,      COMMAND, 1, do_chroot)
@@ -43,6 +43,8 @@
 #include <dirent.h>
 #include <limits.h>
 #include <errno.h>
+#include <stdint.h>
+#include <time.h>
 #include <sys/poll.h>
 
 #include <cutils/misc.h>
@@ -59,6 +61,7 @@
 #include <netinet/in.h>
 #include <sys/mman.h>
 #include <private/android_filesystem_config.h>
+#include <private/android_property_batch.h>
 
 #include <selinux/selinux.h>
 #include <selinux/label.h>
@@ -70,6 +73,8 @@
 #include "vendor_init.h"
 
 #define PERSISTENT_PROPERTY_DIR  "/data/property"
+#define PERSISTENT_PROPERTY_JOURNAL     PERSISTENT_PROPERTY_DIR "/journal"
+#define PERSISTENT_PROPERTY_JOURNAL_TMP PERSISTENT_PROPERTY_DIR "/.journal.tmp"
 
 static int persistent_properties_loaded = 0;
 static int property_area_inited = 0;
@@ -245,27 +250,269 @@ int __property_get(const char *name, char *value)
     return __system_property_get(name, value);
 }
 
-static void write_persistent_property(const char *name, const char *value)
+/*
+ * Persistent properties are kept in a single append-only journal. Each
+ * record holds one name and value, and is protected by a CRC32 so that a
+ * record torn by a crash is detected, and dropped, at the next load.
+ * Writes are batched for PERSIST_FLUSH_DELAY_MS so that a burst of
+ * property sets costs one write and one fsync. Once the journal has grown
+ * well past its live contents it is rewritten into a temporary file that
+ * is then renamed over it.
+ */
+#define PERSIST_JOURNAL_MAGIC   0x4a505250  /* "PRPJ" */
+#define PERSIST_FLUSH_DELAY_MS  100
+#define PERSIST_COMPACT_SLACK   (16 * 1024)
+#define PERSIST_NAME_BUCKETS    64
+
+struct persist_record {
+    uint32_t crc;
+    uint16_t name_len;
+    uint16_t value_len;
+};
+
+struct persist_name {
+    struct persist_name *next;
+    char name[];
+};
+
+static struct persist_name *persist_names[PERSIST_NAME_BUCKETS];
+static int persist_journal_fd = -1;
+static off_t persist_journal_size;
+static off_t persist_live_size;
+static char *persist_pending;
+static size_t persist_pending_len;
+static size_t persist_pending_size;
+static long long persist_flush_time;
+
+static long long persist_now_ms(void)
 {
-    char tempPath[PATH_MAX];
-    char path[PATH_MAX];
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static uint32_t persist_crc32(uint32_t crc, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    int k;
+
+    crc = ~crc;
+    while (len--) {
+        crc ^= *p++;
+        for (k = 0; k < 8; k++)
+            crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+static unsigned persist_name_hash(const char *name, size_t len)
+{
+    unsigned hash = 5381;
+
+    while (len--)
+        hash = hash * 33 + (unsigned char)*name++;
+    return hash % PERSIST_NAME_BUCKETS;
+}
+
+/* Remembers that name is persistent; returns 1 if it was already known */
+static int persist_name_add(const char *name, size_t len)
+{
+    struct persist_name **bucket = &persist_names[persist_name_hash(name, len)];
+    struct persist_name *pn;
+
+    for (pn = *bucket; pn; pn = pn->next) {
+        if (!strncmp(pn->name, name, len) && pn->name[len] == '\0')
+            return 1;
+    }
+
+    pn = malloc(sizeof(*pn) + len + 1);
+    if (!pn)
+        return 0;
+    memcpy(pn->name, name, len);
+    pn->name[len] = '\0';
+    pn->next = *bucket;
+    *bucket = pn;
+    return 0;
+}
+
+static void persist_names_clear(void)
+{
+    struct persist_name *pn, *next;
+    int i;
+
+    for (i = 0; i < PERSIST_NAME_BUCKETS; i++) {
+        for (pn = persist_names[i]; pn; pn = next) {
+            next = pn->next;
+            free(pn);
+        }
+        persist_names[i] = NULL;
+    }
+}
+
+static int persist_append(char **buf, size_t *len, size_t *size,
+                          const char *name, const char *value)
+{
+    struct persist_record rec;
+    size_t name_len = strlen(name);
+    size_t value_len = strlen(value);
+    size_t need = *len + sizeof(rec) + name_len + value_len;
+    char *p;
+
+    if (need > *size) {
+        size_t new_size = *size ? *size * 2 : 4096;
+        while (new_size < need)
+            new_size *= 2;
+        p = realloc(*buf, new_size);
+        if (!p)
+            return -1;
+        *buf = p;
+        *size = new_size;
+    }
+
+    rec.name_len = name_len;
+    rec.value_len = value_len;
+    rec.crc = persist_crc32(0, &rec.name_len,
+                            sizeof(rec) - offsetof(struct persist_record, name_len));
+    rec.crc = persist_crc32(rec.crc, name, name_len);
+    rec.crc = persist_crc32(rec.crc, value, value_len);
+
+    p = *buf + *len;
+    memcpy(p, &rec, sizeof(rec));
+    memcpy(p + sizeof(rec), name, name_len);
+    memcpy(p + sizeof(rec) + name_len, value, value_len);
+    *len = need;
+    return 0;
+}
+
+static int persist_write_all(int fd, const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = TEMP_FAILURE_RETRY(write(fd, buf, len));
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void persist_sync_dir(void)
+{
+    int fd = open(PERSISTENT_PROPERTY_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+/* Rewrites the journal with one record per persistent property */
+static int compact_persistent_journal(void)
+{
+    struct persist_name *pn;
+    char value[PROP_VALUE_MAX];
+    uint32_t magic = PERSIST_JOURNAL_MAGIC;
+    char *buf = NULL;
+    size_t len = 0;
+    size_t size = 0;
     int fd;
+    int i;
 
-    snprintf(tempPath, sizeof(tempPath), "%s/.temp.XXXXXX", PERSISTENT_PROPERTY_DIR);
-    fd = mkstemp(tempPath);
-    if (fd < 0) {
-        ERROR("Unable to write persistent property to temp file %s errno: %d\n", tempPath, errno);
-        return;
+    size = 4096;
+    buf = malloc(size);
+    if (!buf)
+        goto err;
+    memcpy(buf, &magic, sizeof(magic));
+    len = sizeof(magic);
+
+    for (i = 0; i < PERSIST_NAME_BUCKETS; i++) {
+        for (pn = persist_names[i]; pn; pn = pn->next) {
+            __property_get(pn->name, value);
+            if (persist_append(&buf, &len, &size, pn->name, value) < 0)
+                goto err;
+        }
+    }
+
+    fd = open(PERSISTENT_PROPERTY_JOURNAL_TMP,
+              O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd < 0)
+        goto err;
+    if (persist_write_all(fd, buf, len) < 0 || fsync(fd) < 0) {
+        close(fd);
+        unlink(PERSISTENT_PROPERTY_JOURNAL_TMP);
+        goto err;
     }
-    write(fd, value, strlen(value));
-    fsync(fd);
     close(fd);
 
-    snprintf(path, sizeof(path), "%s/%s", PERSISTENT_PROPERTY_DIR, name);
-    if (rename(tempPath, path)) {
-        unlink(tempPath);
-        ERROR("Unable to rename persistent property file %s to %s\n", tempPath, path);
+    if (rename(PERSISTENT_PROPERTY_JOURNAL_TMP, PERSISTENT_PROPERTY_JOURNAL)) {
+        unlink(PERSISTENT_PROPERTY_JOURNAL_TMP);
+        goto err;
+    }
+    persist_sync_dir();
+
+    if (persist_journal_fd >= 0)
+        close(persist_journal_fd);
+    persist_journal_fd = open(PERSISTENT_PROPERTY_JOURNAL,
+                              O_WRONLY | O_APPEND | O_NOFOLLOW | O_CLOEXEC);
+    persist_journal_size = len;
+    persist_live_size = len;
+    free(buf);
+    return 0;
+
+err:
+    ERROR("Unable to compact persistent property journal errno: %d\n", errno);
+    free(buf);
+    return -1;
+}
+
+void flush_persistent_properties(void)
+{
+    if (!persist_pending_len)
+        return;
+
+    if (persist_journal_fd < 0 ||
+            persist_write_all(persist_journal_fd, persist_pending,
+                              persist_pending_len) < 0 ||
+            fsync(persist_journal_fd) < 0) {
+        ERROR("Unable to append to persistent property journal errno: %d\n", errno);
+        /* cut off anything that made it out, and start over from memory */
+        if (persist_journal_fd >= 0)
+            ftruncate(persist_journal_fd, persist_journal_size);
+        compact_persistent_journal();
+    } else {
+        persist_journal_size += persist_pending_len;
+        if (persist_journal_size > 2 * persist_live_size + PERSIST_COMPACT_SLACK)
+            compact_persistent_journal();
     }
+
+    persist_pending_len = 0;
+    persist_flush_time = 0;
+}
+
+int persistent_properties_timeout(void)
+{
+    long long now;
+
+    if (!persist_pending_len)
+        return -1;
+
+    now = persist_now_ms();
+    return now >= persist_flush_time ? 0 : (int)(persist_flush_time - now);
+}
+
+static void write_persistent_property(const char *name, const char *value)
+{
+    persist_name_add(name, strlen(name));
+    if (persist_append(&persist_pending, &persist_pending_len,
+                       &persist_pending_size, name, value) < 0) {
+        ERROR("Unable to queue persistent property %s\n", name);
+        return;
+    }
+    if (!persist_flush_time)
+        persist_flush_time = persist_now_ms() + PERSIST_FLUSH_DELAY_MS;
 }
 
 static bool is_legal_property_name(const char* name, size_t namelen)
@@ -345,12 +592,104 @@ int property_set(const char *name, const char *value)
     return 0;
 }
 
+/* Sets one property on behalf of a client; returns 0 on success */
+static int set_property_for_client(prop_msg *msg, struct ucred *cr,
+                                   char *source_ctx)
+{
+    if (memcmp(msg->name, "ctl.", 4) == 0) {
+        if (check_control_mac_perms(msg->value, source_ctx)) {
+            handle_control_message((char*) msg->name + 4, (char*) msg->value);
+            return 0;
+        }
+        ERROR("sys_prop: Unable to %s service ctl [%s] uid:%d gid:%d pid:%d\n",
+                msg->name + 4, msg->value, cr->uid, cr->gid, cr->pid);
+        return -1;
+    }
+
+    if (check_perms(msg->name, source_ctx)) {
+        return property_set((char*) msg->name, (char*) msg->value) ? -1 : 0;
+    }
+    ERROR("sys_prop: permission denied uid:%d  name:%s\n",
+          cr->uid, msg->name);
+    return -1;
+}
+
+/* Reads a whole prop_msg, which may arrive in pieces, by the given
+ * gettime_ms() deadline.
+ */
+static int recv_prop_msg(int s, prop_msg *msg, uint64_t deadline, struct ucred *cr)
+{
+    struct pollfd ufds[1];
+    size_t len = 0;
+    uint64_t now;
+    int nr;
+    int r;
+
+    while (len < sizeof(*msg)) {
+        now = gettime_ms();
+        ufds[0].fd = s;
+        ufds[0].events = POLLIN;
+        ufds[0].revents = 0;
+        nr = now >= deadline ? 0 :
+                TEMP_FAILURE_RETRY(poll(ufds, 1, deadline - now));
+        if (nr <= 0) {
+            ERROR("sys_prop: timeout waiting for uid=%d to send property batch.\n", cr->uid);
+            return -1;
+        }
+
+        r = TEMP_FAILURE_RETRY(recv(s, (char *) msg + len, sizeof(*msg) - len,
+                                    MSG_DONTWAIT));
+        if (r <= 0) {
+            ERROR("sys_prop: short property batch from uid=%d errno: %d\n", cr->uid, errno);
+            return -1;
+        }
+        len += r;
+    }
+
+    msg->name[PROP_NAME_MAX-1] = 0;
+    msg->value[PROP_VALUE_MAX-1] = 0;
+    return 0;
+}
+
+/* Handles the properties of a PROP_MSG_SETPROP_BATCH connection, answering
+ * each one as soon as it has been set.  The whole batch has to arrive by
+ * |deadline|, so a slow client cannot hold init for longer than one
+ * connection's timeout.
+ */
+static void handle_property_set_batch(int s, unsigned count, struct ucred *cr,
+                                      uint64_t deadline)
+{
+    char *source_ctx = NULL;
+    prop_msg msg;
+    int32_t result;
+
+    getpeercon(s, &source_ctx);
+
+    while (count--) {
+        if (recv_prop_msg(s, &msg, deadline, cr) < 0)
+            break;
+
+        if (msg.cmd != PROP_MSG_SETPROP ||
+                !is_legal_property_name(msg.name, strlen(msg.name))) {
+            ERROR("sys_prop: illegal property in batch. Got: \"%s\"\n", msg.name);
+            result = -1;
+        } else {
+            result = set_property_for_client(&msg, cr, source_ctx);
+        }
+
+        if (TEMP_FAILURE_RETRY(send(s, &result, sizeof(result), MSG_NOSIGNAL)) !=
+                sizeof(result))
+            break;
+    }
+
+    freecon(source_ctx);
+}
+
 void handle_property_set_fd()
 {
     prop_msg msg;
     int s;
     int r;
-    int res;
     struct ucred cr;
     struct sockaddr_un addr;
     socklen_t addr_size = sizeof(addr);
@@ -359,10 +698,13 @@ void handle_property_set_fd()
     struct pollfd ufds[1];
     const int timeout_ms = 2 * 1000;  /* Default 2 sec timeout for caller to send property. */
     int nr;
+    unsigned count;
+    uint64_t deadline;
 
     if ((s = accept(property_set_fd, (struct sockaddr *) &addr, &addr_size)) < 0) {
         return;
     }
+    deadline = gettime_ms() + timeout_ms;
 
     /* Check socket options here */
     if (getsockopt(s, SOL_SOCKET, SO_PEERCRED, &cr, &cr_size) < 0) {
@@ -410,19 +752,9 @@ void handle_property_set_fd()
             // Keep the old close-socket-early behavior when handling
             // ctl.* properties.
             close(s);
-            if (check_control_mac_perms(msg.value, source_ctx)) {
-                handle_control_message((char*) msg.name + 4, (char*) msg.value);
-            } else {
-                ERROR("sys_prop: Unable to %s service ctl [%s] uid:%d gid:%d pid:%d\n",
-                        msg.name + 4, msg.value, cr.uid, cr.gid, cr.pid);
-            }
+            set_property_for_client(&msg, &cr, source_ctx);
         } else {
-            if (check_perms(msg.name, source_ctx)) {
-                property_set((char*) msg.name, (char*) msg.value);
-            } else {
-                ERROR("sys_prop: permission denied uid:%d  name:%s\n",
-                      cr.uid, msg.name);
-            }
+            set_property_for_client(&msg, &cr, source_ctx);
 
             // Note: bionic's property client code assumes that the
             // property server will not close the socket until *AFTER*
@@ -432,6 +764,18 @@ void handle_property_set_fd()
         freecon(source_ctx);
         break;
 
+    case PROP_MSG_SETPROP_BATCH:
+        msg.value[PROP_VALUE_MAX-1] = 0;
+        count = strtoul(msg.value, NULL, 10);
+        if (count > PROP_BATCH_MAX) {
+            ERROR("sys_prop: batch of %u properties from uid=%d is too large\n",
+                  count, cr.uid);
+        } else {
+            handle_property_set_batch(s, count, &cr, deadline);
+        }
+        close(s);
+        break;
+
     default:
         close(s);
         break;
@@ -523,7 +867,7 @@ static void load_properties_from_file(const char *fn, const char *filter)
     }
 }
 
-static void load_persistent_properties()
+static int load_legacy_persistent_properties()
 {
     DIR* dir = opendir(PERSISTENT_PROPERTY_DIR);
     int dir_fd;
@@ -570,6 +914,7 @@ static void load_persistent_properties()
             length = read(fd, value, sizeof(value) - 1);
             if (length >= 0) {
                 value[length] = 0;
+                persist_name_add(entry->d_name, strlen(entry->d_name));
                 property_set(entry->d_name, value);
             } else {
                 ERROR("Unable to read persistent property file %s errno: %d\n",
@@ -580,6 +925,156 @@ static void load_persistent_properties()
         closedir(dir);
     } else {
         ERROR("Unable to open persistent property directory %s errno: %d\n", PERSISTENT_PROPERTY_DIR, errno);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void remove_legacy_persistent_properties(void)
+{
+    struct persist_name *pn;
+    char path[PATH_MAX];
+    int i;
+
+    for (i = 0; i < PERSIST_NAME_BUCKETS; i++) {
+        for (pn = persist_names[i]; pn; pn = pn->next) {
+            snprintf(path, sizeof(path), "%s/%s", PERSISTENT_PROPERTY_DIR, pn->name);
+            unlink(path);
+        }
+    }
+}
+
+
+/* Reads the whole journal in one go and sets the last value recorded for
+ * each property. Returns -1 if there is no journal to read.
+ */
+static int load_persistent_journal(void)
+{
+    struct persist_record rec;
+    struct stat sb;
+    char name[PROP_NAME_MAX];
+    char value[PROP_VALUE_MAX];
+    uint32_t magic;
+    size_t *records = NULL;
+    size_t nrecords = 0;
+    size_t live = sizeof(magic);
+    size_t end;
+    size_t off;
+    char *buf;
+    ssize_t n;
+    size_t len;
+    uint32_t crc;
+    int fd;
+
+    fd = open(PERSISTENT_PROPERTY_JOURNAL, O_RDWR | O_APPEND | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno != ENOENT)
+            ERROR("Unable to open persistent property journal errno: %d\n", errno);
+        return -1;
+    }
+
+    // The journal must not be accessible to others, be owned by root/root,
+    // and not be a hard link to any other file.
+    if (fstat(fd, &sb) < 0 || (sb.st_mode & (S_IRWXG | S_IRWXO)) != 0 ||
+            sb.st_uid != 0 || sb.st_gid != 0 || sb.st_nlink != 1) {
+        ERROR("skipping insecure persistent property journal\n");
+        close(fd);
+        return -1;
+    }
+
+    buf = malloc(sb.st_size ? sb.st_size : 1);
+    if (!buf) {
+        close(fd);
+        return -1;
+    }
+    for (len = 0; len < (size_t)sb.st_size; len += n) {
+        n = TEMP_FAILURE_RETRY(pread(fd, buf + len, sb.st_size - len, len));
+        if (n <= 0)
+            break;
+    }
+
+    if (len >= sizeof(magic))
+        memcpy(&magic, buf, sizeof(magic));
+    if (len < sizeof(magic) || magic != PERSIST_JOURNAL_MAGIC) {
+        ERROR("persistent property journal is corrupt, ignoring it\n");
+        free(buf);
+        close(fd);
+        return -1;
+    }
+
+    /* collect the intact records; anything from the first bad one on is
+     * the remains of an interrupted write */
+    for (off = sizeof(magic); off + sizeof(rec) <= len; ) {
+        memcpy(&rec, buf + off, sizeof(rec));
+        if (rec.name_len == 0 || rec.name_len >= PROP_NAME_MAX ||
+                rec.value_len >= PROP_VALUE_MAX ||
+                off + sizeof(rec) + rec.name_len + rec.value_len > len)
+            break;
+        crc = persist_crc32(0, &rec.name_len,
+                            sizeof(rec) - offsetof(struct persist_record, name_len));
+        crc = persist_crc32(crc, buf + off + sizeof(rec),
+                            rec.name_len + rec.value_len);
+        if (crc != rec.crc)
+            break;
+
+        if ((nrecords & (nrecords - 1)) == 0) {
+            size_t *r = realloc(records, (nrecords ? nrecords * 2 : 64) * sizeof(*r));
+            if (!r)
+                break;
+            records = r;
+        }
+        records[nrecords++] = off;
+        off += sizeof(rec) + rec.name_len + rec.value_len;
+    }
+
+    end = off;
+    if (end != len) {
+        ERROR("dropping %zu bytes from the end of the persistent property journal\n",
+              len - end);
+        ftruncate(fd, end);
+    }
+
+    /* later records override earlier ones, so only the last one counts */
+    while (nrecords--) {
+        off = records[nrecords];
+        memcpy(&rec, buf + off, sizeof(rec));
+        if (persist_name_add(buf + off + sizeof(rec), rec.name_len))
+            continue;
+        live += sizeof(rec) + rec.name_len + rec.value_len;
+        memcpy(name, buf + off + sizeof(rec), rec.name_len);
+        name[rec.name_len] = '\0';
+        memcpy(value, buf + off + sizeof(rec) + rec.name_len, rec.value_len);
+        value[rec.value_len] = '\0';
+        property_set(name, value);
+    }
+
+    free(records);
+    free(buf);
+
+    persist_journal_fd = fd;
+    persist_journal_size = end;
+    persist_live_size = live;
+    return 0;
+}
+
+static void load_persistent_properties()
+{
+    /* Forget about anything persisted before /data was mounted */
+    flush_persistent_properties();
+    if (persist_journal_fd >= 0) {
+        close(persist_journal_fd);
+        persist_journal_fd = -1;
+    }
+    persist_names_clear();
+
+    if (load_persistent_journal() == 0) {
+        if (persist_journal_size > 2 * persist_live_size + PERSIST_COMPACT_SLACK)
+            compact_persistent_journal();
+    } else if (load_legacy_persistent_properties() == 0) {
+        /* move properties stored one per file into a new journal */
+        if (compact_persistent_journal() == 0)
+            remove_legacy_persistent_properties();
     }
 
     persistent_properties_loaded = 1;
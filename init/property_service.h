@@ -30,6 +30,8 @@ void get_property_workspace(int *fd, int *sz);
 extern int __property_get(const char *name, char *value);
 extern int property_set(const char *name, const char *value);
 extern int properties_inited();
+extern void flush_persistent_properties(void);
+extern int persistent_properties_timeout(void);
 int get_property_set_fd(void);
 
 extern void __property_get_size_error()
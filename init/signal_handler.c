@@ -26,6 +26,7 @@
 #include <cutils/android_reboot.h>
 #include <cutils/list.h>
 
+#include "boottrace.h"
 #include "init.h"
 #include "util.h"
 #include "log.h"
@@ -70,6 +71,7 @@ static int wait_for_one_process(int block)
     }
 
     NOTICE("process '%s', pid %d exited\n", svc->name, pid);
+    boottrace_event(BOOTTRACE_SERVICE_EXIT, svc->name, pid);
 
     if (!(svc->flags & SVC_ONESHOT) || (svc->flags & SVC_RESTART)) {
         kill(-pid, SIGKILL);
@@ -116,6 +118,7 @@ static int wait_for_one_process(int block)
 
     svc->flags &= (~SVC_RESTART);
     svc->flags |= SVC_RESTARTING;
+    service_schedule_restart(svc);
 
     /* Execute all onrestart commands for this service. */
     list_for_each(node, &svc->onrestart.commands) {
@@ -7,6 +7,7 @@ enum {
     KEYWORD(subsystem,      SECTION,    1)
     KEYWORD(devname,        OPTION,     1)
     KEYWORD(dirname,        OPTION,     1)
+    KEYWORD(firmware_prefetch, COMMAND, 1)
 #ifdef __MAKE_KEYWORD_ENUM__
     KEYWORD_COUNT,
 };
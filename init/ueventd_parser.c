@@ -22,6 +22,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "devices.h"
 #include "ueventd.h"
 #include "ueventd_parser.h"
 #include "parser.h"
@@ -34,6 +35,7 @@ static void parse_line_device(struct parse_state *state, int nargs, char **args)
 
 #define SECTION 0x01
 #define OPTION  0x02
+#define COMMAND 0x04
 
 #include "ueventd_keywords.h"
 
@@ -60,6 +62,9 @@ static int lookup_keyword(const char *s)
         if (!strcmp(s, "evname")) return K_devname;
         if (!strcmp(s, "irname")) return K_dirname;
         break;
+    case 'f':
+        if (!strcmp(s, "irmware_prefetch")) return K_firmware_prefetch;
+        break;
     case 's':
         if (!strcmp(s, "ubsystem")) return K_subsystem;
         break;
@@ -177,6 +182,19 @@ static void parse_new_section(struct parse_state *state, int kw,
     state->parse_line = parse_line_no_op;
 }
 
+static void parse_command(struct parse_state *state, int kw,
+        int nargs, char **args)
+{
+    int i;
+
+    switch (kw) {
+    case K_firmware_prefetch:
+        for (i = 1; i < nargs; i++)
+            add_firmware_prefetch(args[i]);
+        break;
+    }
+}
+
 static void parse_line(struct parse_state *state, char **args, int nargs)
 {
     int kw = lookup_keyword(args[0]);
@@ -192,6 +210,8 @@ static void parse_line(struct parse_state *state, char **args, int nargs)
         parse_new_section(state, kw, nargs, args);
     } else if (kw_is(kw, OPTION)) {
         state->parse_line(state, nargs, args);
+    } else if (kw_is(kw, COMMAND)) {
+        parse_command(state, kw, nargs, args);
     } else {
         parse_line_device(state, nargs, args);
     }
@@ -115,12 +115,9 @@ int create_socket(const char *name, int type, mode_t perm, uid_t uid,
         goto out_close;
     }
 
-    filecon = NULL;
-    if (sehandle) {
-        ret = selabel_lookup(sehandle, &filecon, addr.sun_path, S_IFSOCK);
-        if (ret == 0)
-            setfscreatecon(filecon);
-    }
+    filecon = lookup_label(addr.sun_path, NULL, S_IFSOCK);
+    if (filecon)
+        setfscreatecon(filecon);
 
     ret = bind(fd, (struct sockaddr *) &addr, sizeof (addr));
     if (ret) {
@@ -129,7 +126,6 @@ int create_socket(const char *name, int type, mode_t perm, uid_t uid,
     }
 
     setfscreatecon(NULL);
-    freecon(filecon);
 
     chown(addr.sun_path, uid, gid);
     chmod(addr.sun_path, perm);
@@ -280,6 +276,22 @@ time_t gettime(void)
     return ts.tv_sec;
 }
 
+/*
+ * gettime_ms() - returns the time in milliseconds of the system's monotonic
+ * clock or zero on error.
+ */
+uint64_t gettime_ms(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0) {
+        ERROR("clock_gettime(CLOCK_MONOTONIC) failed: %s\n", strerror(errno));
+        return 0;
+    }
+
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
 int mkdir_recursive(const char *pathname, mode_t mode)
 {
     char buf[128];
@@ -502,22 +514,146 @@ void import_kernel_cmdline(int in_qemu,
     }
 }
 
+/*
+ * Cache of file labels looked up with sehandle, keyed by path, mode and
+ * symlinks. Matching file_contexts is a walk over its regular expressions,
+ * and ueventd and init ask for the same few thousand paths over and over
+ * again, so each answer is kept until the handle is replaced and
+ * label_cache_flush() is called.
+ */
+#define LABEL_CACHE_BUCKETS 256
+#define LABEL_CACHE_MAX     4096
+
+struct label_cache_entry {
+    struct label_cache_entry *next;
+    unsigned hash;
+    mode_t mode;
+    char *context;          /* NULL if the lookup failed */
+    size_t key_len;
+    char key[];             /* path and links, each NUL terminated */
+};
+
+static struct label_cache_entry *label_cache[LABEL_CACHE_BUCKETS];
+static unsigned int label_cache_count;
+
+void label_cache_flush(void)
+{
+    struct label_cache_entry *entry;
+    int i;
+
+    for (i = 0; i < LABEL_CACHE_BUCKETS; i++) {
+        while ((entry = label_cache[i]) != NULL) {
+            label_cache[i] = entry->next;
+            freecon(entry->context);
+            free(entry);
+        }
+    }
+    label_cache_count = 0;
+}
+
+static size_t label_key(char *key, const char *path, const char **links)
+{
+    size_t len = strlen(path) + 1;
+    size_t n;
+    int i;
+
+    if (key)
+        memcpy(key, path, len);
+    for (i = 0; links && links[i]; i++) {
+        n = strlen(links[i]) + 1;
+        if (key)
+            memcpy(key + len, links[i], n);
+        len += n;
+    }
+    return len;
+}
+
+static unsigned label_hash(const char *key, size_t len, mode_t mode)
+{
+    unsigned hash = 5381 + mode;
+
+    while (len--)
+        hash = hash * 33 + (unsigned char) *key++;
+    return hash;
+}
+
+/*
+ * Looks up the label of path, created with mode, the way
+ * selabel_lookup_best_match() does when links is not NULL. The returned
+ * context belongs to the cache: it must not be freed, and is only valid
+ * until the next flush.
+ */
+char *lookup_label(const char *path, const char **links, mode_t mode)
+{
+    struct label_cache_entry *entry;
+    struct label_cache_entry *cached;
+    char *context = NULL;
+    size_t key_len;
+    unsigned hash;
+
+    if (!sehandle)
+        return NULL;
+
+    /* build the key in place, it becomes the entry on a miss */
+    key_len = label_key(NULL, path, links);
+    entry = malloc(sizeof(*entry) + key_len);
+    if (entry) {
+        label_key(entry->key, path, links);
+        hash = label_hash(entry->key, key_len, mode);
+
+        for (cached = label_cache[hash % LABEL_CACHE_BUCKETS]; cached; cached = cached->next) {
+            if (cached->hash == hash && cached->mode == mode &&
+                    cached->key_len == key_len &&
+                    !memcmp(cached->key, entry->key, key_len)) {
+                free(entry);
+                return cached->context;
+            }
+        }
+    }
+
+    if (links) {
+        if (selabel_lookup_best_match(sehandle, &context, path, links, mode) < 0)
+            context = NULL;
+    } else {
+        if (selabel_lookup(sehandle, &context, path, mode) < 0)
+            context = NULL;
+    }
+
+    if (!entry) {
+        /* keep the answer alive until the next uncached lookup */
+        static char *uncached;
+        freecon(uncached);
+        uncached = context;
+        return context;
+    }
+
+    if (label_cache_count >= LABEL_CACHE_MAX)
+        label_cache_flush();
+
+    entry->hash = hash;
+    entry->mode = mode;
+    entry->context = context;
+    entry->key_len = key_len;
+    entry->next = label_cache[hash % LABEL_CACHE_BUCKETS];
+    label_cache[hash % LABEL_CACHE_BUCKETS] = entry;
+    label_cache_count++;
+
+    return context;
+}
+
 int make_dir(const char *path, mode_t mode)
 {
     int rc;
 
-    char *secontext = NULL;
+    char *secontext = lookup_label(path, NULL, mode);
 
-    if (sehandle) {
-        selabel_lookup(sehandle, &secontext, path, mode);
+    if (secontext)
         setfscreatecon(secontext);
-    }
 
     rc = mkdir(path, mode);
 
     if (secontext) {
         int save_errno = errno;
-        freecon(secontext);
         setfscreatecon(NULL);
         errno = save_errno;
     }
@@ -534,3 +670,70 @@ int restorecon_recursive(const char* pathname)
 {
     return selinux_android_restorecon(pathname, SELINUX_ANDROID_RESTORECON_RECURSE);
 }
+
+/* Orders paths so that every directory is directly followed by everything
+ * below it: '/' sorts before any other character.
+ */
+static int compare_tree_order(const void *a, const void *b)
+{
+    const unsigned char *p = *(const unsigned char **) a;
+    const unsigned char *q = *(const unsigned char **) b;
+    int cp, cq;
+
+    for (;; p++, q++) {
+        cp = *p == '/' ? 1 : *p;
+        cq = *q == '/' ? 1 : *q;
+        if (cp != cq || !cp)
+            return cp - cq;
+    }
+}
+
+/*
+ * Relabels every tree in paths, walking each file only once: duplicates and
+ * paths that lie below another one in the list are dropped. Returns -1 with
+ * errno set if any tree could not be relabeled.
+ */
+int restorecon_recursive_batch(const char **paths, int count)
+{
+    const char **sorted;
+    const char *root = NULL;
+    size_t root_len = 0;
+    int save_errno = 0;
+    int ret = 0;
+    int i;
+
+    if (count <= 0)
+        return 0;
+
+    sorted = malloc(count * sizeof(*sorted));
+    if (!sorted) {
+        for (i = 0; i < count; i++) {
+            if (restorecon_recursive(paths[i]) < 0) {
+                save_errno = errno;
+                ret = -1;
+            }
+        }
+        errno = save_errno;
+        return ret;
+    }
+    memcpy(sorted, paths, count * sizeof(*sorted));
+    qsort(sorted, count, sizeof(*sorted), compare_tree_order);
+
+    for (i = 0; i < count; i++) {
+        if (root_len && !strncmp(sorted[i], root, root_len) &&
+                (sorted[i][root_len] == '/' || sorted[i][root_len] == '\0' ||
+                 root[root_len - 1] == '/'))
+            continue;
+
+        root = sorted[i];
+        root_len = strlen(root);
+        if (restorecon_recursive(root) < 0) {
+            save_errno = errno;
+            ret = -1;
+        }
+    }
+
+    free(sorted);
+    errno = save_errno;
+    return ret;
+}
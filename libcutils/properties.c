@@ -104,16 +104,136 @@ int32_t property_get_int32(const char *key, int32_t default_value) {
     return (int32_t)property_get_imax(key, INT32_MIN, INT32_MAX, default_value);
 }
 
+/* Sets properties one at a time, for when they can't be batched */
+static int property_set_each(const char * const *keys,
+                             const char * const *values,
+                             size_t count, int *results)
+{
+    size_t i;
+    int ret = 0;
+    int r;
+
+    for (i = 0; i < count; i++) {
+        r = property_set(keys[i], values[i]);
+        if (results)
+            results[i] = r;
+        if (r < 0)
+            ret = r;
+    }
+    return ret;
+}
+
 #ifdef HAVE_LIBC_SYSTEM_PROPERTIES
 
 #define _REALLY_INCLUDE_SYS__SYSTEM_PROPERTIES_H_
+#include <stdio.h>
 #include <sys/_system_properties.h>
+#include <sys/socket.h>
+#include <private/android_property_batch.h>
 
 int property_set(const char *key, const char *value)
 {
     return __system_property_set(key, value);
 }
 
+static int send_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    ssize_t n;
+
+    while (len > 0) {
+        n = TEMP_FAILURE_RETRY(send(fd, p, len, MSG_NOSIGNAL));
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Sends up to PROP_BATCH_MAX properties in one go; see
+** android_property_batch.h for the protocol.
+*/
+static int property_set_batch_chunk(const char * const *keys,
+                                    const char * const *values,
+                                    size_t count, int *results)
+{
+    prop_msg msg;
+    int32_t result;
+    size_t answered = 0;
+    size_t i;
+    int ret = 0;
+    int fd;
+
+    for (i = 0; i < count; i++) {
+        if (strlen(keys[i]) >= PROP_NAME_MAX ||
+                strlen(values[i]) >= PROP_VALUE_MAX) {
+            /* the service has no way to refuse just one property */
+            return property_set_each(keys, values, count, results);
+        }
+    }
+
+    fd = socket_local_client(PROP_SERVICE_NAME,
+                             ANDROID_SOCKET_NAMESPACE_RESERVED, SOCK_STREAM);
+    if (fd < 0)
+        return property_set_each(keys, values, count, results);
+
+    memset(&msg, 0, sizeof(msg));
+    msg.cmd = PROP_MSG_SETPROP_BATCH;
+    snprintf(msg.value, sizeof(msg.value), "%zu", count);
+    if (send_all(fd, &msg, sizeof(msg)) < 0)
+        goto out;
+
+    for (i = 0; i < count; i++) {
+        memset(&msg, 0, sizeof(msg));
+        msg.cmd = PROP_MSG_SETPROP;
+        strcpy(msg.name, keys[i]);
+        strcpy(msg.value, values[i]);
+        if (send_all(fd, &msg, sizeof(msg)) < 0)
+            break;
+    }
+
+    for (; answered < count; answered++) {
+        if (TEMP_FAILURE_RETRY(recv(fd, &result, sizeof(result), MSG_WAITALL)) !=
+                sizeof(result))
+            break;
+        if (results)
+            results[answered] = result;
+        if (result < 0)
+            ret = result;
+    }
+
+out:
+    close(fd);
+
+    /* an older service stops after the first message */
+    if (answered < count) {
+        if (property_set_each(keys + answered, values + answered,
+                              count - answered,
+                              results ? results + answered : NULL) < 0)
+            ret = -1;
+    }
+    return ret;
+}
+
+int property_set_batch(const char * const *keys, const char * const *values,
+                       size_t count, int *results)
+{
+    size_t i;
+    size_t n;
+    int ret = 0;
+
+    for (i = 0; i < count; i += n) {
+        n = count - i;
+        if (n > PROP_BATCH_MAX)
+            n = PROP_BATCH_MAX;
+        if (property_set_batch_chunk(keys + i, values + i, n,
+                                     results ? results + i : NULL) < 0)
+            ret = -1;
+    }
+    return ret;
+}
+
 int property_get(const char *key, char *value, const char *default_value)
 {
     int len;
@@ -418,3 +538,11 @@ int property_list(void (*propfn)(const char *key, const char *value, void *cooki
 }
 
 #endif
+
+#ifndef HAVE_LIBC_SYSTEM_PROPERTIES
+int property_set_batch(const char * const *keys, const char * const *values,
+                       size_t count, int *results)
+{
+    return property_set_each(keys, values, count, results);
+}
+#endif
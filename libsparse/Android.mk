@@ -10,6 +10,12 @@ libsparse_src_files := \
         sparse_err.c \
         sparse_read.c
 
+# The host library compresses gzip output on several threads
+libsparse_host_ldlibs :=
+ifneq ($(HOST_OS),windows)
+libsparse_host_ldlibs := -lpthread
+endif
+
 
 include $(CLEAR_VARS)
 LOCAL_EXPORT_C_INCLUDE_DIRS := $(LOCAL_PATH)/include
@@ -51,6 +57,7 @@ LOCAL_MODULE_STEM := simg2img
 LOCAL_STATIC_LIBRARIES := \
     libsparse_host \
     libz
+LOCAL_LDLIBS := $(libsparse_host_ldlibs)
 LOCAL_CFLAGS := -Werror
 include $(BUILD_HOST_EXECUTABLE)
 
@@ -74,6 +81,7 @@ LOCAL_MODULE_STEM := img2simg
 LOCAL_STATIC_LIBRARIES := \
     libsparse_host \
     libz
+LOCAL_LDLIBS := $(libsparse_host_ldlibs)
 LOCAL_CFLAGS := -Werror
 include $(BUILD_HOST_EXECUTABLE)
 
@@ -96,11 +104,23 @@ LOCAL_MODULE := append2simg
 LOCAL_STATIC_LIBRARIES := \
     libsparse_host \
     libz
+LOCAL_LDLIBS := $(libsparse_host_ldlibs)
 LOCAL_CFLAGS := -Werror
 include $(BUILD_HOST_EXECUTABLE)
 
 endif
 
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := sparse_benchmark.c
+LOCAL_MODULE := sparse_benchmark
+LOCAL_MODULE_TAGS := tests
+LOCAL_STATIC_LIBRARIES := \
+    libsparse_host \
+    libz
+LOCAL_LDLIBS := $(libsparse_host_ldlibs)
+LOCAL_CFLAGS := -Werror
+include $(BUILD_HOST_EXECUTABLE)
+
 include $(CLEAR_VARS)
 LOCAL_MODULE := simg_dump.py
 LOCAL_SRC_FILES := simg_dump.py
@@ -44,14 +44,107 @@ struct backed_block {
 		} fill;
 	};
 	struct backed_block *next;
+	/* The list is also a skip list: next is the level 0 link, and skip[i]
+	 * is the link at level i + 1, for a node of the given height. */
+	unsigned int height;
+	struct backed_block *skip[];
 };
 
+#define BB_MAX_HEIGHT 16
+
 struct backed_block_list {
 	struct backed_block *data_blocks;
-	struct backed_block *last_used;
+	struct backed_block *skip_head[BB_MAX_HEIGHT - 1];
+	unsigned int height;
+	uint32_t seed;
 	unsigned int block_size;
 };
 
+/* Returns the link that points to the next node at the given level after
+ * bb, where bb == NULL is the head of the list. */
+static struct backed_block **bb_link(struct backed_block_list *bbl,
+		struct backed_block *bb, unsigned int level)
+{
+	if (bb == NULL) {
+		return level == 0 ? &bbl->data_blocks : &bbl->skip_head[level - 1];
+	}
+	assert(level < bb->height);
+	return level == 0 ? &bb->next : &bb->skip[level - 1];
+}
+
+/* Fills update[level] with the last node before limit at each level, or
+ * NULL for the list head, in O(log n). */
+static void bb_find(struct backed_block_list *bbl, int64_t limit,
+		struct backed_block **update)
+{
+	struct backed_block *x = NULL;
+	struct backed_block *n;
+	int level;
+
+	for (level = BB_MAX_HEIGHT - 1; level >= (int)bbl->height; level--) {
+		update[level] = NULL;
+	}
+
+	for (level = bbl->height - 1; level >= 0; level--) {
+		while ((n = *bb_link(bbl, x, level)) && n->block < limit) {
+			x = n;
+		}
+		update[level] = x;
+	}
+}
+
+/* Picks a height with P(height > h) = 4^-h */
+static unsigned int bb_random_height(struct backed_block_list *bbl)
+{
+	unsigned int height = 1;
+	uint32_t r;
+
+	/* xorshift32 */
+	r = bbl->seed;
+	r ^= r << 13;
+	r ^= r >> 17;
+	r ^= r << 5;
+	bbl->seed = r;
+
+	while (height < BB_MAX_HEIGHT && (r & 3) == 0) {
+		height++;
+		r >>= 2;
+	}
+
+	return height;
+}
+
+static struct backed_block *bb_alloc(struct backed_block_list *bbl)
+{
+	unsigned int height = bb_random_height(bbl);
+	struct backed_block *bb;
+
+	bb = calloc(1, sizeof(struct backed_block) +
+			(height - 1) * sizeof(struct backed_block *));
+	if (bb == NULL) {
+		return NULL;
+	}
+
+	bb->height = height;
+	return bb;
+}
+
+/* Unlinks bb from every level of the list without freeing it */
+static void bb_unlink(struct backed_block_list *bbl, struct backed_block *bb)
+{
+	struct backed_block *update[BB_MAX_HEIGHT];
+	struct backed_block **link;
+	unsigned int level;
+
+	bb_find(bbl, bb->block, update);
+	for (level = 0; level < bb->height; level++) {
+		link = bb_link(bbl, update[level], level);
+		if (*link == bb) {
+			*link = *bb_link(bbl, bb, level);
+		}
+	}
+}
+
 struct backed_block *backed_block_iter_new(struct backed_block_list *bbl)
 {
 	return bbl->data_blocks;
@@ -62,6 +155,21 @@ struct backed_block *backed_block_iter_next(struct backed_block *bb)
 	return bb->next;
 }
 
+/* Returns the last block starting at or before block, or the first block
+ * if there is none, in O(log n). */
+struct backed_block *backed_block_iter_find(struct backed_block_list *bbl,
+		unsigned int block)
+{
+	struct backed_block *update[BB_MAX_HEIGHT];
+
+	bb_find(bbl, (int64_t)block + 1, update);
+	if (update[0]) {
+		return update[0];
+	}
+
+	return bbl->data_blocks;
+}
+
 unsigned int backed_block_len(struct backed_block *bb)
 {
 	return bb->len;
@@ -123,7 +231,12 @@ void backed_block_destroy(struct backed_block *bb)
 struct backed_block_list *backed_block_list_new(unsigned int block_size)
 {
 	struct backed_block_list *b = calloc(sizeof(struct backed_block_list), 1);
+	if (b == NULL) {
+		return NULL;
+	}
 	b->block_size = block_size;
+	b->height = 1;
+	b->seed = 0x9e3779b9;
 	return b;
 }
 
@@ -145,44 +258,50 @@ void backed_block_list_move(struct backed_block_list *from,
 		struct backed_block_list *to, struct backed_block *start,
 		struct backed_block *end)
 {
-	struct backed_block *bb;
+	struct backed_block *before[BB_MAX_HEIGHT];
+	struct backed_block *last[BB_MAX_HEIGHT];
+	struct backed_block *dest[BB_MAX_HEIGHT];
+	struct backed_block **link;
+	struct backed_block *first;
+	unsigned int level;
 
 	if (start == NULL) {
 		start = from->data_blocks;
 	}
 
-	if (!end) {
-		for (end = start; end && end->next; end = end->next)
-			;
+	if (start == NULL) {
+		return;
 	}
 
-	if (start == NULL || end == NULL) {
-		return;
+	if (!end) {
+		bb_find(from, INT64_MAX, last);
+		end = last[0];
 	}
 
-	from->last_used = NULL;
-	to->last_used = NULL;
-	if (from->data_blocks == start) {
-		from->data_blocks = end->next;
-	} else {
-		for (bb = from->data_blocks; bb; bb = bb->next) {
-			if (bb->next == start) {
-				bb->next = end->next;
-				break;
-			}
+	/*
+	 * start..end is a contiguous run in from, and must not interleave with
+	 * the blocks already in to, so at every level the nodes of the run form
+	 * a contiguous sublist that can be cut and spliced as a whole.
+	 */
+	bb_find(from, start->block, before);
+	bb_find(from, (int64_t)end->block + 1, last);
+	bb_find(to, start->block, dest);
+
+	for (level = 0; level < from->height; level++) {
+		if (last[level] == NULL || last[level]->block < start->block) {
+			continue;
 		}
-	}
 
-	if (!to->data_blocks) {
-		to->data_blocks = start;
-		end->next = NULL;
-	} else {
-		for (bb = to->data_blocks; bb; bb = bb->next) {
-			if (!bb->next || bb->next->block > start->block) {
-				end->next = bb->next;
-				bb->next = start;
-				break;
-			}
+		link = bb_link(from, before[level], level);
+		first = *link;
+		*link = *bb_link(from, last[level], level);
+
+		link = bb_link(to, dest[level], level);
+		*bb_link(to, last[level], level) = *link;
+		*link = first;
+
+		if (level + 1 > to->height) {
+			to->height = level + 1;
 		}
 	}
 }
@@ -237,7 +356,7 @@ static int merge_bb(struct backed_block_list *bbl,
 	/* Blocks are compatible and adjacent, with a before b.  Merge b into a,
 	 * and free b */
 	a->len += b->len;
-	a->next = b->next;
+	bb_unlink(bbl, b);
 
 	backed_block_destroy(b);
 
@@ -246,40 +365,23 @@ static int merge_bb(struct backed_block_list *bbl,
 
 static int queue_bb(struct backed_block_list *bbl, struct backed_block *new_bb)
 {
-	struct backed_block *bb;
+	struct backed_block *update[BB_MAX_HEIGHT];
+	struct backed_block **link;
+	unsigned int level;
 
-	if (bbl->data_blocks == NULL) {
-		bbl->data_blocks = new_bb;
-		return 0;
-	}
+	bb_find(bbl, new_bb->block, update);
 
-	if (bbl->data_blocks->block > new_bb->block) {
-		new_bb->next = bbl->data_blocks;
-		bbl->data_blocks = new_bb;
-		return 0;
+	for (level = 0; level < new_bb->height; level++) {
+		link = bb_link(bbl, update[level], level);
+		*bb_link(bbl, new_bb, level) = *link;
+		*link = new_bb;
 	}
-
-	/* Optimization: blocks are mostly queued in sequence, so save the
-	   pointer to the last bb that was added, and start searching from
-	   there if the next block number is higher */
-	if (bbl->last_used && new_bb->block > bbl->last_used->block)
-		bb = bbl->last_used;
-	else
-		bb = bbl->data_blocks;
-	bbl->last_used = new_bb;
-
-	for (; bb->next && bb->next->block < new_bb->block; bb = bb->next)
-		;
-
-	if (bb->next == NULL) {
-		bb->next = new_bb;
-	} else {
-		new_bb->next = bb->next;
-		bb->next = new_bb;
+	if (new_bb->height > bbl->height) {
+		bbl->height = new_bb->height;
 	}
 
 	merge_bb(bbl, new_bb, new_bb->next);
-	merge_bb(bbl, bb, new_bb);
+	merge_bb(bbl, update[0], new_bb);
 
 	return 0;
 }
@@ -288,7 +390,7 @@ static int queue_bb(struct backed_block_list *bbl, struct backed_block *new_bb)
 int backed_block_add_fill(struct backed_block_list *bbl, unsigned int fill_val,
 		unsigned int len, unsigned int block)
 {
-	struct backed_block *bb = calloc(1, sizeof(struct backed_block));
+	struct backed_block *bb = bb_alloc(bbl);
 	if (bb == NULL) {
 		return -ENOMEM;
 	}
@@ -306,7 +408,7 @@ int backed_block_add_fill(struct backed_block_list *bbl, unsigned int fill_val,
 int backed_block_add_data(struct backed_block_list *bbl, void *data,
 		unsigned int len, unsigned int block)
 {
-	struct backed_block *bb = calloc(1, sizeof(struct backed_block));
+	struct backed_block *bb = bb_alloc(bbl);
 	if (bb == NULL) {
 		return -ENOMEM;
 	}
@@ -324,7 +426,7 @@ int backed_block_add_data(struct backed_block_list *bbl, void *data,
 int backed_block_add_file(struct backed_block_list *bbl, const char *filename,
 		int64_t offset, unsigned int len, unsigned int block)
 {
-	struct backed_block *bb = calloc(1, sizeof(struct backed_block));
+	struct backed_block *bb = bb_alloc(bbl);
 	if (bb == NULL) {
 		return -ENOMEM;
 	}
@@ -343,7 +445,7 @@ int backed_block_add_file(struct backed_block_list *bbl, const char *filename,
 int backed_block_add_fd(struct backed_block_list *bbl, int fd, int64_t offset,
 		unsigned int len, unsigned int block)
 {
-	struct backed_block *bb = calloc(1, sizeof(struct backed_block));
+	struct backed_block *bb = bb_alloc(bbl);
 	if (bb == NULL) {
 		return -ENOMEM;
 	}
@@ -376,6 +478,9 @@ int backed_block_split(struct backed_block_list *bbl, struct backed_block *bb,
 
 	*new_bb = *bb;
 
+	/* The new block is only linked at level 0, which keeps the upper
+	 * levels valid without searching for its predecessors */
+	new_bb->height = 1;
 	new_bb->len = bb->len - max_len;
 	new_bb->block = bb->block + max_len / bbl->block_size;
 	new_bb->next = bb->next;
@@ -40,6 +40,8 @@ int backed_block_add_fd(struct backed_block_list *bbl, int fd,
 
 struct backed_block *backed_block_iter_new(struct backed_block_list *bbl);
 struct backed_block *backed_block_iter_next(struct backed_block *bb);
+struct backed_block *backed_block_iter_find(struct backed_block_list *bbl,
+		unsigned int block);
 unsigned int backed_block_len(struct backed_block *bb);
 unsigned int backed_block_block(struct backed_block *bb);
 void *backed_block_data(struct backed_block *bb);
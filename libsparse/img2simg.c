@@ -17,7 +17,9 @@
 #define _FILE_OFFSET_BITS 64
 #define _LARGEFILE64_SOURCE 1
 
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -40,7 +42,10 @@
 
 void usage()
 {
-    fprintf(stderr, "Usage: img2simg <raw_image_file> <sparse_image_file> [<block_size>]\n");
+    fprintf(stderr, "Usage: img2simg [-z] [-g] [-j <threads>] <raw_image_file> <sparse_image_file> [<block_size>]\n");
+    fprintf(stderr, "  -z  write blocks of zeros as don't care chunks instead of fill chunks\n");
+    fprintf(stderr, "  -g  gzip the sparse image\n");
+    fprintf(stderr, "  -j  number of compression threads for -g, 0 for one per cpu\n");
 }
 
 int main(int argc, char *argv[])
@@ -51,6 +56,35 @@ int main(int argc, char *argv[])
 	struct sparse_file *s;
 	unsigned int block_size = 4096;
 	off64_t len;
+	bool holes = false;
+	bool gz = false;
+	int threads = 0;
+	long val;
+	char *end;
+
+	while (argc > 1 && argv[1][0] == '-' && argv[1][1] != '\0') {
+		if (strcmp(argv[1], "-z") == 0) {
+			holes = true;
+		} else if (strcmp(argv[1], "-g") == 0) {
+			gz = true;
+		} else if (strcmp(argv[1], "-j") == 0 && argc > 2) {
+			errno = 0;
+			val = strtol(argv[2], &end, 10);
+			if (errno || end == argv[2] || *end || val < 0 || val > INT_MAX) {
+				fprintf(stderr, "Invalid thread count %s\n", argv[2]);
+				usage();
+				exit(-1);
+			}
+			threads = val;
+			argc--;
+			argv++;
+		} else {
+			usage();
+			exit(-1);
+		}
+		argc--;
+		argv++;
+	}
 
 	if (argc < 3 || argc > 4) {
 		usage();
@@ -96,13 +130,21 @@ int main(int argc, char *argv[])
 	}
 
 	sparse_file_verbose(s);
-	ret = sparse_file_read(s, in, false, false);
+	if (sparse_file_gz_options(s, 9, threads)) {
+		usage();
+		exit(-1);
+	}
+	if (holes) {
+		ret = sparse_file_read_holes(s, in);
+	} else {
+		ret = sparse_file_read(s, in, false, false);
+	}
 	if (ret) {
 		fprintf(stderr, "Failed to read file\n");
 		exit(-1);
 	}
 
-	ret = sparse_file_write(s, out, false, true, false);
+	ret = sparse_file_write(s, out, gz, true, false);
 	if (ret) {
 		fprintf(stderr, "Failed to write sparse file\n");
 		exit(-1);
@@ -140,6 +140,24 @@ int sparse_file_add_file(struct sparse_file *s,
 int sparse_file_add_fd(struct sparse_file *s,
 		int fd, int64_t file_offset, unsigned int len, unsigned int block);
 
+/**
+ * sparse_file_add_region - add part of one sparse file to another
+ *
+ * @to - sparse file cookie to add to
+ * @from - sparse file cookie to take the chunks from
+ * @block - first block of the region
+ * @len - length of the region in blocks
+ *
+ * Adds whatever is backed in [block : block + len) of from to the same
+ * blocks of to.  Both files must have the same block size.  The data itself
+ * is not copied: memory, files and fds backing from must stay valid for as
+ * long as to is used.  Unbacked blocks of from stay unbacked in to.
+ *
+ * Returns 0 on success, negative errno on error.
+ */
+int sparse_file_add_region(struct sparse_file *to, struct sparse_file *from,
+		unsigned int block, unsigned int len);
+
 /**
  * sparse_file_write - write a sparse file to a file
  *
@@ -150,10 +168,10 @@ int sparse_file_add_fd(struct sparse_file *s,
  * @crc - append a crc chunk
  *
  * Writes a sparse file to a file.  If gz is true, the data will be passed
- * through zlib.  If sparse is true, the file will be written in the Android
- * sparse file format.  If sparse is false, the file will be written by seeking
- * over unused chunks, producing a smaller file if the filesystem supports
- * sparse files.  If crc is true, the crc of the expanded data will be
+ * through zlib (see sparse_file_gz_options).  If sparse is true, the file
+ * will be written in the Android sparse file format.  If sparse is false, the
+ * file will be written by seeking over unused chunks, producing a smaller file
+ * if the filesystem supports sparse files.  If crc is true, the crc of the expanded data will be
  * calculated and appended in a crc chunk.
  *
  * Returns 0 on success, negative errno on error.
@@ -214,6 +232,21 @@ int sparse_file_callback(struct sparse_file *s, bool sparse, bool crc,
  */
 int sparse_file_read(struct sparse_file *s, int fd, bool sparse, bool crc);
 
+/**
+ * sparse_file_read_holes - read a normal file, leaving zero blocks unbacked
+ *
+ * @s - sparse file cookie
+ * @fd - file descriptor to read from
+ *
+ * Reads a normal file into a sparse file cookie like sparse_file_read with
+ * sparse false, except that blocks of all zeros are not added to the cookie
+ * at all.  They will be written as don't care chunks instead of fill chunks,
+ * which is appropriate when the destination is known to read back as zero.
+ *
+ * Returns 0 on success, negative errno on error.
+ */
+int sparse_file_read_holes(struct sparse_file *s, int fd);
+
 /**
  * sparse_file_import - import an existing sparse file
  *
@@ -259,6 +292,15 @@ struct sparse_file *sparse_file_import_auto(int fd, bool crc);
 int sparse_file_resparse(struct sparse_file *in_s, unsigned int max_len,
 		struct sparse_file **out_s, int out_s_count);
 
+/**
+ * sparse_file_block_size - return the block size of a sparse file
+ *
+ * @s - sparse file cookie
+ *
+ * Returns the block size the sparse file was created or imported with.
+ */
+unsigned int sparse_file_block_size(struct sparse_file *s);
+
 /**
  * sparse_file_verbose - set a sparse file cookie to print verbose errors
  *
@@ -268,6 +310,23 @@ int sparse_file_resparse(struct sparse_file *in_s, unsigned int max_len,
  */
 void sparse_file_verbose(struct sparse_file *s);
 
+/**
+ * sparse_file_gz_options - set how gzipped output is compressed
+ *
+ * @s - sparse file cookie
+ * @level - zlib compression level, 0 to 9
+ * @threads - number of compression threads, 0 for one per online cpu
+ *
+ * Applies to later calls to sparse_file_write with gz set.  With more than
+ * one thread the output is cut into blocks that are compressed in parallel
+ * and written as consecutive gzip members, which gunzip and zlib read back
+ * as a single stream.  With one thread a single gzip stream is written.
+ * The default is level 9 with one thread per online cpu.
+ *
+ * Returns 0 on success, negative errno on error.
+ */
+int sparse_file_gz_options(struct sparse_file *s, int level, int threads);
+
 /**
  * sparse_print_verbose - function called to print verbose errors
  *
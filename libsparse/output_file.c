@@ -16,6 +16,7 @@
 
 #define _FILE_OFFSET_BITS 64
 #define _LARGEFILE64_SOURCE 1
+#define _GNU_SOURCE
 
 #include <fcntl.h>
 #include <inttypes.h>
@@ -35,7 +36,9 @@
 #include "sparse_format.h"
 
 #ifndef USE_MINGW
+#include <pthread.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #define O_BINARY 0
 #else
 #define ftruncate64 ftruncate
@@ -45,6 +48,7 @@
 #define lseek64 lseek
 #define ftruncate64 ftruncate
 #define mmap64 mmap
+#define pread64 pread
 #define off64_t off_t
 #endif
 
@@ -56,6 +60,19 @@
 #define SPARSE_HEADER_LEN       (sizeof(sparse_header_t))
 #define CHUNK_HEADER_LEN (sizeof(chunk_header_t))
 
+/* Size of the buffers used to expand fill chunks and to copy file data
+ * when it can't be copied inside the kernel
+ */
+#define FILL_BUF_SIZE (1024 * 1024)
+#define COPY_BUF_SIZE (1024 * 1024)
+
+/* Amount of input compressed into each gzip member by the parallel gzip
+ * output, and the number of members in flight per compression thread
+ */
+#define PGZ_BLOCK_SIZE (512 * 1024)
+#define PGZ_BLOCKS_PER_THREAD 2
+#define PGZ_MAX_AUTO_THREADS 32
+
 #define container_of(inner, outer_t, elem) \
 	((outer_t *)((char *)inner - offsetof(outer_t, elem)))
 
@@ -64,6 +81,9 @@ struct output_file_ops {
 	int (*skip)(struct output_file *, int64_t);
 	int (*pad)(struct output_file *, int64_t);
 	int (*write)(struct output_file *, void *, int);
+	int (*copy)(struct output_file *, int fd, int64_t offset,
+			unsigned int len);
+	int (*zero)(struct output_file *, int64_t);
 	void (*close)(struct output_file *);
 };
 
@@ -72,6 +92,8 @@ struct sparse_file_ops {
 			void *data);
 	int (*write_fill_chunk)(struct output_file *out, unsigned int len,
 			uint32_t fill_val);
+	int (*write_fd_chunk)(struct output_file *out, unsigned int len,
+			int fd, int64_t offset);
 	int (*write_skip_chunk)(struct output_file *out, int64_t len);
 	int (*write_end_chunk)(struct output_file *out);
 };
@@ -87,20 +109,63 @@ struct output_file {
 	int64_t len;
 	char *zero_buf;
 	uint32_t *fill_buf;
+	unsigned int fill_buf_len;
+	unsigned int fill_buf_valid;
+	uint32_t fill_buf_val;
 	char *buf;
 };
 
 struct output_file_gz {
 	struct output_file out;
 	gzFile gz_fd;
+	int level;
 };
 
 #define to_output_file_gz(_o) \
 	container_of((_o), struct output_file_gz, out)
 
+#ifndef USE_MINGW
+struct pgz_block {
+	char *in;
+	unsigned int in_len;
+	unsigned char *out;
+	unsigned int out_len;
+	unsigned int out_size;
+	bool done;
+	int err;
+};
+
+struct output_file_pgz {
+	struct output_file out;
+	int fd;
+	int level;
+	int err;
+	int64_t pos;
+
+	pthread_mutex_t lock;
+	pthread_cond_t queued;
+	pthread_cond_t done;
+	pthread_t *threads;
+	unsigned int nthreads;
+	bool stop;
+
+	/* blocks are used in order as a ring, indexed by sequence number */
+	struct pgz_block *blocks;
+	unsigned int nblocks;
+	unsigned int fill;
+	unsigned int next_job;
+	unsigned int next_write;
+};
+
+#define to_output_file_pgz(_o) \
+	container_of((_o), struct output_file_pgz, out)
+#endif
+
 struct output_file_normal {
 	struct output_file out;
 	int fd;
+	bool no_copy_range;
+	char *copy_buf;
 };
 
 #define to_output_file_normal(_o) \
@@ -166,10 +231,104 @@ static int file_write(struct output_file *out, void *data, int len)
 	return 0;
 }
 
+#ifndef USE_MINGW
+/* Copy len bytes at offset in fd to the output.  copy_file_range() lets the
+ * kernel move the data (or share extents) without a trip through user space;
+ * when it is unavailable or refuses the pair of files, fall back to reading
+ * through a bounce buffer.
+ */
+static int file_copy(struct output_file *out, int fd, int64_t offset,
+		unsigned int len)
+{
+	struct output_file_normal *outn = to_output_file_normal(out);
+	ssize_t ret;
+
+#ifdef __NR_copy_file_range
+	while (len > 0 && !outn->no_copy_range) {
+		loff_t off_in = offset;
+
+		ret = syscall(__NR_copy_file_range, fd, &off_in, outn->fd, NULL,
+				len, 0);
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		} else if (ret <= 0) {
+			if (ret < 0 && errno != EXDEV && errno != ENOSYS &&
+					errno != EINVAL && errno != EOPNOTSUPP &&
+					errno != EBADF) {
+				error_errno("copy_file_range");
+				return -1;
+			}
+			outn->no_copy_range = true;
+			break;
+		}
+		offset += ret;
+		len -= ret;
+	}
+#endif
+
+	if (len > 0 && !outn->copy_buf) {
+		outn->copy_buf = malloc(COPY_BUF_SIZE);
+		if (!outn->copy_buf) {
+			error_errno("malloc copy_buf");
+			return -ENOMEM;
+		}
+	}
+
+	while (len > 0) {
+		ret = pread64(fd, outn->copy_buf, min(len, COPY_BUF_SIZE), offset);
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		} else if (ret < 0) {
+			error_errno("pread");
+			return -1;
+		} else if (ret == 0) {
+			error("unexpected end of input file");
+			return -1;
+		}
+		if (file_write(out, outn->copy_buf, ret) < 0) {
+			return -1;
+		}
+		offset += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+#endif
+
+/* Leave len bytes of zeros at the current position without writing them,
+ * by punching a hole where the filesystem (or block device) supports it.
+ */
+#ifdef FALLOC_FL_PUNCH_HOLE
+static int file_zero(struct output_file *out, int64_t len)
+{
+	struct output_file_normal *outn = to_output_file_normal(out);
+	off64_t pos;
+
+	pos = lseek64(outn->fd, 0, SEEK_CUR);
+	if (pos < 0) {
+		return -1;
+	}
+
+	if (fallocate(outn->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			pos, len) < 0) {
+		return -1;
+	}
+
+	return file_skip(out, len);
+}
+#else
+static int file_zero(struct output_file *out __unused, int64_t len __unused)
+{
+	return -1;
+}
+#endif
+
 static void file_close(struct output_file *out)
 {
 	struct output_file_normal *outn = to_output_file_normal(out);
 
+	free(outn->copy_buf);
 	free(outn);
 }
 
@@ -178,14 +337,20 @@ static struct output_file_ops file_ops = {
 	.skip = file_skip,
 	.pad = file_pad,
 	.write = file_write,
+#ifndef USE_MINGW
+	.copy = file_copy,
+#endif
+	.zero = file_zero,
 	.close = file_close,
 };
 
 static int gz_file_open(struct output_file *out, int fd)
 {
 	struct output_file_gz *outgz = to_output_file_gz(out);
+	char mode[] = "wb9";
 
-	outgz->gz_fd = gzdopen(fd, "wb9");
+	mode[2] = '0' + outgz->level;
+	outgz->gz_fd = gzdopen(fd, mode);
 	if (!outgz->gz_fd) {
 		error_errno("gzopen");
 		return -errno;
@@ -265,6 +430,273 @@ static struct output_file_ops gz_file_ops = {
 	.close = gz_file_close,
 };
 
+#ifndef USE_MINGW
+/*
+ * Parallel gzip output.  The stream is cut into PGZ_BLOCK_SIZE blocks that
+ * are deflated by a pool of threads, each into a complete gzip member, and
+ * the members are written to the fd in order.  Concatenated members are a
+ * valid gzip file and decompress to the concatenated data.
+ */
+static void *pgz_thread(void *arg)
+{
+	struct output_file_pgz *outpgz = arg;
+	struct pgz_block *block;
+	z_stream strm;
+	bool init;
+	int zret;
+
+	memset(&strm, 0, sizeof(strm));
+	/* windowBits above 15 asks zlib for a gzip header and trailer */
+	init = deflateInit2(&strm, outpgz->level, Z_DEFLATED, 15 + 16, 8,
+			Z_DEFAULT_STRATEGY) == Z_OK;
+
+	pthread_mutex_lock(&outpgz->lock);
+	for (;;) {
+		while (outpgz->next_job == outpgz->fill && !outpgz->stop) {
+			pthread_cond_wait(&outpgz->queued, &outpgz->lock);
+		}
+		if (outpgz->next_job == outpgz->fill) {
+			break;
+		}
+		block = &outpgz->blocks[outpgz->next_job++ % outpgz->nblocks];
+		pthread_mutex_unlock(&outpgz->lock);
+
+		zret = Z_STREAM_ERROR;
+		if (init) {
+			deflateReset(&strm);
+			strm.next_in = (unsigned char *)block->in;
+			strm.avail_in = block->in_len;
+			strm.next_out = block->out;
+			strm.avail_out = block->out_size;
+			zret = deflate(&strm, Z_FINISH);
+			block->out_len = strm.next_out - block->out;
+		}
+		block->err = zret == Z_STREAM_END ? 0 : -1;
+
+		pthread_mutex_lock(&outpgz->lock);
+		block->done = true;
+		pthread_cond_broadcast(&outpgz->done);
+	}
+	pthread_mutex_unlock(&outpgz->lock);
+
+	if (init) {
+		deflateEnd(&strm);
+	}
+
+	return NULL;
+}
+
+/* Write out the oldest queued block once it has been compressed */
+static int pgz_write_next(struct output_file_pgz *outpgz)
+{
+	struct pgz_block *block;
+	unsigned char *ptr;
+	unsigned int len;
+	ssize_t ret;
+
+	block = &outpgz->blocks[outpgz->next_write % outpgz->nblocks];
+
+	pthread_mutex_lock(&outpgz->lock);
+	while (!block->done) {
+		pthread_cond_wait(&outpgz->done, &outpgz->lock);
+	}
+	pthread_mutex_unlock(&outpgz->lock);
+
+	if (block->err) {
+		error("deflate failed");
+		outpgz->err = -1;
+	}
+
+	ptr = block->out;
+	len = block->out_len;
+	while (len > 0 && !outpgz->err) {
+		ret = write(outpgz->fd, ptr, len);
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		} else if (ret < 0) {
+			error_errno("write");
+			outpgz->err = -1;
+		} else {
+			ptr += ret;
+			len -= ret;
+		}
+	}
+
+	block->done = false;
+	block->in_len = 0;
+	outpgz->next_write++;
+
+	return outpgz->err;
+}
+
+/* Hand the block being filled to the compression threads */
+static int pgz_queue_block(struct output_file_pgz *outpgz)
+{
+	pthread_mutex_lock(&outpgz->lock);
+	outpgz->fill++;
+	pthread_cond_signal(&outpgz->queued);
+	pthread_mutex_unlock(&outpgz->lock);
+
+	if (outpgz->fill - outpgz->next_write == outpgz->nblocks) {
+		return pgz_write_next(outpgz);
+	}
+
+	return outpgz->err;
+}
+
+/* Append len bytes of data, or of zeros if data is NULL */
+static int pgz_append(struct output_file_pgz *outpgz, const char *data,
+		int64_t len)
+{
+	struct pgz_block *block;
+	unsigned int n;
+	int ret;
+
+	while (len > 0) {
+		block = &outpgz->blocks[outpgz->fill % outpgz->nblocks];
+		n = min(len, (int64_t)(PGZ_BLOCK_SIZE - block->in_len));
+		if (data) {
+			memcpy(block->in + block->in_len, data, n);
+			data += n;
+		} else {
+			memset(block->in + block->in_len, 0, n);
+		}
+		block->in_len += n;
+		outpgz->pos += n;
+		len -= n;
+
+		if (block->in_len == PGZ_BLOCK_SIZE) {
+			ret = pgz_queue_block(outpgz);
+			if (ret < 0) {
+				return ret;
+			}
+		}
+	}
+
+	return outpgz->err;
+}
+
+static int pgz_file_open(struct output_file *out, int fd)
+{
+	struct output_file_pgz *outpgz = to_output_file_pgz(out);
+	unsigned int i;
+
+	outpgz->fd = fd;
+	outpgz->nblocks = outpgz->nthreads * PGZ_BLOCKS_PER_THREAD;
+
+	pthread_mutex_init(&outpgz->lock, NULL);
+	pthread_cond_init(&outpgz->queued, NULL);
+	pthread_cond_init(&outpgz->done, NULL);
+
+	outpgz->blocks = calloc(outpgz->nblocks, sizeof(struct pgz_block));
+	outpgz->threads = calloc(outpgz->nthreads, sizeof(pthread_t));
+	if (!outpgz->blocks || !outpgz->threads) {
+		error_errno("malloc pgz blocks");
+		outpgz->nthreads = 0;
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < outpgz->nblocks; i++) {
+		struct pgz_block *block = &outpgz->blocks[i];
+
+		/* room for the worst case expansion plus the gzip wrapper */
+		block->out_size = compressBound(PGZ_BLOCK_SIZE) + 64;
+		block->in = malloc(PGZ_BLOCK_SIZE);
+		block->out = malloc(block->out_size);
+		if (!block->in || !block->out) {
+			error_errno("malloc pgz block");
+			outpgz->nthreads = 0;
+			return -ENOMEM;
+		}
+	}
+
+	for (i = 0; i < outpgz->nthreads; i++) {
+		if (pthread_create(&outpgz->threads[i], NULL, pgz_thread, outpgz)) {
+			error("failed to start compression thread");
+			outpgz->nthreads = i;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int pgz_file_skip(struct output_file *out, int64_t cnt)
+{
+	struct output_file_pgz *outpgz = to_output_file_pgz(out);
+
+	return pgz_append(outpgz, NULL, cnt);
+}
+
+static int pgz_file_pad(struct output_file *out, int64_t len)
+{
+	struct output_file_pgz *outpgz = to_output_file_pgz(out);
+
+	if (outpgz->pos >= len) {
+		return 0;
+	}
+
+	return pgz_append(outpgz, NULL, len - outpgz->pos);
+}
+
+static int pgz_file_write(struct output_file *out, void *data, int len)
+{
+	struct output_file_pgz *outpgz = to_output_file_pgz(out);
+
+	return pgz_append(outpgz, data, len);
+}
+
+static void pgz_file_close(struct output_file *out)
+{
+	struct output_file_pgz *outpgz = to_output_file_pgz(out);
+	struct pgz_block *block;
+	unsigned int i;
+
+	if (outpgz->nthreads) {
+		/* An empty stream still needs one member to be a gzip file */
+		block = &outpgz->blocks[outpgz->fill % outpgz->nblocks];
+		if (block->in_len || outpgz->fill == 0) {
+			pgz_queue_block(outpgz);
+		}
+		while (outpgz->next_write != outpgz->fill) {
+			pgz_write_next(outpgz);
+		}
+
+		pthread_mutex_lock(&outpgz->lock);
+		outpgz->stop = true;
+		pthread_cond_broadcast(&outpgz->queued);
+		pthread_mutex_unlock(&outpgz->lock);
+	}
+
+	for (i = 0; i < outpgz->nthreads; i++) {
+		pthread_join(outpgz->threads[i], NULL);
+	}
+
+	for (i = 0; outpgz->blocks && i < outpgz->nblocks; i++) {
+		free(outpgz->blocks[i].in);
+		free(outpgz->blocks[i].out);
+	}
+	free(outpgz->blocks);
+	free(outpgz->threads);
+
+	pthread_cond_destroy(&outpgz->done);
+	pthread_cond_destroy(&outpgz->queued);
+	pthread_mutex_destroy(&outpgz->lock);
+
+	/* gzclose() closes the fd in the single threaded case, match it */
+	close(outpgz->fd);
+	free(outpgz);
+}
+
+static struct output_file_ops pgz_file_ops = {
+	.open = pgz_file_open,
+	.skip = pgz_file_skip,
+	.pad = pgz_file_pad,
+	.write = pgz_file_write,
+	.close = pgz_file_close,
+};
+#endif
+
 static int callback_file_open(struct output_file *out __unused, int fd __unused)
 {
 	return 0;
@@ -367,7 +799,7 @@ static int write_sparse_fill_chunk(struct output_file *out, unsigned int len,
 		uint32_t fill_val)
 {
 	chunk_header_t chunk_header;
-	int rnd_up_len, count;
+	int rnd_up_len;
 	int ret;
 
 	/* Round up the fill length to a multiple of the block size */
@@ -387,9 +819,8 @@ static int write_sparse_fill_chunk(struct output_file *out, unsigned int len,
 		return -1;
 
 	if (out->use_crc) {
-		count = out->block_size / sizeof(uint32_t);
-		while (count--)
-			out->crc32 = sparse_crc32(out->crc32, &fill_val, sizeof(uint32_t));
+		out->crc32 = sparse_crc32_repeat(out->crc32, &fill_val,
+				sizeof(fill_val), out->block_size / sizeof(fill_val));
 	}
 
 	out->cur_out_ptr += rnd_up_len;
@@ -398,10 +829,21 @@ static int write_sparse_fill_chunk(struct output_file *out, unsigned int len,
 	return 0;
 }
 
+static int write_sparse_raw_chunk_header(struct output_file *out,
+		unsigned int rnd_up_len)
+{
+	chunk_header_t chunk_header;
+
+	chunk_header.chunk_type = CHUNK_TYPE_RAW;
+	chunk_header.reserved1 = 0;
+	chunk_header.chunk_sz = rnd_up_len / out->block_size;
+	chunk_header.total_sz = CHUNK_HEADER_LEN + rnd_up_len;
+	return out->ops->write(out, &chunk_header, sizeof(chunk_header));
+}
+
 static int write_sparse_data_chunk(struct output_file *out, unsigned int len,
 		void *data)
 {
-	chunk_header_t chunk_header;
 	int rnd_up_len, zero_len;
 	int ret;
 
@@ -410,12 +852,7 @@ static int write_sparse_data_chunk(struct output_file *out, unsigned int len,
 	zero_len = rnd_up_len - len;
 
 	/* Finally we can safely emit a chunk of data */
-	chunk_header.chunk_type = CHUNK_TYPE_RAW;
-	chunk_header.reserved1 = 0;
-	chunk_header.chunk_sz = rnd_up_len / out->block_size;
-	chunk_header.total_sz = CHUNK_HEADER_LEN + rnd_up_len;
-	ret = out->ops->write(out, &chunk_header, sizeof(chunk_header));
-
+	ret = write_sparse_raw_chunk_header(out, rnd_up_len);
 	if (ret < 0)
 		return -1;
 	ret = out->ops->write(out, data, len);
@@ -439,6 +876,34 @@ static int write_sparse_data_chunk(struct output_file *out, unsigned int len,
 	return 0;
 }
 
+/* Only used when the output can copy from a file and no crc is needed */
+static int write_sparse_fd_chunk(struct output_file *out, unsigned int len,
+		int fd, int64_t offset)
+{
+	int rnd_up_len, zero_len;
+	int ret;
+
+	rnd_up_len = ALIGN(len, out->block_size);
+	zero_len = rnd_up_len - len;
+
+	ret = write_sparse_raw_chunk_header(out, rnd_up_len);
+	if (ret < 0)
+		return -1;
+	ret = out->ops->copy(out, fd, offset, len);
+	if (ret < 0)
+		return -1;
+	if (zero_len) {
+		ret = out->ops->write(out, out->zero_buf, zero_len);
+		if (ret < 0)
+			return -1;
+	}
+
+	out->cur_out_ptr += rnd_up_len;
+	out->chunk_cnt++;
+
+	return 0;
+}
+
 int write_sparse_end_chunk(struct output_file *out)
 {
 	chunk_header_t chunk_header;
@@ -468,6 +933,7 @@ int write_sparse_end_chunk(struct output_file *out)
 static struct sparse_file_ops sparse_file_ops = {
 		.write_data_chunk = write_sparse_data_chunk,
 		.write_fill_chunk = write_sparse_fill_chunk,
+		.write_fd_chunk = write_sparse_fd_chunk,
 		.write_skip_chunk = write_sparse_skip_chunk,
 		.write_end_chunk = write_sparse_end_chunk,
 };
@@ -490,20 +956,52 @@ static int write_normal_data_chunk(struct output_file *out, unsigned int len,
 	return ret;
 }
 
+static int write_normal_fd_chunk(struct output_file *out, unsigned int len,
+		int fd, int64_t offset)
+{
+	int ret;
+	unsigned int rnd_up_len = ALIGN(len, out->block_size);
+
+	ret = out->ops->copy(out, fd, offset, len);
+	if (ret < 0) {
+		return ret;
+	}
+
+	if (rnd_up_len > len) {
+		ret = out->ops->skip(out, rnd_up_len - len);
+	}
+
+	return ret;
+}
+
 static int write_normal_fill_chunk(struct output_file *out, unsigned int len,
 		uint32_t fill_val)
 {
 	int ret;
 	unsigned int i;
 	unsigned int write_len;
+	unsigned int init_len;
 
-	/* Initialize fill_buf with the fill_val */
-	for (i = 0; i < out->block_size / sizeof(uint32_t); i++) {
+	if (fill_val == 0 && out->ops->zero && out->ops->zero(out, len) == 0) {
+		return 0;
+	}
+
+	/* Initialize as much of fill_buf with the fill_val as will be used */
+	init_len = min(len, out->fill_buf_len);
+	if (out->fill_buf_val != fill_val) {
+		out->fill_buf_valid = 0;
+		out->fill_buf_val = fill_val;
+	}
+	for (i = out->fill_buf_valid / sizeof(uint32_t);
+			i < init_len / sizeof(uint32_t); i++) {
 		out->fill_buf[i] = fill_val;
 	}
+	if (init_len > out->fill_buf_valid) {
+		out->fill_buf_valid = init_len;
+	}
 
 	while (len) {
-		write_len = min(len, out->block_size);
+		write_len = min(len, out->fill_buf_len);
 		ret = out->ops->write(out, out->fill_buf, write_len);
 		if (ret < 0) {
 			return ret;
@@ -528,6 +1026,7 @@ int write_normal_end_chunk(struct output_file *out)
 static struct sparse_file_ops normal_file_ops = {
 		.write_data_chunk = write_normal_data_chunk,
 		.write_fill_chunk = write_normal_fill_chunk,
+		.write_fd_chunk = write_normal_fd_chunk,
 		.write_skip_chunk = write_normal_skip_chunk,
 		.write_end_chunk = write_normal_end_chunk,
 };
@@ -535,6 +1034,8 @@ static struct sparse_file_ops normal_file_ops = {
 void output_file_close(struct output_file *out)
 {
 	out->sparse_ops->write_end_chunk(out);
+	free(out->zero_buf);
+	free(out->fill_buf);
 	out->ops->close(out);
 }
 
@@ -556,7 +1057,13 @@ static int output_file_init(struct output_file *out, int block_size,
 		return -ENOMEM;
 	}
 
-	out->fill_buf = calloc(block_size, 1);
+	out->fill_buf_len = block_size;
+	if (FILL_BUF_SIZE > block_size) {
+		out->fill_buf_len = FILL_BUF_SIZE / block_size * block_size;
+	}
+	out->fill_buf_valid = out->fill_buf_len;
+	out->fill_buf_val = 0;
+	out->fill_buf = calloc(out->fill_buf_len, 1);
 	if (!out->fill_buf) {
 		error_errno("malloc fill_buf");
 		ret = -ENOMEM;
@@ -601,7 +1108,7 @@ err_fill_buf:
 	return ret;
 }
 
-static struct output_file *output_file_new_gz(void)
+static struct output_file *output_file_new_gz(int level)
 {
 	struct output_file_gz *outgz = calloc(1, sizeof(struct output_file_gz));
 	if (!outgz) {
@@ -610,10 +1117,28 @@ static struct output_file *output_file_new_gz(void)
 	}
 
 	outgz->out.ops = &gz_file_ops;
+	outgz->level = level;
 
 	return &outgz->out;
 }
 
+#ifndef USE_MINGW
+static struct output_file *output_file_new_pgz(int level, int threads)
+{
+	struct output_file_pgz *outpgz = calloc(1, sizeof(struct output_file_pgz));
+	if (!outpgz) {
+		error_errno("malloc struct outpgz");
+		return NULL;
+	}
+
+	outpgz->out.ops = &pgz_file_ops;
+	outpgz->level = level;
+	outpgz->nthreads = threads;
+
+	return &outpgz->out;
+}
+#endif
+
 static struct output_file *output_file_new_normal(void)
 {
 	struct output_file_normal *outn = calloc(1, sizeof(struct output_file_normal));
@@ -654,13 +1179,22 @@ struct output_file *output_file_open_callback(int (*write)(void *, const void *,
 }
 
 struct output_file *output_file_open_fd(int fd, unsigned int block_size, int64_t len,
-		int gz, int sparse, int chunks, int crc)
+		int gz, int gz_level, int gz_threads, int sparse, int chunks, int crc)
 {
 	int ret;
 	struct output_file *out;
 
+#ifndef USE_MINGW
+	if (gz && gz_threads <= 0) {
+		gz_threads = min(sysconf(_SC_NPROCESSORS_ONLN),
+				(long)PGZ_MAX_AUTO_THREADS);
+	}
+	if (gz && gz_threads > 1) {
+		out = output_file_new_pgz(gz_level, gz_threads);
+	} else
+#endif
 	if (gz) {
-		out = output_file_new_gz();
+		out = output_file_new_gz(gz_level);
 	} else {
 		out = output_file_new_normal();
 	}
@@ -668,11 +1202,15 @@ struct output_file *output_file_open_fd(int fd, unsigned int block_size, int64_t
 		return NULL;
 	}
 
-	out->ops->open(out, fd);
+	ret = out->ops->open(out, fd);
+	if (ret < 0) {
+		out->ops->close(out);
+		return NULL;
+	}
 
 	ret = output_file_init(out, block_size, len, sparse, chunks, crc);
 	if (ret < 0) {
-		free(out);
+		out->ops->close(out);
 		return NULL;
 	}
 
@@ -701,6 +1239,10 @@ int write_fd_chunk(struct output_file *out, unsigned int len,
 	int buffer_size;
 	char *ptr;
 
+	if (out->ops->copy && !out->use_crc) {
+		return out->sparse_ops->write_fd_chunk(out, len, fd, offset);
+	}
+
 	aligned_offset = offset & ~(4096 - 1);
 	aligned_diff = offset - aligned_offset;
 	buffer_size = len + aligned_diff;
@@ -22,7 +22,7 @@
 struct output_file;
 
 struct output_file *output_file_open_fd(int fd, unsigned int block_size, int64_t len,
-		int gz, int sparse, int chunks, int crc);
+		int gz, int gz_level, int gz_threads, int sparse, int chunks, int crc);
 struct output_file *output_file_open_callback(int (*write)(void *, const void *, int),
 		void *priv, unsigned int block_size, int64_t len, int gz, int sparse,
 		int chunks, int crc);
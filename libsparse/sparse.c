@@ -15,7 +15,9 @@
  */
 
 #include <assert.h>
+#include <errno.h>
 #include <stdlib.h>
+#include <zlib.h>
 
 #include <sparse/sparse.h>
 
@@ -42,6 +44,8 @@ struct sparse_file *sparse_file_new(unsigned int block_size, int64_t len)
 
 	s->block_size = block_size;
 	s->len = len;
+	s->gz_level = Z_BEST_COMPRESSION;
+	s->gz_threads = 0;
 
 	return s;
 }
@@ -78,6 +82,65 @@ int sparse_file_add_fd(struct sparse_file *s,
 	return backed_block_add_fd(s->backed_block_list, fd, file_offset,
 			len, block);
 }
+
+int sparse_file_add_region(struct sparse_file *to, struct sparse_file *from,
+		unsigned int block, unsigned int len)
+{
+	struct backed_block *bb;
+	unsigned int end = block + len;
+	unsigned int bb_block;
+	unsigned int bb_end;
+	unsigned int start;
+	int64_t offset;
+	int64_t bytes;
+	int ret = 0;
+
+	if (to->block_size != from->block_size) {
+		return -EINVAL;
+	}
+
+	for (bb = backed_block_iter_find(from->backed_block_list, block);
+			bb && ret == 0; bb = backed_block_iter_next(bb)) {
+		bb_block = backed_block_block(bb);
+		bb_end = bb_block + DIV_ROUND_UP(backed_block_len(bb), from->block_size);
+		if (bb_block >= end) {
+			break;
+		}
+		if (bb_end <= block) {
+			continue;
+		}
+
+		start = bb_block > block ? bb_block : block;
+		offset = (int64_t)(start - bb_block) * from->block_size;
+		bytes = (int64_t)((bb_end < end ? bb_end : end) - start) *
+				from->block_size;
+		if (bytes > backed_block_len(bb) - offset) {
+			bytes = backed_block_len(bb) - offset;
+		}
+
+		switch (backed_block_type(bb)) {
+		case BACKED_BLOCK_DATA:
+			ret = sparse_file_add_data(to,
+					(char *)backed_block_data(bb) + offset, bytes, start);
+			break;
+		case BACKED_BLOCK_FILE:
+			ret = sparse_file_add_file(to, backed_block_filename(bb),
+					backed_block_file_offset(bb) + offset, bytes, start);
+			break;
+		case BACKED_BLOCK_FD:
+			ret = sparse_file_add_fd(to, backed_block_fd(bb),
+					backed_block_file_offset(bb) + offset, bytes, start);
+			break;
+		case BACKED_BLOCK_FILL:
+			ret = sparse_file_add_fill(to, backed_block_fill_val(bb),
+					bytes, start);
+			break;
+		}
+	}
+
+	return ret;
+}
+
 unsigned int sparse_count_chunks(struct sparse_file *s)
 {
 	struct backed_block *bb;
@@ -157,7 +220,8 @@ int sparse_file_write(struct sparse_file *s, int fd, bool gz, bool sparse,
 	struct output_file *out;
 
 	chunks = sparse_count_chunks(s);
-	out = output_file_open_fd(fd, s->block_size, s->len, gz, sparse, chunks, crc);
+	out = output_file_open_fd(fd, s->block_size, s->len, gz, s->gz_level,
+			s->gz_threads, sparse, chunks, crc);
 
 	if (!out)
 		return -ENOMEM;
@@ -311,7 +375,25 @@ int sparse_file_resparse(struct sparse_file *in_s, unsigned int max_len,
 	return c;
 }
 
+unsigned int sparse_file_block_size(struct sparse_file *s)
+{
+	return s->block_size;
+}
+
 void sparse_file_verbose(struct sparse_file *s)
 {
 	s->verbose = true;
 }
+
+int sparse_file_gz_options(struct sparse_file *s, int level, int threads)
+{
+	if (level < Z_NO_COMPRESSION || level > Z_BEST_COMPRESSION ||
+			threads < 0) {
+		return -EINVAL;
+	}
+
+	s->gz_level = level;
+	s->gz_threads = threads;
+
+	return 0;
+}
@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include <sparse/sparse.h>
+
+/*
+ * Builds a sparse file out of single-block fill chunks added in random
+ * order, the worst case for the sorted backed block list, then times
+ * sizing and resparsing it.
+ */
+
+#define BLOCK_SIZE 4096
+
+static double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (double)tv.tv_sec + (double)tv.tv_usec / 1000000;
+}
+
+void usage()
+{
+	fprintf(stderr, "Usage: sparse_benchmark [<blocks>]\n");
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int blocks = 1000000;
+	unsigned int *order;
+	unsigned int i, j, tmp;
+	struct sparse_file *s;
+	struct sparse_file **out_s;
+	int64_t len;
+	int files;
+	double start;
+
+	if (argc > 2) {
+		usage();
+		exit(-1);
+	}
+
+	if (argc == 2) {
+		blocks = strtoul(argv[1], NULL, 0);
+	}
+
+	order = malloc(blocks * sizeof(*order));
+	if (!order) {
+		fprintf(stderr, "Failed to allocate block order\n");
+		exit(-1);
+	}
+
+	/* Every other block, so that neighbours never merge */
+	srand(1);
+	for (i = 0; i < blocks; i++) {
+		order[i] = i * 2;
+	}
+	for (i = blocks - 1; i > 0; i--) {
+		j = rand() % (i + 1);
+		tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+
+	s = sparse_file_new(BLOCK_SIZE, (int64_t)blocks * 2 * BLOCK_SIZE);
+	if (!s) {
+		fprintf(stderr, "Failed to create sparse file\n");
+		exit(-1);
+	}
+
+	start = now();
+	for (i = 0; i < blocks; i++) {
+		if (sparse_file_add_fill(s, order[i], BLOCK_SIZE, order[i]) < 0) {
+			fprintf(stderr, "Failed to add block %u\n", order[i]);
+			exit(-1);
+		}
+	}
+	printf("add %u blocks in random order: %.3fs\n", blocks, now() - start);
+
+	start = now();
+	len = sparse_file_len(s, true, false);
+	printf("sparse_file_len (%lld bytes): %.3fs\n", (long long)len,
+			now() - start);
+
+	start = now();
+	files = sparse_file_resparse(s, 64 * 1024 * 1024, NULL, 0);
+	if (files < 0) {
+		fprintf(stderr, "Failed to resparse\n");
+		exit(-1);
+	}
+	out_s = calloc(files, sizeof(*out_s));
+	if (!out_s) {
+		fprintf(stderr, "Failed to allocate sparse file array\n");
+		exit(-1);
+	}
+	files = sparse_file_resparse(s, 64 * 1024 * 1024, out_s, files);
+	printf("resparse into %d files: %.3fs\n", files, now() - start);
+
+	for (i = 0; i < (unsigned int)files; i++) {
+		sparse_file_destroy(out_s[i]);
+	}
+	free(out_s);
+	sparse_file_destroy(s);
+	free(order);
+
+	exit(0);
+}
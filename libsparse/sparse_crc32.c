@@ -43,8 +43,47 @@
  */
 
 /* Code taken from FreeBSD 8 */
+#include <stddef.h>
 #include <stdint.h>
 
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+
+/*
+ * ARMv8 has CRC32 instructions for exactly this polynomial.  The choice is
+ * made at compile time: the macro is only defined when the build targets
+ * CPUs that have them, and the compiler may then use them itself anyway.
+ */
+static uint32_t crc32_update(uint32_t crc, const uint8_t *p, size_t size)
+{
+	while (size && ((uintptr_t)p & 7)) {
+		crc = __crc32b(crc, *p++);
+		size--;
+	}
+#if defined(__aarch64__)
+	while (size >= 8) {
+		crc = __crc32d(crc, *(const uint64_t *)p);
+		p += 8;
+		size -= 8;
+	}
+#endif
+	while (size >= 4) {
+		crc = __crc32w(crc, *(const uint32_t *)p);
+		p += 4;
+		size -= 4;
+	}
+	while (size--) {
+		crc = __crc32b(crc, *p++);
+	}
+	return crc;
+}
+
+#else
+
+#ifndef USE_MINGW
+#include <pthread.h>
+#endif
+
 static uint32_t crc32_tab[] = {
         0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
         0xe963a535, 0x9e6495a3, 0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988,
@@ -92,20 +131,180 @@ static uint32_t crc32_tab[] = {
 };
 
 /*
- * A function that calculates the CRC-32 based on the table above is
- * given below for documentation purposes. An equivalent implementation
- * of this function that's actually used in the kernel can be found
- * in sys/libkern.h, where it can be inlined.
+ * Slicing-by-8: crc32_slice[k][b] is the CRC contribution of byte b
+ * followed by k zero bytes, so eight input bytes can be folded in with
+ * eight independent table lookups per iteration instead of a serial
+ * chain of eight.  The tables are derived from crc32_tab on first use,
+ * which may happen on several threads at once.
  */
+static uint32_t crc32_slice[8][256];
+#ifndef USE_MINGW
+static pthread_once_t crc32_slice_once = PTHREAD_ONCE_INIT;
+#else
+static int crc32_slice_ready;
+#endif
 
-uint32_t sparse_crc32(uint32_t crc_in, const void *buf, int size)
+static void crc32_slice_init(void)
 {
-        const uint8_t *p = buf;
-        uint32_t crc;
+	int i, k;
+
+	for (i = 0; i < 256; i++) {
+		crc32_slice[0][i] = crc32_tab[i];
+	}
+	for (k = 1; k < 8; k++) {
+		for (i = 0; i < 256; i++) {
+			uint32_t c = crc32_slice[k - 1][i];
+			crc32_slice[k][i] = crc32_tab[c & 0xFF] ^ (c >> 8);
+		}
+	}
+}
 
-        crc = crc_in ^ ~0U;
-        while (size--)
-                crc = crc32_tab[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
-        return crc ^ ~0U;
+static inline uint32_t load_le32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
 }
 
+static uint32_t crc32_update(uint32_t crc, const uint8_t *p, size_t size)
+{
+	uint32_t lo, hi;
+
+#ifndef USE_MINGW
+	pthread_once(&crc32_slice_once, crc32_slice_init);
+#else
+	/* Windows builds are single threaded. */
+	if (!crc32_slice_ready) {
+		crc32_slice_init();
+		crc32_slice_ready = 1;
+	}
+#endif
+
+	while (size && ((uintptr_t)p & 3)) {
+		crc = crc32_tab[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+		size--;
+	}
+	while (size >= 8) {
+		lo = load_le32(p) ^ crc;
+		hi = load_le32(p + 4);
+		crc = crc32_slice[7][lo & 0xFF] ^
+		      crc32_slice[6][(lo >> 8) & 0xFF] ^
+		      crc32_slice[5][(lo >> 16) & 0xFF] ^
+		      crc32_slice[4][lo >> 24] ^
+		      crc32_slice[3][hi & 0xFF] ^
+		      crc32_slice[2][(hi >> 8) & 0xFF] ^
+		      crc32_slice[1][(hi >> 16) & 0xFF] ^
+		      crc32_slice[0][hi >> 24];
+		p += 8;
+		size -= 8;
+	}
+	while (size--) {
+		crc = crc32_tab[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+#endif
+
+uint32_t sparse_crc32(uint32_t crc_in, const void *buf, size_t size)
+{
+	return crc32_update(crc_in ^ ~0U, buf, size) ^ ~0U;
+}
+
+/*
+ * Combining two CRCs works by advancing crc1 over len2 zero bytes, which
+ * is a linear operator over GF(2) that can be applied in O(log len2)
+ * matrix squarings.  This is the method used by zlib's crc32_combine.
+ */
+#define GF2_DIM 32
+
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec)
+{
+	uint32_t sum = 0;
+
+	while (vec) {
+		if (vec & 1) {
+			sum ^= *mat;
+		}
+		vec >>= 1;
+		mat++;
+	}
+	return sum;
+}
+
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat)
+{
+	int n;
+
+	for (n = 0; n < GF2_DIM; n++) {
+		square[n] = gf2_matrix_times(mat, mat[n]);
+	}
+}
+
+uint32_t sparse_crc32_combine(uint32_t crc1, uint32_t crc2, uint64_t len2)
+{
+	int n;
+	uint32_t row;
+	uint32_t even[GF2_DIM];
+	uint32_t odd[GF2_DIM];
+
+	if (len2 == 0) {
+		return crc1;
+	}
+
+	/* operator for one zero bit */
+	odd[0] = 0xedb88320U;
+	row = 1;
+	for (n = 1; n < GF2_DIM; n++) {
+		odd[n] = row;
+		row <<= 1;
+	}
+
+	/* operators for two and four zero bits */
+	gf2_matrix_square(even, odd);
+	gf2_matrix_square(odd, even);
+
+	/* apply len2 zero bytes to crc1, squaring up to one zero byte first */
+	do {
+		gf2_matrix_square(even, odd);
+		if (len2 & 1) {
+			crc1 = gf2_matrix_times(even, crc1);
+		}
+		len2 >>= 1;
+		if (len2 == 0) {
+			break;
+		}
+
+		gf2_matrix_square(odd, even);
+		if (len2 & 1) {
+			crc1 = gf2_matrix_times(odd, crc1);
+		}
+		len2 >>= 1;
+	} while (len2);
+
+	return crc1 ^ crc2;
+}
+
+uint32_t sparse_crc32_repeat(uint32_t crc_in, const void *buf, size_t size,
+		uint64_t count)
+{
+	uint32_t block_crc;
+	uint64_t block_len = size;
+
+	if (size == 0 || count == 0) {
+		return crc_in;
+	}
+
+	/* Square the pattern: crc(P^2n) = combine(crc(P^n), crc(P^n), len(P^n)) */
+	block_crc = sparse_crc32(0, buf, size);
+	while (count) {
+		if (count & 1) {
+			crc_in = sparse_crc32_combine(crc_in, block_crc, block_len);
+		}
+		count >>= 1;
+		if (count) {
+			block_crc = sparse_crc32_combine(block_crc, block_crc, block_len);
+			block_len <<= 1;
+		}
+	}
+
+	return crc_in;
+}
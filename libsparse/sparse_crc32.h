@@ -14,7 +14,16 @@
  * limitations under the License.
  */
 
+#include <stddef.h>
 #include <stdint.h>
 
 uint32_t sparse_crc32(uint32_t crc, const void *buf, size_t size);
 
+/* Returns the crc of the concatenation of two buffers, given the crc of
+ * each and the length of the second. */
+uint32_t sparse_crc32_combine(uint32_t crc1, uint32_t crc2, uint64_t len2);
+
+/* Extends crc over count back-to-back copies of buf in O(log count). */
+uint32_t sparse_crc32_repeat(uint32_t crc, const void *buf, size_t size,
+		uint64_t count);
+
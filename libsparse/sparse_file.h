@@ -23,6 +23,8 @@ struct sparse_file {
 	unsigned int block_size;
 	int64_t len;
 	bool verbose;
+	int gz_level;
+	int gz_threads;
 
 	struct backed_block_list *backed_block_list;
 	struct output_file *out;
@@ -19,6 +19,7 @@
 #define _LARGEFILE64_SOURCE 1
 
 #include <fcntl.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -139,11 +140,8 @@ static int process_fill_chunk(struct sparse_file *s, unsigned int chunk_size,
 		int fd, unsigned int blocks, unsigned int block, uint32_t *crc32)
 {
 	int ret;
-	int chunk;
 	int64_t len = (int64_t)blocks * s->block_size;
 	uint32_t fill_val;
-	uint32_t *fillbuf;
-	unsigned int i;
 
 	if (chunk_size != sizeof(fill_val)) {
 		return -EINVAL;
@@ -160,17 +158,8 @@ static int process_fill_chunk(struct sparse_file *s, unsigned int chunk_size,
 	}
 
 	if (crc32) {
-		/* Fill copy_buf with the fill value */
-		fillbuf = (uint32_t *)copybuf;
-		for (i = 0; i < (COPY_BUF_SIZE / sizeof(fill_val)); i++) {
-			fillbuf[i] = fill_val;
-		}
-
-		while (len) {
-			chunk = min(len, COPY_BUF_SIZE);
-			*crc32 = sparse_crc32(*crc32, copybuf, chunk);
-			len -= chunk;
-		}
+		*crc32 = sparse_crc32_repeat(*crc32, &fill_val, sizeof(fill_val),
+				len / sizeof(fill_val));
 	}
 
 	return 0;
@@ -185,14 +174,11 @@ static int process_skip_chunk(struct sparse_file *s, unsigned int chunk_size,
 	}
 
 	if (crc32) {
-	        int64_t len = (int64_t)blocks * s->block_size;
-		memset(copybuf, 0, COPY_BUF_SIZE);
+		int64_t len = (int64_t)blocks * s->block_size;
+		uint32_t zero = 0;
 
-		while (len) {
-			int chunk = min(len, COPY_BUF_SIZE);
-			*crc32 = sparse_crc32(*crc32, copybuf, chunk);
-			len -= chunk;
-		}
+		*crc32 = sparse_crc32_repeat(*crc32, &zero, sizeof(zero),
+				len / sizeof(zero));
 	}
 
 	return 0;
@@ -353,54 +339,141 @@ static int sparse_file_read_sparse(struct sparse_file *s, int fd, bool crc)
 	return 0;
 }
 
-static int sparse_file_read_normal(struct sparse_file *s, int fd)
+/* Returns true if every 32 bit word of the block is the same, and stores
+ * that word in fill.  Comparing the block against itself shifted by one
+ * word lets the C library's vectorized memcmp do the scan.
+ */
+static bool sparse_block_is_fill(const uint32_t *buf, unsigned int block_size,
+		uint32_t *fill)
 {
-	int ret;
-	uint32_t *buf = malloc(s->block_size);
+	if (buf[0] != buf[1]) {
+		return false;
+	}
+
+	if (memcmp(buf, buf + 1, block_size - sizeof(uint32_t)) != 0) {
+		return false;
+	}
+
+	*fill = buf[0];
+	return true;
+}
+
+enum read_run_type {
+	READ_RUN_NONE,
+	READ_RUN_DATA,
+	READ_RUN_FILL,
+	READ_RUN_HOLE,
+};
+
+struct read_run {
+	enum read_run_type type;
+	unsigned int block;
+	int64_t offset;
+	unsigned int len;
+	uint32_t fill_val;
+};
+
+static int read_run_flush(struct sparse_file *s, int fd, struct read_run *run)
+{
+	int ret = 0;
+
+	switch (run->type) {
+	case READ_RUN_DATA:
+		ret = sparse_file_add_fd(s, fd, run->offset, run->len, run->block);
+		break;
+	case READ_RUN_FILL:
+		ret = sparse_file_add_fill(s, run->fill_val, run->len, run->block);
+		break;
+	case READ_RUN_NONE:
+	case READ_RUN_HOLE:
+		break;
+	}
+
+	run->type = READ_RUN_NONE;
+	run->len = 0;
+
+	return ret;
+}
+
+/* Reads a normal file in COPY_BUF_SIZE batches and records consecutive
+ * blocks of the same kind as a single backed block, instead of issuing a
+ * read and a backed block insertion per block.  If holes is true, blocks
+ * of zeros are left out of the sparse file entirely so they are written as
+ * don't care chunks rather than fill chunks.
+ */
+static int sparse_file_read_normal(struct sparse_file *s, int fd, bool holes)
+{
+	int ret = 0;
+	unsigned int batch_size;
+	uint32_t *buf;
 	unsigned int block = 0;
 	int64_t remain = s->len;
 	int64_t offset = 0;
 	unsigned int to_read;
-	unsigned int i;
-	bool sparse_block;
+	unsigned int pos;
+	unsigned int len;
+	enum read_run_type type;
+	uint32_t fill_val = 0;
+	struct read_run run = { .type = READ_RUN_NONE };
+
+	if (s->block_size < 2 * sizeof(uint32_t) ||
+			s->block_size % sizeof(uint32_t) != 0) {
+		return -EINVAL;
+	}
+
+	batch_size = COPY_BUF_SIZE - COPY_BUF_SIZE % s->block_size;
+	if (batch_size == 0) {
+		batch_size = s->block_size;
+	}
 
+	buf = malloc(batch_size);
 	if (!buf) {
 		return -ENOMEM;
 	}
 
 	while (remain > 0) {
-		to_read = min(remain, s->block_size);
+		to_read = min(remain, batch_size);
 		ret = read_all(fd, buf, to_read);
 		if (ret < 0) {
 			error("failed to read sparse file");
-			return ret;
+			goto out;
 		}
 
-		if (to_read == s->block_size) {
-			sparse_block = true;
-			for (i = 1; i < s->block_size / sizeof(uint32_t); i++) {
-				if (buf[0] != buf[i]) {
-					sparse_block = false;
-					break;
-				}
+		for (pos = 0; pos < to_read; pos += len) {
+			len = min(to_read - pos, s->block_size);
+
+			type = READ_RUN_DATA;
+			if (len == s->block_size &&
+					sparse_block_is_fill((uint32_t *)((char *)buf + pos),
+							s->block_size, &fill_val)) {
+				type = (holes && fill_val == 0) ? READ_RUN_HOLE : READ_RUN_FILL;
 			}
-		} else {
-			sparse_block = false;
-		}
 
-		if (sparse_block) {
-			/* TODO: add flag to use skip instead of fill for buf[0] == 0 */
-			sparse_file_add_fill(s, buf[0], to_read, block);
-		} else {
-			sparse_file_add_fd(s, fd, offset, to_read, block);
+			if (run.type != type ||
+					(type == READ_RUN_FILL && run.fill_val != fill_val) ||
+					run.len > UINT_MAX - s->block_size) {
+				ret = read_run_flush(s, fd, &run);
+				if (ret < 0) {
+					goto out;
+				}
+				run.type = type;
+				run.block = block;
+				run.offset = offset + pos;
+				run.fill_val = fill_val;
+			}
+			run.len += len;
+			block++;
 		}
 
 		remain -= to_read;
 		offset += to_read;
-		block++;
 	}
 
-	return 0;
+	ret = read_run_flush(s, fd, &run);
+
+out:
+	free(buf);
+	return ret;
 }
 
 int sparse_file_read(struct sparse_file *s, int fd, bool sparse, bool crc)
@@ -412,10 +485,15 @@ int sparse_file_read(struct sparse_file *s, int fd, bool sparse, bool crc)
 	if (sparse) {
 		return sparse_file_read_sparse(s, fd, crc);
 	} else {
-		return sparse_file_read_normal(s, fd);
+		return sparse_file_read_normal(s, fd, false);
 	}
 }
 
+int sparse_file_read_holes(struct sparse_file *s, int fd)
+{
+	return sparse_file_read_normal(s, fd, true);
+}
+
 struct sparse_file *sparse_file_import(int fd, bool verbose, bool crc)
 {
 	int ret;
@@ -495,7 +573,7 @@ struct sparse_file *sparse_file_import_auto(int fd, bool crc)
 		return NULL;
 	}
 
-	ret = sparse_file_read_normal(s, fd);
+	ret = sparse_file_read_normal(s, fd, false);
 	if (ret < 0) {
 		sparse_file_destroy(s);
 		return NULL;
@@ -24,6 +24,7 @@
 #include <limits.h>
 #include <linux/fuse.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -38,8 +39,10 @@
 
 #include <cutils/fs.h>
 #include <cutils/hashmap.h>
+#include <cutils/list.h>
 #include <cutils/log.h>
 #include <cutils/multiuser.h>
+#include <cutils/properties.h>
 
 #include <private/android_filesystem_config.h>
 
@@ -100,6 +103,7 @@
 #endif
 
 #define ERROR(x...) ALOGE(x)
+#define INFO(x...) ALOGI(x)
 
 #define FUSE_UNKNOWN_INO 0xffffffff
 
@@ -117,6 +121,36 @@
 /* Default number of threads. */
 #define DEFAULT_NUM_THREADS 2
 
+/* Default number of seconds the kernel may cache attributes and entries. */
+#define DEFAULT_CACHE_VALID 10
+
+/* Properties that tune the daemon per device when not given on the command
+ * line; see usage(). */
+static const char* const kCacheValidProperty = "ro.sdcard.cache_valid";
+static const char* const kWritebackProperty = "ro.sdcard.writeback";
+
+/* Request latencies are counted in buckets of powers of two microseconds:
+ * bucket i holds requests that took less than 2^(i+1) us, and the last one
+ * everything slower. */
+#define NR_LATENCY_BUCKETS 16
+
+/* Statistics are kept per opcode below this; any others share slot 0,
+ * which no opcode uses. */
+#define NR_OPCODE_STATS 64
+
+#if defined(SPLICE_F_MOVE) && defined(F_SETPIPE_SZ)
+/* Move file data between /dev/fuse and the backing files with splice(2)
+ * rather than copying it through the handler buffers. */
+#define FUSE_SPLICE 1
+
+/* Size of each handler's splice pipe. It has to hold a whole request,
+ * since the kernel refuses to split one across splice calls. */
+#define SPLICE_PIPE_SIZE (MAX_REQUEST_SIZE + 2 * PAGESIZE)
+
+/* The kernel can splice to and from /dev/fuse as of protocol 7.14. */
+#define FUSE_SPLICE_MINOR 14
+#endif
+
 /* Pseudo-error constant used to indicate that no fuse status is needed
  * or that a reply has already been written. */
 #define NO_STATUS 1
@@ -162,6 +196,8 @@ struct handle {
 
 struct dirhandle {
     DIR *d;
+    /* offset of the entry readdir(d) returns next, counting from 0 */
+    __u64 next_off;
 };
 
 struct node {
@@ -181,9 +217,16 @@ struct node {
     gid_t gid;
     mode_t mode;
 
-    struct node *next;          /* per-dir sibling list */
-    struct node *child;         /* first contained file by this dir */
+    struct node *next;          /* next in the parent's hash chain */
     struct node *parent;        /* containing directory */
+    __u32 hash;                 /* name_hash() of name when added to parent */
+
+    /* Contained files, hashed by case-folded name so that both exact and
+     * case-insensitive lookups only have to look at one chain. Allocated
+     * with the first child. */
+    struct node **children;
+    __u32 nr_buckets;
+    __u32 nr_children;
 
     size_t namelen;
     char *name;
@@ -219,7 +262,12 @@ static bool int_equals(void *keyA, void *keyB) {
 
 /* Global data structure shared by all fuse handlers. */
 struct fuse {
-    pthread_mutex_t lock;
+    /* Guards the node tree and the package maps. Handlers that only resolve
+     * nodes and paths share it; anything that restructures the tree, removes
+     * a node or creates one takes it exclusively. Taking a reference on a
+     * node is atomic, so that lookups of existing nodes can share the lock
+     * too; dropping one always happens exclusively. */
+    pthread_rwlock_t lock;
 
     __u64 next_generation;
     int fd;
@@ -244,12 +292,44 @@ struct fuse {
      * inode numbers into 32 bit values on 64 bit kernels (see fuse_squash_ino
      * in fs/fuse/inode.c).
      *
-     * Accesses must be guarded by |lock|.
+     * Accesses must hold |lock| exclusively.
      */
     __u32 inode_ctr;
 
     Hashmap* package_to_appid;
     Hashmap* appid_with_rw;
+
+#ifdef FUSE_SPLICE
+    /* Set by INIT once the kernel is known to support splicing on /dev/fuse. */
+    bool splice;
+#endif
+
+    /* Seconds the kernel may cache attributes and entries. */
+    __u64 cache_valid;
+
+    /* Whether to let the kernel cache writes; cleared by INIT if the kernel
+     * cannot. */
+    bool writeback;
+
+    /* The handlers, so that their statistics can be dumped. */
+    struct fuse_handler* handlers;
+    int num_handlers;
+
+    /* Case-folded indexes of recently searched backing directories, most
+     * recently used first; see find_file_within(). The list and the index
+     * refcounts are guarded by |name_index_lock|. */
+    pthread_mutex_t name_index_lock;
+    struct listnode name_indexes;
+    __u32 nr_name_indexes;
+};
+
+/* Counters for one opcode, kept per handler so that they need no locking. */
+struct op_stats {
+    uint64_t count;
+    uint64_t errors;
+    uint64_t total_us;
+    uint64_t max_us;
+    __u32 latency[NR_LATENCY_BUCKETS];
 };
 
 /* Private data used by a single fuse handler. */
@@ -257,6 +337,17 @@ struct fuse_handler {
     struct fuse* fuse;
     int token;
 
+#ifdef FUSE_SPLICE
+    /* Pipe that requests and READ replies are spliced through, or -1 if it
+     * could not be set up. */
+    int pipe[2];
+
+    /* Bytes of the current WRITE's payload still sitting in |pipe|. */
+    size_t spliced;
+#endif
+
+    struct op_stats stats[NR_OPCODE_STATS];
+
     /* To save memory, we never use the contents of the request buffer and the read
      * buffer at the same time.  This allows us to share the underlying storage. */
     union {
@@ -277,7 +368,7 @@ static inline __u64 ptr_to_id(void *ptr)
 
 static void acquire_node_locked(struct node* node)
 {
-    node->refcount++;
+    __sync_add_and_fetch(&node->refcount, 1);
     TRACE("ACQUIRE %p (%s) rc=%d\n", node, node->name, node->refcount);
 }
 
@@ -296,6 +387,7 @@ static void release_node_locked(struct node* node)
             memset(node->name, 0xef, node->namelen);
             free(node->name);
             free(node->actual_name);
+            free(node->children);
             memset(node, 0xfc, sizeof(*node));
             free(node);
         }
@@ -304,25 +396,74 @@ static void release_node_locked(struct node* node)
     }
 }
 
+#define MIN_CHILD_BUCKETS 8
+
+/* Hash of a name folded to lower case, so that names differing only by case
+ * land in the same bucket. */
+static __u32 name_hash(const char* name)
+{
+    __u32 hash = 5381;
+
+    while (*name) {
+        hash = hash * 33 + tolower((unsigned char) *name++);
+    }
+    return hash;
+}
+
+/* Doubles the children table of a directory once it holds twice as many
+ * nodes as buckets; if memory is short the chains just get longer. */
+static void grow_children_locked(struct node* parent)
+{
+    __u32 nr_buckets = parent->nr_buckets ? parent->nr_buckets * 2 : MIN_CHILD_BUCKETS;
+    struct node** children;
+    struct node* node;
+    __u32 i;
+
+    children = calloc(nr_buckets, sizeof(*children));
+    if (!children) {
+        return;
+    }
+    for (i = 0; i < parent->nr_buckets; i++) {
+        while ((node = parent->children[i])) {
+            parent->children[i] = node->next;
+            node->next = children[node->hash % nr_buckets];
+            children[node->hash % nr_buckets] = node;
+        }
+    }
+    free(parent->children);
+    parent->children = children;
+    parent->nr_buckets = nr_buckets;
+}
+
 static void add_node_to_parent_locked(struct node *node, struct node *parent) {
+    struct node** bucket;
+
+    if (!parent->nr_buckets || parent->nr_children >= parent->nr_buckets * 2) {
+        grow_children_locked(parent);
+    }
+
     node->parent = parent;
-    node->next = parent->child;
-    parent->child = node;
+    node->hash = name_hash(node->name);
+    if (parent->nr_buckets) {
+        bucket = &parent->children[node->hash % parent->nr_buckets];
+        node->next = *bucket;
+        *bucket = node;
+    }
+    parent->nr_children++;
     acquire_node_locked(parent);
 }
 
 static void remove_node_from_parent_locked(struct node* node)
 {
+    struct node** bucket;
+
     if (node->parent) {
-        if (node->parent->child == node) {
-            node->parent->child = node->parent->child->next;
-        } else {
-            struct node *node2;
-            node2 = node->parent->child;
-            while (node2->next != node)
-                node2 = node2->next;
-            node2->next = node->next;
+        bucket = &node->parent->children[node->hash % node->parent->nr_buckets];
+        while (*bucket != node) {
+            bucket = &(*bucket)->next;
         }
+        *bucket = node->next;
+        node->parent->nr_children--;
         release_node_locked(node->parent);
         node->parent = NULL;
         node->next = NULL;
@@ -365,6 +506,310 @@ static ssize_t get_node_path_locked(struct node* node, char* buf, size_t bufsize
     return pathlen + namelen;
 }
 
+/* Maximum number of directories whose names are indexed at once. */
+#define MAX_NAME_INDEXES 32
+
+/* Directories modified this recently may still change without their mtime
+ * moving, since timestamps are only as fine as the filesystem clock. */
+#define NAME_INDEX_RACY_SECS 2
+
+struct name_entry {
+    struct name_entry* next;
+    __u32 hash;
+    char name[];
+};
+
+/* The names in one backing directory, hashed by name_hash() so that a
+ * case-insensitive search only has to look at one chain. An index is trusted
+ * while the directory's mtime matches the one it was built from; changes made
+ * by this daemon are applied to it directly. */
+struct name_index {
+    struct listnode lru;
+    dev_t dev;
+    ino_t ino;
+    int refcount;
+
+    pthread_mutex_t lock;       /* guards the fields below */
+    bool valid;
+    time_t mtime;
+    long mtime_nsec;
+    struct name_entry** buckets;
+    __u32 nr_buckets;
+    __u32 nr_entries;
+};
+
+static void clear_name_index_locked(struct name_index* index)
+{
+    struct name_entry* entry;
+    __u32 i;
+
+    for (i = 0; i < index->nr_buckets; i++) {
+        while ((entry = index->buckets[i])) {
+            index->buckets[i] = entry->next;
+            free(entry);
+        }
+    }
+    free(index->buckets);
+    index->buckets = NULL;
+    index->nr_buckets = 0;
+    index->nr_entries = 0;
+    index->valid = false;
+}
+
+static bool add_name_locked(struct name_index* index, const char* name)
+{
+    __u32 hash = name_hash(name);
+    size_t namelen = strlen(name);
+    struct name_entry* entry;
+    __u32 i;
+
+    if (index->nr_entries >= index->nr_buckets * 2) {
+        __u32 nr_buckets = index->nr_buckets ? index->nr_buckets * 2 : MIN_CHILD_BUCKETS;
+        struct name_entry** buckets = calloc(nr_buckets, sizeof(*buckets));
+        if (!buckets) {
+            return false;
+        }
+        for (i = 0; i < index->nr_buckets; i++) {
+            while ((entry = index->buckets[i])) {
+                index->buckets[i] = entry->next;
+                entry->next = buckets[entry->hash % nr_buckets];
+                buckets[entry->hash % nr_buckets] = entry;
+            }
+        }
+        free(index->buckets);
+        index->buckets = buckets;
+        index->nr_buckets = nr_buckets;
+    }
+
+    for (entry = index->buckets[hash % index->nr_buckets]; entry; entry = entry->next) {
+        if (entry->hash == hash && !strcmp(entry->name, name)) {
+            return true;
+        }
+    }
+    entry = malloc(sizeof(*entry) + namelen + 1);
+    if (!entry) {
+        return false;
+    }
+    entry->hash = hash;
+    memcpy(entry->name, name, namelen + 1);
+    entry->next = index->buckets[hash % index->nr_buckets];
+    index->buckets[hash % index->nr_buckets] = entry;
+    index->nr_entries++;
+    return true;
+}
+
+static void remove_name_locked(struct name_index* index, const char* name)
+{
+    __u32 hash = name_hash(name);
+    struct name_entry** link;
+    struct name_entry* entry;
+
+    if (!index->nr_buckets) {
+        return;
+    }
+    for (link = &index->buckets[hash % index->nr_buckets]; (entry = *link);
+            link = &entry->next) {
+        if (entry->hash == hash && !strcmp(entry->name, name)) {
+            *link = entry->next;
+            free(entry);
+            index->nr_entries--;
+            return;
+        }
+    }
+}
+
+static const char* find_name_locked(struct name_index* index, const char* name)
+{
+    __u32 hash = name_hash(name);
+    struct name_entry* entry;
+
+    if (!index->nr_buckets) {
+        return NULL;
+    }
+    for (entry = index->buckets[hash % index->nr_buckets]; entry; entry = entry->next) {
+        if (entry->hash == hash && !strcasecmp(entry->name, name)) {
+            return entry->name;
+        }
+    }
+    return NULL;
+}
+
+static bool build_name_index_locked(struct name_index* index, const char* path,
+        const struct stat* s)
+{
+    struct dirent* entry;
+    DIR* dir;
+
+    clear_name_index_locked(index);
+    dir = opendir(path);
+    if (!dir) {
+        return false;
+    }
+    while ((entry = readdir(dir))) {
+        if (!add_name_locked(index, entry->d_name)) {
+            clear_name_index_locked(index);
+            closedir(dir);
+            return false;
+        }
+    }
+    closedir(dir);
+    index->valid = true;
+    index->mtime = s->st_mtime;
+    index->mtime_nsec = s->st_mtime_nsec;
+    return true;
+}
+
+/* Returns a reference to the index of the directory described by |s|,
+ * creating one if |create| is set and there is room, or NULL. */
+static struct name_index* get_name_index(struct fuse* fuse, const struct stat* s,
+        bool create)
+{
+    struct name_index* index;
+    struct listnode* item;
+
+    pthread_mutex_lock(&fuse->name_index_lock);
+    list_for_each(item, &fuse->name_indexes) {
+        index = node_to_item(item, struct name_index, lru);
+        if (index->ino == s->st_ino && index->dev == s->st_dev) {
+            goto found;
+        }
+    }
+    index = NULL;
+    if (!create) {
+        goto out;
+    }
+    if (fuse->nr_name_indexes >= MAX_NAME_INDEXES) {
+        /* Recycle the least recently used index nobody is looking at. */
+        list_for_each_reverse(item, &fuse->name_indexes) {
+            struct name_index* victim = node_to_item(item, struct name_index, lru);
+            if (!victim->refcount) {
+                list_remove(&victim->lru);
+                fuse->nr_name_indexes--;
+                clear_name_index_locked(victim);
+                pthread_mutex_destroy(&victim->lock);
+                free(victim);
+                break;
+            }
+        }
+        if (fuse->nr_name_indexes >= MAX_NAME_INDEXES) {
+            goto out;
+        }
+    }
+    index = calloc(1, sizeof(*index));
+    if (!index) {
+        goto out;
+    }
+    pthread_mutex_init(&index->lock, NULL);
+    index->dev = s->st_dev;
+    index->ino = s->st_ino;
+    list_add_head(&fuse->name_indexes, &index->lru);
+    fuse->nr_name_indexes++;
+found:
+    list_remove(&index->lru);
+    list_add_head(&fuse->name_indexes, &index->lru);
+    index->refcount++;
+out:
+    pthread_mutex_unlock(&fuse->name_index_lock);
+    return index;
+}
+
+static void put_name_index(struct fuse* fuse, struct name_index* index)
+{
+    pthread_mutex_lock(&fuse->name_index_lock);
+    index->refcount--;
+    pthread_mutex_unlock(&fuse->name_index_lock);
+}
+
+/* Searches the index of directory |path| for a name matching |name| ignoring
+ * case, (re)building the index if the directory changed since it was last
+ * read, and copies the match over |actual|. Returns false if no index could
+ * be used, in which case the caller should scan the directory itself. */
+static bool search_name_index(struct fuse* fuse, const char* path,
+        const char* name, char* actual)
+{
+    struct name_index* index;
+    const char* found;
+    struct stat s;
+
+    if (stat(path, &s) < 0 || !(index = get_name_index(fuse, &s, true))) {
+        return false;
+    }
+    pthread_mutex_lock(&index->lock);
+    if (!index->valid || index->mtime != s.st_mtime
+            || index->mtime_nsec != s.st_mtime_nsec) {
+        if (!build_name_index_locked(index, path, &s)) {
+            pthread_mutex_unlock(&index->lock);
+            put_name_index(fuse, index);
+            return false;
+        }
+    }
+    found = find_name_locked(index, name);
+    if (found) {
+        /* don't need to copy the null again */
+        memcpy(actual, found, strlen(name));
+    }
+    if (time(NULL) - s.st_mtime < NAME_INDEX_RACY_SECS) {
+        /* Whatever else changes within the same tick would not move the
+         * mtime, so this snapshot is only good for the current search. */
+        clear_name_index_locked(index);
+    }
+    pthread_mutex_unlock(&index->lock);
+    put_name_index(fuse, index);
+    return true;
+}
+
+/* Records the state of directory |path| before this daemon changes it, for
+ * update_name_index(). A directory that can't be stat'ed gets a zeroed stat,
+ * which matches no index. */
+static void stat_before_change(const char* path, struct stat* before)
+{
+    if (stat(path, before) < 0) {
+        memset(before, 0, sizeof(*before));
+    }
+}
+
+/* Applies a change this daemon just made to directory |path| to its index,
+ * if it has one, so that the index stays usable across our own creates,
+ * unlinks and renames rather than being rebuilt after each. The delta is
+ * only applied if the index was current when the change was made, i.e. its
+ * mtime is the one in |before|; the change moved the mtime, so we then adopt
+ * the new one, unless it is too recent to be trusted. Otherwise something
+ * else changed the directory too and the index is dropped. */
+static void update_name_index(struct fuse* fuse, const char* path,
+        const struct stat* before, const char* removed, const char* added)
+{
+    struct name_index* index;
+    struct stat s;
+
+    if (stat(path, &s) < 0 || !(index = get_name_index(fuse, &s, false))) {
+        return;
+    }
+    pthread_mutex_lock(&index->lock);
+    if (index->valid) {
+        if (before->st_ino != s.st_ino || before->st_dev != s.st_dev
+                || index->mtime != before->st_mtime
+                || index->mtime_nsec != before->st_mtime_nsec) {
+            clear_name_index_locked(index);
+        } else {
+            if (removed) {
+                remove_name_locked(index, removed);
+            }
+            if (added && !add_name_locked(index, added)) {
+                clear_name_index_locked(index);
+            } else if (time(NULL) - s.st_mtime < NAME_INDEX_RACY_SECS) {
+                /* as in search_name_index(), a change made by someone else
+                 * in the same tick would not move the mtime again */
+                clear_name_index_locked(index);
+            } else {
+                index->mtime = s.st_mtime;
+                index->mtime_nsec = s.st_mtime_nsec;
+            }
+        }
+    }
+    pthread_mutex_unlock(&index->lock);
+    put_name_index(fuse, index);
+}
+
 /* Finds the absolute path of a file within a given directory.
  * Performs a case-insensitive search for the file and sets the buffer to the path
  * of the first matching file.  If 'search' is zero or if no match is found, sets
@@ -373,7 +818,7 @@ static ssize_t get_node_path_locked(struct node* node, char* buf, size_t bufsize
  * Populates 'buf' with the path and returns the actual name (within 'buf') on success,
  * or returns NULL if the path is too long for the provided buffer.
  */
-static char* find_file_within(const char* path, const char* name,
+static char* find_file_within(struct fuse* fuse, const char* path, const char* name,
         char* buf, size_t bufsize, int search)
 {
     size_t pathlen = strlen(path);
@@ -390,7 +835,7 @@ static char* find_file_within(const char* path, const char* name,
     actual = buf + pathlen + 1;
     memcpy(actual, name, namelen + 1);
 
-    if (search && access(buf, F_OK)) {
+    if (search && access(buf, F_OK) && !search_name_index(fuse, path, name, actual)) {
         struct dirent* entry;
         DIR* dir = opendir(path);
         if (!dir) {
@@ -698,34 +1143,61 @@ static struct node* lookup_node_and_path_by_id_locked(struct fuse* fuse, __u64 n
 
 static struct node *lookup_child_by_name_locked(struct node *node, const char *name)
 {
-    for (node = node->child; node; node = node->next) {
+    if (!node->nr_buckets) {
+        return 0;
+    }
+
+    __u32 hash = name_hash(name);
+    for (node = node->children[hash % node->nr_buckets]; node; node = node->next) {
         /* use exact string comparison, nodes that differ by case
          * must be considered distinct even if they refer to the same
          * underlying file as otherwise operations such as "mv x x"
          * will not work because the source and target nodes are the same. */
-        if (!strcmp(name, node->name)) {
+        if (node->hash == hash && !strcmp(name, node->name)) {
             return node;
         }
     }
     return 0;
 }
 
-static struct node* acquire_or_create_child_locked(
+/* Returns the named child of parent with a reference taken for the caller,
+ * creating its node if needed. The tree is left locked, shared or
+ * exclusively, so that the caller can fill the node into its reply before
+ * unlocking; on failure it is left unlocked. */
+static struct node* acquire_or_create_child(
         struct fuse* fuse, struct node* parent,
         const char* name, const char* actual_name)
 {
-    struct node* child = lookup_child_by_name_locked(parent, name);
+    struct node* child;
+
+    pthread_rwlock_rdlock(&fuse->lock);
+    child = lookup_child_by_name_locked(parent, name);
+    if (child) {
+        acquire_node_locked(child);
+        return child;
+    }
+    pthread_rwlock_unlock(&fuse->lock);
+
+    pthread_rwlock_wrlock(&fuse->lock);
+    child = lookup_child_by_name_locked(parent, name);
     if (child) {
         acquire_node_locked(child);
     } else {
         child = create_node_locked(fuse, parent, name, actual_name);
+        if (!child) {
+            pthread_rwlock_unlock(&fuse->lock);
+        }
     }
     return child;
 }
 
 static void fuse_init(struct fuse *fuse, int fd, const char *source_path,
-        gid_t write_gid, derive_t derive, bool split_perms) {
-    pthread_mutex_init(&fuse->lock, NULL);
+        gid_t write_gid, derive_t derive, bool split_perms, int cache_valid,
+        bool writeback) {
+    pthread_rwlock_init(&fuse->lock, NULL);
+    pthread_mutex_init(&fuse->name_index_lock, NULL);
+    list_init(&fuse->name_indexes);
+    fuse->nr_name_indexes = 0;
 
     fuse->fd = fd;
     fuse->next_generation = 0;
@@ -733,6 +1205,13 @@ static void fuse_init(struct fuse *fuse, int fd, const char *source_path,
     fuse->split_perms = split_perms;
     fuse->write_gid = write_gid;
     fuse->inode_ctr = 1;
+#ifdef FUSE_SPLICE
+    fuse->splice = false;
+#endif
+    fuse->cache_valid = cache_valid;
+    fuse->writeback = writeback;
+    fuse->handlers = NULL;
+    fuse->num_handlers = 0;
 
     memset(&fuse->root, 0, sizeof(fuse->root));
     fuse->root.nid = FUSE_ROOT_ID; /* 1 */
@@ -818,19 +1297,17 @@ static int fuse_reply_entry(struct fuse* fuse, __u64 unique,
         return -errno;
     }
 
-    pthread_mutex_lock(&fuse->lock);
-    node = acquire_or_create_child_locked(fuse, parent, name, actual_name);
+    node = acquire_or_create_child(fuse, parent, name, actual_name);
     if (!node) {
-        pthread_mutex_unlock(&fuse->lock);
         return -ENOMEM;
     }
     memset(&out, 0, sizeof(out));
     attr_from_stat(&out.attr, &s, node);
-    out.attr_valid = 10;
-    out.entry_valid = 10;
+    out.attr_valid = fuse->cache_valid;
+    out.entry_valid = fuse->cache_valid;
     out.nodeid = node->nid;
     out.generation = node->gen;
-    pthread_mutex_unlock(&fuse->lock);
+    pthread_rwlock_unlock(&fuse->lock);
     fuse_reply(fuse, unique, &out, sizeof(out));
     return NO_STATUS;
 }
@@ -846,7 +1323,7 @@ static int fuse_reply_attr(struct fuse* fuse, __u64 unique, const struct node* n
     }
     memset(&out, 0, sizeof(out));
     attr_from_stat(&out.attr, &s, node);
-    out.attr_valid = 10;
+    out.attr_valid = fuse->cache_valid;
     fuse_reply(fuse, unique, &out, sizeof(out));
     return NO_STATUS;
 }
@@ -859,14 +1336,14 @@ static int handle_lookup(struct fuse* fuse, struct fuse_handler* handler,
     char child_path[PATH_MAX];
     const char* actual_name;
 
-    pthread_mutex_lock(&fuse->lock);
+    pthread_rwlock_rdlock(&fuse->lock);
     parent_node = lookup_node_and_path_by_id_locked(fuse, hdr->nodeid,
             parent_path, sizeof(parent_path));
     TRACE("[%d] LOOKUP %s @ %"PRIx64" (%s)\n", handler->token, name, hdr->nodeid,
         parent_node ? parent_node->name : "?");
-    pthread_mutex_unlock(&fuse->lock);
+    pthread_rwlock_unlock(&fuse->lock);
 
-    if (!parent_node || !(actual_name = find_file_within(parent_path, name,
+    if (!parent_node || !(actual_name = find_file_within(fuse, parent_path, name,
             child_path, sizeof(child_path), 1))) {
         return -ENOENT;
     }
@@ -877,24 +1354,49 @@ static int handle_lookup(struct fuse* fuse, struct fuse_handler* handler,
     return fuse_reply_entry(fuse, hdr->unique, parent_node, name, actual_name, child_path);
 }
 
-static int handle_forget(struct fuse* fuse, struct fuse_handler* handler,
-        const struct fuse_in_header *hdr, const struct fuse_forget_in *req)
+static void forget_node_locked(struct fuse* fuse, struct fuse_handler* handler,
+        __u64 nodeid, __u64 nlookup)
 {
-    struct node* node;
+    struct node* node = lookup_node_by_id_locked(fuse, nodeid);
 
-    pthread_mutex_lock(&fuse->lock);
-    node = lookup_node_by_id_locked(fuse, hdr->nodeid);
-    TRACE("[%d] FORGET #%"PRIu64" @ %"PRIx64" (%s)\n", handler->token, req->nlookup,
-            hdr->nodeid, node ? node->name : "?");
+    TRACE("[%d] FORGET #%"PRIu64" @ %"PRIx64" (%s)\n", handler->token, nlookup,
+            nodeid, node ? node->name : "?");
     if (node) {
-        __u64 n = req->nlookup;
-        while (n--) {
+        while (nlookup--) {
             release_node_locked(node);
         }
     }
-    pthread_mutex_unlock(&fuse->lock);
+}
+
+static int handle_forget(struct fuse* fuse, struct fuse_handler* handler,
+        const struct fuse_in_header *hdr, const struct fuse_forget_in *req)
+{
+    pthread_rwlock_wrlock(&fuse->lock);
+    forget_node_locked(fuse, handler, hdr->nodeid, req->nlookup);
+    pthread_rwlock_unlock(&fuse->lock);
+    return NO_STATUS; /* no reply */
+}
+
+#ifdef FUSE_DO_READDIRPLUS
+static int handle_batch_forget(struct fuse* fuse, struct fuse_handler* handler,
+        const struct fuse_batch_forget_in *req, size_t data_len)
+{
+    const struct fuse_forget_one *items = (const struct fuse_forget_one*) (req + 1);
+    size_t count = (data_len - sizeof(*req)) / sizeof(*items);
+    size_t i;
+
+    if (req->count < count) {
+        count = req->count;
+    }
+    TRACE("[%d] BATCH_FORGET %zu\n", handler->token, count);
+    pthread_rwlock_wrlock(&fuse->lock);
+    for (i = 0; i < count; i++) {
+        forget_node_locked(fuse, handler, items[i].nodeid, items[i].nlookup);
+    }
+    pthread_rwlock_unlock(&fuse->lock);
     return NO_STATUS; /* no reply */
 }
+#endif
 
 static int handle_getattr(struct fuse* fuse, struct fuse_handler* handler,
         const struct fuse_in_header *hdr, const struct fuse_getattr_in *req)
@@ -902,11 +1404,11 @@ static int handle_getattr(struct fuse* fuse, struct fuse_handler* handler,
     struct node* node;
     char path[PATH_MAX];
 
-    pthread_mutex_lock(&fuse->lock);
+    pthread_rwlock_rdlock(&fuse->lock);
     node = lookup_node_and_path_by_id_locked(fuse, hdr->nodeid, path, sizeof(path));
     TRACE("[%d] GETATTR flags=%x fh=%"PRIx64" @ %"PRIx64" (%s)\n", handler->token,
             req->getattr_flags, req->fh, hdr->nodeid, node ? node->name : "?");
-    pthread_mutex_unlock(&fuse->lock);
+    pthread_rwlock_unlock(&fuse->lock);
 
     if (!node) {
         return -ENOENT;
@@ -926,12 +1428,12 @@ static int handle_setattr(struct fuse* fuse, struct fuse_handler* handler,
     char path[PATH_MAX];
     struct timespec times[2];
 
-    pthread_mutex_lock(&fuse->lock);
+    pthread_rwlock_rdlock(&fuse->lock);
     has_rw = get_caller_has_rw_locked(fuse, hdr);
     node = lookup_node_and_path_by_id_locked(fuse, hdr->nodeid, path, sizeof(path));
     TRACE("[%d] SETATTR fh=%"PRIx64" valid=%x @ %"PRIx64" (%s)\n", handler->token,
             req->fh, req->valid, hdr->nodeid, node ? node->name : "?");
-    pthread_mutex_unlock(&fuse->lock);
+    pthread_rwlock_unlock(&fuse->lock);
 
     if (!node) {
         return -ENOENT;
@@ -989,16 +1491,17 @@ static int handle_mknod(struct fuse* fuse, struct fuse_handler* handler,
     char parent_path[PATH_MAX];
     char child_path[PATH_MAX];
     const char* actual_name;
+    struct stat parent_stat;
 
-    pthread_mutex_lock(&fuse->lock);
+    pthread_rwlock_rdlock(&fuse->lock);
     has_rw = get_caller_has_rw_locked(fuse, hdr);
     parent_node = lookup_node_and_path_by_id_locked(fuse, hdr->nodeid,
             parent_path, sizeof(parent_path));
     TRACE("[%d] MKNOD %s 0%o @ %"PRIx64" (%s)\n", handler->token,
             name, req->mode, hdr->nodeid, parent_node ? parent_node->name : "?");
-    pthread_mutex_unlock(&fuse->lock);
+    pthread_rwlock_unlock(&fuse->lock);
 
-    if (!parent_node || !(actual_name = find_file_within(parent_path, name,
+    if (!parent_node || !(actual_name = find_file_within(fuse, parent_path, name,
             child_path, sizeof(child_path), 1))) {
         return -ENOENT;
     }
@@ -1006,9 +1509,11 @@ static int handle_mknod(struct fuse* fuse, struct fuse_handler* handler,
         return -EACCES;
     }
     __u32 mode = (req->mode & (~0777)) | 0664;
+    stat_before_change(parent_path, &parent_stat);
     if (mknod(child_path, mode, req->rdev) < 0) {
         return -errno;
     }
+    update_name_index(fuse, parent_path, &parent_stat, NULL, actual_name);
     return fuse_reply_entry(fuse, hdr->unique, parent_node, name, actual_name, child_path);
 }
 
@@ -1020,16 +1525,17 @@ static int handle_mkdir(struct fuse* fuse, struct fuse_handler* handler,
     char parent_path[PATH_MAX];
     char child_path[PATH_MAX];
     const char* actual_name;
+    struct stat parent_stat;
 
-    pthread_mutex_lock(&fuse->lock);
+    pthread_rwlock_rdlock(&fuse->lock);
     has_rw = get_caller_has_rw_locked(fuse, hdr);
     parent_node = lookup_node_and_path_by_id_locked(fuse, hdr->nodeid,
             parent_path, sizeof(parent_path));
     TRACE("[%d] MKDIR %s 0%o @ %"PRIx64" (%s)\n", handler->token,
             name, req->mode, hdr->nodeid, parent_node ? parent_node->name : "?");
-    pthread_mutex_unlock(&fuse->lock);
+    pthread_rwlock_unlock(&fuse->lock);
 
-    if (!parent_node || !(actual_name = find_file_within(parent_path, name,
+    if (!parent_node || !(actual_name = find_file_within(fuse, parent_path, name,
             child_path, sizeof(child_path), 1))) {
         return -ENOENT;
     }
@@ -1037,9 +1543,11 @@ static int handle_mkdir(struct fuse* fuse, struct fuse_handler* handler,
         return -EACCES;
     }
     __u32 mode = (req->mode & (~0777)) | 0775;
+    stat_before_change(parent_path, &parent_stat);
     if (mkdir(child_path, mode) < 0) {
         return -errno;
     }
+    update_name_index(fuse, parent_path, &parent_stat, NULL, actual_name);
 
     /* When creating /Android/data and /Android/obb, mark them as .nomedia */
     if (parent_node->perm == PERM_ANDROID && !strcasecmp(name, "data")) {
@@ -1069,25 +1577,29 @@ static int handle_unlink(struct fuse* fuse, struct fuse_handler* handler,
     struct node* parent_node;
     char parent_path[PATH_MAX];
     char child_path[PATH_MAX];
+    const char* actual_name;
+    struct stat parent_stat;
 
-    pthread_mutex_lock(&fuse->lock);
+    pthread_rwlock_rdlock(&fuse->lock);
     has_rw = get_caller_has_rw_locked(fuse, hdr);
     parent_node = lookup_node_and_path_by_id_locked(fuse, hdr->nodeid,
             parent_path, sizeof(parent_path));
     TRACE("[%d] UNLINK %s @ %"PRIx64" (%s)\n", handler->token,
             name, hdr->nodeid, parent_node ? parent_node->name : "?");
-    pthread_mutex_unlock(&fuse->lock);
+    pthread_rwlock_unlock(&fuse->lock);
 
-    if (!parent_node || !find_file_within(parent_path, name,
-            child_path, sizeof(child_path), 1)) {
+    if (!parent_node || !(actual_name = find_file_within(fuse, parent_path, name,
+            child_path, sizeof(child_path), 1))) {
         return -ENOENT;
     }
     if (!check_caller_access_to_name(fuse, hdr, parent_node, name, W_OK, has_rw)) {
         return -EACCES;
     }
+    stat_before_change(parent_path, &parent_stat);
     if (unlink(child_path) < 0) {
         return -errno;
     }
+    update_name_index(fuse, parent_path, &parent_stat, actual_name, NULL);
     return 0;
 }
 
@@ -1098,25 +1610,29 @@ static int handle_rmdir(struct fuse* fuse, struct fuse_handler* handler,
     struct node* parent_node;
     char parent_path[PATH_MAX];
     char child_path[PATH_MAX];
+    const char* actual_name;
+    struct stat parent_stat;
 
-    pthread_mutex_lock(&fuse->lock);
+    pthread_rwlock_rdlock(&fuse->lock);
     has_rw = get_caller_has_rw_locked(fuse, hdr);
     parent_node = lookup_node_and_path_by_id_locked(fuse, hdr->nodeid,
             parent_path, sizeof(parent_path));
     TRACE("[%d] RMDIR %s @ %"PRIx64" (%s)\n", handler->token,
             name, hdr->nodeid, parent_node ? parent_node->name : "?");
-    pthread_mutex_unlock(&fuse->lock);
+    pthread_rwlock_unlock(&fuse->lock);
 
-    if (!parent_node || !find_file_within(parent_path, name,
-            child_path, sizeof(child_path), 1)) {
+    if (!parent_node || !(actual_name = find_file_within(fuse, parent_path, name,
+            child_path, sizeof(child_path), 1))) {
         return -ENOENT;
     }
     if (!check_caller_access_to_name(fuse, hdr, parent_node, name, W_OK, has_rw)) {
         return -EACCES;
     }
+    stat_before_change(parent_path, &parent_stat);
     if (rmdir(child_path) < 0) {
         return -errno;
     }
+    update_name_index(fuse, parent_path, &parent_stat, actual_name, NULL);
     return 0;
 }
 
@@ -1133,9 +1649,11 @@ static int handle_rename(struct fuse* fuse, struct fuse_handler* handler,
     char old_child_path[PATH_MAX];
     char new_child_path[PATH_MAX];
     const char* new_actual_name;
+    struct stat old_parent_stat;
+    struct stat new_parent_stat;
     int res;
 
-    pthread_mutex_lock(&fuse->lock);
+    pthread_rwlock_rdlock(&fuse->lock);
     has_rw = get_caller_has_rw_locked(fuse, hdr);
     old_parent_node = lookup_node_and_path_by_id_locked(fuse, hdr->nodeid,
             old_parent_path, sizeof(old_parent_path));
@@ -1164,7 +1682,7 @@ static int handle_rename(struct fuse* fuse, struct fuse_handler* handler,
         goto lookup_error;
     }
     acquire_node_locked(child_node);
-    pthread_mutex_unlock(&fuse->lock);
+    pthread_rwlock_unlock(&fuse->lock);
 
     /* Special case for renaming a file where destination is same path
      * differing only by case.  In this case we don't want to look for a case
@@ -1172,20 +1690,32 @@ static int handle_rename(struct fuse* fuse, struct fuse_handler* handler,
      */
     int search = old_parent_node != new_parent_node
             || strcasecmp(old_name, new_name);
-    if (!(new_actual_name = find_file_within(new_parent_path, new_name,
+    if (!(new_actual_name = find_file_within(fuse, new_parent_path, new_name,
             new_child_path, sizeof(new_child_path), search))) {
         res = -ENOENT;
         goto io_error;
     }
 
     TRACE("[%d] RENAME %s->%s\n", handler->token, old_child_path, new_child_path);
+    stat_before_change(old_parent_path, &old_parent_stat);
+    if (old_parent_node != new_parent_node) {
+        stat_before_change(new_parent_path, &new_parent_stat);
+    }
     res = rename(old_child_path, new_child_path);
     if (res < 0) {
         res = -errno;
         goto io_error;
     }
+    if (old_parent_node == new_parent_node) {
+        update_name_index(fuse, old_parent_path, &old_parent_stat,
+                strrchr(old_child_path, '/') + 1, new_actual_name);
+    } else {
+        update_name_index(fuse, old_parent_path, &old_parent_stat,
+                strrchr(old_child_path, '/') + 1, NULL);
+        update_name_index(fuse, new_parent_path, &new_parent_stat, NULL, new_actual_name);
+    }
 
-    pthread_mutex_lock(&fuse->lock);
+    pthread_rwlock_wrlock(&fuse->lock);
     res = rename_node_locked(child_node, new_name, new_actual_name);
     if (!res) {
         remove_node_from_parent_locked(child_node);
@@ -1194,11 +1724,11 @@ static int handle_rename(struct fuse* fuse, struct fuse_handler* handler,
     goto done;
 
 io_error:
-    pthread_mutex_lock(&fuse->lock);
+    pthread_rwlock_wrlock(&fuse->lock);
 done:
     release_node_locked(child_node);
 lookup_error:
-    pthread_mutex_unlock(&fuse->lock);
+    pthread_rwlock_unlock(&fuse->lock);
     return res;
 }
 
@@ -1221,13 +1751,14 @@ static int handle_open(struct fuse* fuse, struct fuse_handler* handler,
     char path[PATH_MAX];
     struct fuse_open_out out;
     struct handle *h;
+    int flags;
 
-    pthread_mutex_lock(&fuse->lock);
+    pthread_rwlock_rdlock(&fuse->lock);
     has_rw = get_caller_has_rw_locked(fuse, hdr);
     node = lookup_node_and_path_by_id_locked(fuse, hdr->nodeid, path, sizeof(path));
     TRACE("[%d] OPEN 0%o @ %"PRIx64" (%s)\n", handler->token,
             req->flags, hdr->nodeid, node ? node->name : "?");
-    pthread_mutex_unlock(&fuse->lock);
+    pthread_rwlock_unlock(&fuse->lock);
 
     if (!node) {
         return -ENOENT;
@@ -1240,8 +1771,17 @@ static int handle_open(struct fuse* fuse, struct fuse_handler* handler,
     if (!h) {
         return -ENOMEM;
     }
+    flags = req->flags;
+    if (fuse->writeback) {
+        /* The kernel may read pages back to fill in partial writes, and it
+         * positions appends itself. */
+        if ((flags & O_ACCMODE) == O_WRONLY) {
+            flags = (flags & ~O_ACCMODE) | O_RDWR;
+        }
+        flags &= ~O_APPEND;
+    }
     TRACE("[%d] OPEN %s\n", handler->token, path);
-    h->fd = open(path, req->flags);
+    h->fd = open(path, flags);
     if (h->fd < 0) {
         free(h);
         return -errno;
@@ -1253,6 +1793,116 @@ static int handle_open(struct fuse* fuse, struct fuse_handler* handler,
     return NO_STATUS;
 }
 
+#ifdef FUSE_SPLICE
+/* Reads exactly |len| bytes from a pipe that is known to hold them. */
+static int read_pipe(int fd, void* buf, size_t len)
+{
+    while (len) {
+        ssize_t res = read(fd, buf, len);
+        if (res <= 0) {
+            if (res < 0 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf = (__u8*) buf + res;
+        len -= res;
+    }
+    return 0;
+}
+
+/* Throws away |len| bytes left in a handler's pipe. */
+static void drain_pipe(struct fuse_handler* handler, size_t len)
+{
+    __u8 buf[PAGESIZE];
+
+    while (len) {
+        size_t count = len < sizeof(buf) ? len : sizeof(buf);
+        if (read_pipe(handler->pipe[0], buf, count)) {
+            ERROR("[%d] cannot drain splice pipe: %s\n", handler->token, strerror(errno));
+            return;
+        }
+        len -= count;
+    }
+}
+
+/* Replies to a READ by splicing the file's pages through the handler's pipe
+ * into /dev/fuse, so that the data is never copied into our buffers.
+ *
+ * The reply header has to enter the pipe before the data, so it promises
+ * all |size| bytes. If the file comes up short the reply is pulled back out
+ * of the pipe into |buffer| and sent the ordinary way.
+ *
+ * Returns NO_STATUS once replied, or a negative errno.
+ */
+static int splice_read(struct fuse* fuse, struct fuse_handler* handler, __u64 unique,
+        int fd, __u32 size, __u64 offset, __u8* buffer)
+{
+    struct fuse_out_header hdr;
+    loff_t off = offset;
+    size_t len = 0;
+    ssize_t res = 0;
+
+    hdr.len = sizeof(hdr) + size;
+    hdr.error = 0;
+    hdr.unique = unique;
+    if (write(handler->pipe[1], &hdr, sizeof(hdr)) != sizeof(hdr)) {
+        return -EIO;
+    }
+    while (len < size) {
+        res = splice(fd, &off, handler->pipe[1], NULL, size - len, SPLICE_F_MOVE);
+        if (res <= 0) {
+            break;
+        }
+        len += res;
+    }
+    if (res < 0) {
+        res = -errno;
+        drain_pipe(handler, sizeof(hdr) + len);
+        return res;
+    }
+    if (len < size) {
+        if (read_pipe(handler->pipe[0], &hdr, sizeof(hdr))
+                || read_pipe(handler->pipe[0], buffer, len)) {
+            return -EIO;
+        }
+        fuse_reply(fuse, unique, buffer, len);
+        return NO_STATUS;
+    }
+
+    len += sizeof(hdr);
+    res = splice(handler->pipe[0], NULL, fuse->fd, NULL, len, SPLICE_F_MOVE);
+    if (res != (ssize_t) len) {
+        /* As with fuse_reply(), the request may have been interrupted. */
+        ERROR("*** READ REPLY FAILED *** %d\n", errno);
+        drain_pipe(handler, res < 0 ? len : len - res);
+    }
+    return NO_STATUS;
+}
+
+/* Writes the payload of a WRITE straight from the handler's pipe into the
+ * file. Returns like pwrite(). */
+static ssize_t splice_write(struct fuse_handler* handler, int fd, __u32 size, __u64 offset)
+{
+    loff_t off = offset;
+    size_t len = 0;
+    ssize_t res;
+
+    while (len < size) {
+        res = splice(handler->pipe[0], NULL, fd, &off, size - len, SPLICE_F_MOVE);
+        if (res <= 0) {
+            if (res < 0 && !len) {
+                return -1;
+            }
+            break;
+        }
+        len += res;
+        handler->spliced -= res;
+    }
+    return len;
+}
+#endif
+
 static int handle_read(struct fuse* fuse, struct fuse_handler* handler,
         const struct fuse_in_header* hdr, const struct fuse_read_in* req)
 {
@@ -1272,6 +1922,11 @@ static int handle_read(struct fuse* fuse, struct fuse_handler* handler,
     if (size > MAX_READ) {
         return -EINVAL;
     }
+#ifdef FUSE_SPLICE
+    if (fuse->splice && handler->pipe[0] >= 0) {
+        return splice_read(fuse, handler, unique, h->fd, size, offset, read_buffer);
+    }
+#endif
     res = pread64(h->fd, read_buffer, size, offset);
     if (res < 0) {
         return -errno;
@@ -1289,13 +1944,32 @@ static int handle_write(struct fuse* fuse, struct fuse_handler* handler,
     int res;
     __u8 aligned_buffer[req->size] __attribute__((__aligned__(PAGESIZE)));
 
+    TRACE("[%d] WRITE %p(%d) %u@%"PRIu64"\n", handler->token,
+            h, h->fd, req->size, req->offset);
+#ifdef FUSE_SPLICE
+    /* If read_request() spliced the payload, it is still in the pipe. */
+    if (handler->spliced && handler->spliced != req->size) {
+        return -EINVAL;
+    }
+#endif
     if (req->flags & O_DIRECT) {
+#ifdef FUSE_SPLICE
+        /* O_DIRECT wants aligned memory, so that still takes one copy. */
+        if (handler->spliced) {
+            if (read_pipe(handler->pipe[0], aligned_buffer, req->size)) {
+                return -EIO;
+            }
+            handler->spliced = 0;
+        } else
+#endif
         memcpy(aligned_buffer, buffer, req->size);
         buffer = (const __u8*) aligned_buffer;
     }
-
-    TRACE("[%d] WRITE %p(%d) %u@%"PRIu64"\n", handler->token,
-            h, h->fd, req->size, req->offset);
+#ifdef FUSE_SPLICE
+    if (handler->spliced) {
+        res = splice_write(handler, h->fd, req->size, req->offset);
+    } else
+#endif
     res = pwrite64(h->fd, buffer, req->size, req->offset);
     if (res < 0) {
         return -errno;
@@ -1313,10 +1987,10 @@ static int handle_statfs(struct fuse* fuse, struct fuse_handler* handler,
     struct fuse_statfs_out out;
     int res;
 
-    pthread_mutex_lock(&fuse->lock);
+    pthread_rwlock_rdlock(&fuse->lock);
     TRACE("[%d] STATFS\n", handler->token);
     res = get_node_path_locked(&fuse->root, path, sizeof(path));
-    pthread_mutex_unlock(&fuse->lock);
+    pthread_rwlock_unlock(&fuse->lock);
     if (res < 0) {
         return -ENOENT;
     }
@@ -1387,11 +2061,11 @@ static int handle_opendir(struct fuse* fuse, struct fuse_handler* handler,
     struct fuse_open_out out;
     struct dirhandle *h;
 
-    pthread_mutex_lock(&fuse->lock);
+    pthread_rwlock_rdlock(&fuse->lock);
     node = lookup_node_and_path_by_id_locked(fuse, hdr->nodeid, path, sizeof(path));
     TRACE("[%d] OPENDIR @ %"PRIx64" (%s)\n", handler->token,
             hdr->nodeid, node ? node->name : "?");
-    pthread_mutex_unlock(&fuse->lock);
+    pthread_rwlock_unlock(&fuse->lock);
 
     if (!node) {
         return -ENOENT;
@@ -1405,6 +2079,7 @@ static int handle_opendir(struct fuse* fuse, struct fuse_handler* handler,
     }
     TRACE("[%d] OPENDIR %s\n", handler->token, path);
     h->d = opendir(path);
+    h->next_off = 0;
     if (!h->d) {
         free(h);
         return -errno;
@@ -1416,34 +2091,166 @@ static int handle_opendir(struct fuse* fuse, struct fuse_handler* handler,
     return NO_STATUS;
 }
 
+/* Positions an open directory at the entry the kernel asks for. Each entry's
+ * offset is one past its index, so anything but where the last reply ended
+ * (a rewinddir() or seekdir() above us) means starting over and skipping
+ * forward. */
+static void seek_dirhandle(struct fuse_handler* handler, struct dirhandle* h,
+        __u64 offset)
+{
+    if (offset == h->next_off) {
+        return;
+    }
+    TRACE("[%d] calling rewinddir() to reach offset %"PRIu64"\n", handler->token, offset);
+    rewinddir(h->d);
+    h->next_off = 0;
+    while (h->next_off < offset && readdir(h->d)) {
+        h->next_off++;
+    }
+}
+
 static int handle_readdir(struct fuse* fuse, struct fuse_handler* handler,
         const struct fuse_in_header* hdr, const struct fuse_read_in* req)
 {
-    char buffer[8192];
-    struct fuse_dirent *fde = (struct fuse_dirent*) buffer;
+    struct dirhandle *h = id_to_ptr(req->fh);
+    __u64 unique = hdr->unique;
+    __u64 offset = req->offset;
+    __u32 size = req->size;
+    __u32 len = 0;
     struct dirent *de;
+    long pos;
+    __u8 *read_buffer = (__u8 *) ((uintptr_t)(handler->read_buffer + PAGESIZE) & ~((uintptr_t)PAGESIZE-1));
+
+    /* As in handle_read(), the reply buffer overlaps the request. */
+
+    TRACE("[%d] READDIR %p %u@%"PRIu64"\n", handler->token, h, size, offset);
+    if (size > MAX_READ) {
+        size = MAX_READ;
+    }
+
+    /* Fill the buffer with as many entries as fit, rather than paying a
+     * round trip to the kernel for each one. An entry that doesn't fit is
+     * put back for the next request. */
+    seek_dirhandle(handler, h, offset);
+    while ((pos = telldir(h->d)) >= 0 && (de = readdir(h->d))) {
+        struct fuse_dirent *fde = (struct fuse_dirent*) (read_buffer + len);
+        size_t namelen = strlen(de->d_name);
+        size_t entlen = FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET + namelen);
+
+        if (len + entlen > size) {
+            seekdir(h->d, pos);
+            break;
+        }
+        fde->ino = FUSE_UNKNOWN_INO;
+        fde->off = ++h->next_off;
+        fde->type = de->d_type;
+        fde->namelen = namelen;
+        memcpy(fde->name, de->d_name, namelen);
+        memset(fde->name + namelen, 0, entlen - FUSE_NAME_OFFSET - namelen);
+        len += entlen;
+    }
+
+    if (!len) {
+        return 0;
+    }
+    fuse_reply(fuse, unique, read_buffer, len);
+    return NO_STATUS;
+}
+
+#ifdef FUSE_DO_READDIRPLUS
+/* Fills in the entry of a READDIRPLUS reply, acquiring the node the way a
+ * LOOKUP would. Leaves the entry zeroed, which the kernel takes as "no
+ * attributes" and falls back to LOOKUP for, if that isn't possible. */
+static void fill_direntplus_entry(struct fuse* fuse, const struct fuse_in_header* hdr,
+        struct node* parent_node, const char* parent_path, const char* name,
+        struct fuse_entry_out* out)
+{
+    char child_path[PATH_MAX];
+    struct node* node;
+    struct stat s;
+
+    memset(out, 0, sizeof(*out));
+
+    /* the kernel ignores these, so they must not take a reference */
+    if (!strcmp(name, ".") || !strcmp(name, "..")) {
+        return;
+    }
+    if (!check_caller_access_to_name(fuse, hdr, parent_node, name, R_OK, false)) {
+        return;
+    }
+    if ((size_t) snprintf(child_path, sizeof(child_path), "%s/%s", parent_path, name)
+            >= sizeof(child_path) || lstat(child_path, &s) < 0) {
+        return;
+    }
+
+    node = acquire_or_create_child(fuse, parent_node, name, name);
+    if (node) {
+        attr_from_stat(&out->attr, &s, node);
+        out->attr_valid = fuse->cache_valid;
+        out->entry_valid = fuse->cache_valid;
+        out->nodeid = node->nid;
+        out->generation = node->gen;
+        pthread_rwlock_unlock(&fuse->lock);
+    }
+}
+
+static int handle_readdirplus(struct fuse* fuse, struct fuse_handler* handler,
+        const struct fuse_in_header* hdr, const struct fuse_read_in* req)
+{
     struct dirhandle *h = id_to_ptr(req->fh);
+    struct fuse_in_header in_hdr = *hdr;
+    __u64 offset = req->offset;
+    __u32 size = req->size;
+    __u32 len = 0;
+    struct node* node;
+    char path[PATH_MAX];
+    struct dirent *de;
+    long pos;
+    __u8 *read_buffer = (__u8 *) ((uintptr_t)(handler->read_buffer + PAGESIZE) & ~((uintptr_t)PAGESIZE-1));
+
+    /* As in handle_read(), the reply buffer overlaps the request; in_hdr
+     * keeps the caller's credentials for the access checks. */
 
-    TRACE("[%d] READDIR %p\n", handler->token, h);
-    if (req->offset == 0) {
-        /* rewinddir() might have been called above us, so rewind here too */
-        TRACE("[%d] calling rewinddir()\n", handler->token);
-        rewinddir(h->d);
+    pthread_rwlock_rdlock(&fuse->lock);
+    node = lookup_node_and_path_by_id_locked(fuse, in_hdr.nodeid, path, sizeof(path));
+    TRACE("[%d] READDIRPLUS %p %u@%"PRIu64" @ %"PRIx64" (%s)\n", handler->token,
+            h, size, offset, in_hdr.nodeid, node ? node->name : "?");
+    pthread_rwlock_unlock(&fuse->lock);
+
+    if (!node) {
+        return -ENOENT;
+    }
+    if (size > MAX_READ) {
+        size = MAX_READ;
+    }
+
+    seek_dirhandle(handler, h, offset);
+    while ((pos = telldir(h->d)) >= 0 && (de = readdir(h->d))) {
+        struct fuse_direntplus *fdp = (struct fuse_direntplus*) (read_buffer + len);
+        size_t namelen = strlen(de->d_name);
+        size_t entlen = FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET_DIRENTPLUS + namelen);
+
+        if (len + entlen > size) {
+            seekdir(h->d, pos);
+            break;
+        }
+        fill_direntplus_entry(fuse, &in_hdr, node, path, de->d_name, &fdp->entry_out);
+        fdp->dirent.ino = fdp->entry_out.nodeid ? fdp->entry_out.attr.ino : FUSE_UNKNOWN_INO;
+        fdp->dirent.off = ++h->next_off;
+        fdp->dirent.type = de->d_type;
+        fdp->dirent.namelen = namelen;
+        memcpy(fdp->dirent.name, de->d_name, namelen);
+        memset(fdp->dirent.name + namelen, 0, entlen - FUSE_NAME_OFFSET_DIRENTPLUS - namelen);
+        len += entlen;
     }
-    de = readdir(h->d);
-    if (!de) {
+
+    if (!len) {
         return 0;
     }
-    fde->ino = FUSE_UNKNOWN_INO;
-    /* increment the offset so we can detect when rewinddir() seeks back to the beginning */
-    fde->off = req->offset + 1;
-    fde->type = de->d_type;
-    fde->namelen = strlen(de->d_name);
-    memcpy(fde->name, de->d_name, fde->namelen + 1);
-    fuse_reply(fuse, hdr->unique, fde,
-            FUSE_DIRENT_ALIGN(sizeof(struct fuse_dirent) + fde->namelen));
+    fuse_reply(fuse, in_hdr.unique, read_buffer, len);
     return NO_STATUS;
 }
+#endif
 
 static int handle_releasedir(struct fuse* fuse, struct fuse_handler* handler,
         const struct fuse_in_header* hdr, const struct fuse_release_in* req)
@@ -1460,17 +2267,56 @@ static int handle_init(struct fuse* fuse, struct fuse_handler* handler,
         const struct fuse_in_header* hdr, const struct fuse_init_in* req)
 {
     struct fuse_init_out out;
+    size_t out_size = sizeof(out);
 
     TRACE("[%d] INIT ver=%d.%d maxread=%d flags=%x\n",
             handler->token, req->major, req->minor, req->max_readahead, req->flags);
+    memset(&out, 0, sizeof(out));
     out.major = FUSE_KERNEL_VERSION;
     out.minor = FUSE_KERNEL_MINOR_VERSION;
     out.max_readahead = req->max_readahead;
     out.flags = FUSE_ATOMIC_O_TRUNC | FUSE_BIG_WRITES;
+#ifdef FUSE_DO_READDIRPLUS
+    out.flags |= req->flags & FUSE_DO_READDIRPLUS;
+#endif
+    /* Reads are independent pread()s, so readahead need not wait for them
+     * one at a time. */
+    out.flags |= req->flags & FUSE_ASYNC_READ;
+#ifdef FUSE_AUTO_INVAL_DATA
+    /* Drop cached pages when a file's size or mtime changes underneath us,
+     * so that long cache validity doesn't serve stale data. */
+    out.flags |= req->flags & FUSE_AUTO_INVAL_DATA;
+#endif
+#ifdef FUSE_WRITEBACK_CACHE
+    if (!(req->flags & FUSE_WRITEBACK_CACHE)) {
+        fuse->writeback = false;
+    }
+    if (fuse->writeback) {
+        out.flags |= FUSE_WRITEBACK_CACHE;
+    }
+#else
+    fuse->writeback = false;
+#endif
+#ifdef FUSE_MAX_PAGES
+    /* Otherwise the kernel caps requests at 32 pages, short of MAX_WRITE. */
+    if (req->flags & FUSE_MAX_PAGES) {
+        out.flags |= FUSE_MAX_PAGES;
+        out.max_pages = MAX_WRITE / PAGESIZE;
+    }
+#endif
+#ifdef FUSE_COMPAT_22_INIT_OUT_SIZE
+    /* Older kernels reject a reply longer than the one they know. */
+    if (req->major == 7 && req->minor < 23) {
+        out_size = FUSE_COMPAT_22_INIT_OUT_SIZE;
+    }
+#endif
     out.max_background = 32;
     out.congestion_threshold = 32;
     out.max_write = MAX_WRITE;
-    fuse_reply(fuse, hdr->unique, &out, sizeof(out));
+#ifdef FUSE_SPLICE
+    fuse->splice = req->major > 7 || (req->major == 7 && req->minor >= FUSE_SPLICE_MINOR);
+#endif
+    fuse_reply(fuse, hdr->unique, &out, out_size);
     return NO_STATUS;
 }
 
@@ -1488,6 +2334,16 @@ static int handle_fuse_request(struct fuse *fuse, struct fuse_handler* handler,
         return handle_forget(fuse, handler, hdr, req);
     }
 
+#ifdef FUSE_DO_READDIRPLUS
+    case FUSE_BATCH_FORGET: {
+        const struct fuse_batch_forget_in *req = data;
+        if (data_len < sizeof(*req)) {
+            return NO_STATUS; /* no reply */
+        }
+        return handle_batch_forget(fuse, handler, req, data_len);
+    }
+#endif
+
     case FUSE_GETATTR: { /* getattr_in -> attr_out */
         const struct fuse_getattr_in *req = data;
         return handle_getattr(fuse, handler, hdr, req);
@@ -1579,6 +2435,13 @@ static int handle_fuse_request(struct fuse *fuse, struct fuse_handler* handler,
         return handle_readdir(fuse, handler, hdr, req);
     }
 
+#ifdef FUSE_DO_READDIRPLUS
+    case FUSE_READDIRPLUS: {
+        const struct fuse_read_in *req = data;
+        return handle_readdirplus(fuse, handler, hdr, req);
+    }
+#endif
+
     case FUSE_RELEASEDIR: { /* release_in -> */
         const struct fuse_release_in *req = data;
         return handle_releasedir(fuse, handler, hdr, req);
@@ -1597,12 +2460,177 @@ static int handle_fuse_request(struct fuse *fuse, struct fuse_handler* handler,
     }
 }
 
+static const char* const kOpcodeNames[NR_OPCODE_STATS] = {
+    [0] = "other",
+    [FUSE_LOOKUP] = "LOOKUP",
+    [FUSE_FORGET] = "FORGET",
+    [FUSE_GETATTR] = "GETATTR",
+    [FUSE_SETATTR] = "SETATTR",
+    [FUSE_MKNOD] = "MKNOD",
+    [FUSE_MKDIR] = "MKDIR",
+    [FUSE_UNLINK] = "UNLINK",
+    [FUSE_RMDIR] = "RMDIR",
+    [FUSE_RENAME] = "RENAME",
+    [FUSE_OPEN] = "OPEN",
+    [FUSE_READ] = "READ",
+    [FUSE_WRITE] = "WRITE",
+    [FUSE_STATFS] = "STATFS",
+    [FUSE_RELEASE] = "RELEASE",
+    [FUSE_FSYNC] = "FSYNC",
+    [FUSE_FLUSH] = "FLUSH",
+    [FUSE_INIT] = "INIT",
+    [FUSE_OPENDIR] = "OPENDIR",
+    [FUSE_READDIR] = "READDIR",
+    [FUSE_RELEASEDIR] = "RELEASEDIR",
+    [FUSE_FSYNCDIR] = "FSYNCDIR",
+    [FUSE_SETXATTR] = "SETXATTR",
+    [FUSE_GETXATTR] = "GETXATTR",
+    [FUSE_LISTXATTR] = "LISTXATTR",
+    [FUSE_REMOVEXATTR] = "REMOVEXATTR",
+    [FUSE_CREATE] = "CREATE",
+    [FUSE_INTERRUPT] = "INTERRUPT",
+#ifdef FUSE_DO_READDIRPLUS
+    [FUSE_BATCH_FORGET] = "BATCH_FORGET",
+    [FUSE_READDIRPLUS] = "READDIRPLUS",
+#endif
+};
+
+static uint64_t gettime_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void record_request(struct fuse_handler* handler, __u32 opcode, int res,
+        uint64_t us)
+{
+    struct op_stats* stats = &handler->stats[opcode < NR_OPCODE_STATS ? opcode : 0];
+    int bucket = 0;
+
+    while (bucket < NR_LATENCY_BUCKETS - 1 && us >> (bucket + 1)) {
+        bucket++;
+    }
+    stats->count++;
+    if (res < 0) {
+        stats->errors++;
+    }
+    stats->total_us += us;
+    if (us > stats->max_us) {
+        stats->max_us = us;
+    }
+    stats->latency[bucket]++;
+}
+
+/* Logs the request statistics of all handlers since startup. The counters
+ * are read while the handlers keep running, so a dump can be off by the
+ * requests in flight. */
+static void dump_stats(struct fuse* fuse)
+{
+    int op, i, b;
+
+    INFO("request statistics:\n");
+    for (op = 0; op < NR_OPCODE_STATS; op++) {
+        struct op_stats total;
+        char name[16];
+        char hist[NR_LATENCY_BUCKETS * 24];
+        size_t len = 0;
+
+        memset(&total, 0, sizeof(total));
+        for (i = 0; i < fuse->num_handlers; i++) {
+            const struct op_stats* stats = &fuse->handlers[i].stats[op];
+            total.count += stats->count;
+            total.errors += stats->errors;
+            total.total_us += stats->total_us;
+            if (stats->max_us > total.max_us) {
+                total.max_us = stats->max_us;
+            }
+            for (b = 0; b < NR_LATENCY_BUCKETS; b++) {
+                total.latency[b] += stats->latency[b];
+            }
+        }
+        if (!total.count) {
+            continue;
+        }
+
+        for (b = 0; b < NR_LATENCY_BUCKETS; b++) {
+            if (total.latency[b]) {
+                len += snprintf(hist + len, sizeof(hist) - len, " %s%uus:%u",
+                        b < NR_LATENCY_BUCKETS - 1 ? "<" : ">=",
+                        b < NR_LATENCY_BUCKETS - 1 ? 2u << b : 1u << b,
+                        total.latency[b]);
+            }
+        }
+        if (kOpcodeNames[op]) {
+            snprintf(name, sizeof(name), "%s", kOpcodeNames[op]);
+        } else {
+            snprintf(name, sizeof(name), "op %d", op);
+        }
+        INFO("%s: %"PRIu64" requests, %"PRIu64" errors, avg %"PRIu64"us, "
+                "max %"PRIu64"us;%s\n", name, total.count, total.errors,
+                total.total_us / total.count, total.max_us, hist);
+    }
+}
+
+/* Dumps statistics whenever SIGUSR1 arrives; ignite_fuse() blocks the signal
+ * in every other thread. */
+static void* start_stats_dumper(void* data)
+{
+    struct fuse* fuse = data;
+    sigset_t sigset;
+    int sig;
+
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGUSR1);
+    for (;;) {
+        if (!sigwait(&sigset, &sig)) {
+            dump_stats(fuse);
+        }
+    }
+    return NULL;
+}
+
+/* Reads the next request into the request buffer. When splicing, the request
+ * is first moved into the handler's pipe and everything but the payload of a
+ * WRITE is read back out; handle_write() splices the payload into the file. */
+static ssize_t read_request(struct fuse* fuse, struct fuse_handler* handler)
+{
+#ifdef FUSE_SPLICE
+    if (fuse->splice && handler->pipe[0] >= 0) {
+        const struct fuse_in_header *hdr = (void*)handler->request_buffer;
+        ssize_t len;
+        size_t head;
+
+        len = splice(fuse->fd, NULL, handler->pipe[1], NULL,
+                sizeof(handler->request_buffer), 0);
+        if (len < (ssize_t) sizeof(*hdr)) {
+            if (len > 0) {
+                drain_pipe(handler, len);
+            }
+            return len;
+        }
+        if (read_pipe(handler->pipe[0], handler->request_buffer, sizeof(*hdr))) {
+            return -1;
+        }
+        head = len - sizeof(*hdr);
+        if (hdr->opcode == FUSE_WRITE && head > sizeof(struct fuse_write_in)) {
+            head = sizeof(struct fuse_write_in);
+        }
+        if (read_pipe(handler->pipe[0], handler->request_buffer + sizeof(*hdr), head)) {
+            return -1;
+        }
+        handler->spliced = len - sizeof(*hdr) - head;
+        return len;
+    }
+#endif
+    return read(fuse->fd, handler->request_buffer, sizeof(handler->request_buffer));
+}
+
 static void handle_fuse_requests(struct fuse_handler* handler)
 {
     struct fuse* fuse = handler->fuse;
     for (;;) {
-        ssize_t len = read(fuse->fd,
-                handler->request_buffer, sizeof(handler->request_buffer));
+        ssize_t len = read_request(fuse, handler);
         if (len < 0) {
             if (errno != EINTR) {
                 ERROR("[%d] handle_fuse_requests: errno=%d\n", handler->token, errno);
@@ -1625,8 +2653,17 @@ static void handle_fuse_requests(struct fuse_handler* handler)
         const void *data = handler->request_buffer + sizeof(struct fuse_in_header);
         size_t data_len = len - sizeof(struct fuse_in_header);
         __u64 unique = hdr->unique;
+        __u32 opcode = hdr->opcode;
+        uint64_t start = gettime_us();
         int res = handle_fuse_request(fuse, handler, hdr, data, data_len);
 
+#ifdef FUSE_SPLICE
+        if (handler->spliced) {
+            drain_pipe(handler, handler->spliced);
+            handler->spliced = 0;
+        }
+#endif
+
         /* We do not access the request again after this point because the underlying
          * buffer storage may have been reused while processing the request. */
 
@@ -1636,6 +2673,7 @@ static void handle_fuse_requests(struct fuse_handler* handler)
             }
             fuse_status(fuse, unique, res);
         }
+        record_request(handler, opcode, res, gettime_us() - start);
     }
 }
 
@@ -1660,7 +2698,7 @@ static bool remove_int_to_null(void *key, void *value, void *context) {
 }
 
 static int read_package_list(struct fuse *fuse) {
-    pthread_mutex_lock(&fuse->lock);
+    pthread_rwlock_wrlock(&fuse->lock);
 
     hashmapForEach(fuse->package_to_appid, remove_str_to_int, fuse->package_to_appid);
     hashmapForEach(fuse->appid_with_rw, remove_int_to_null, fuse->appid_with_rw);
@@ -1668,7 +2706,7 @@ static int read_package_list(struct fuse *fuse) {
     FILE* file = fopen(kPackagesListFile, "r");
     if (!file) {
         ERROR("failed to open package list: %s\n", strerror(errno));
-        pthread_mutex_unlock(&fuse->lock);
+        pthread_rwlock_unlock(&fuse->lock);
         return -1;
     }
 
@@ -1697,7 +2735,7 @@ static int read_package_list(struct fuse *fuse) {
             hashmapSize(fuse->package_to_appid),
             hashmapSize(fuse->appid_with_rw));
     fclose(file);
-    pthread_mutex_unlock(&fuse->lock);
+    pthread_rwlock_unlock(&fuse->lock);
     return 0;
 }
 
@@ -1766,24 +2804,47 @@ static void watch_package_list(struct fuse* fuse) {
 static int ignite_fuse(struct fuse* fuse, int num_threads)
 {
     struct fuse_handler* handlers;
+    pthread_t thread;
+    sigset_t sigset;
     int i;
 
-    handlers = malloc(num_threads * sizeof(struct fuse_handler));
+    handlers = calloc(num_threads, sizeof(struct fuse_handler));
     if (!handlers) {
         ERROR("cannot allocate storage for threads\n");
         return -ENOMEM;
     }
+    fuse->handlers = handlers;
+    fuse->num_handlers = num_threads;
+
+    /* Leave SIGUSR1 to the statistics thread. */
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+    if (pthread_create(&thread, NULL, start_stats_dumper, fuse)) {
+        ERROR("failed to start statistics thread\n");
+    }
 
     for (i = 0; i < num_threads; i++) {
         handlers[i].fuse = fuse;
         handlers[i].token = i;
+#ifdef FUSE_SPLICE
+        handlers[i].spliced = 0;
+        if (pipe(handlers[i].pipe)) {
+            ERROR("[%d] cannot create splice pipe: %s\n", i, strerror(errno));
+            handlers[i].pipe[0] = handlers[i].pipe[1] = -1;
+        } else if (fcntl(handlers[i].pipe[0], F_SETPIPE_SZ, SPLICE_PIPE_SIZE) < 0) {
+            ERROR("[%d] cannot size splice pipe: %s\n", i, strerror(errno));
+            close(handlers[i].pipe[0]);
+            close(handlers[i].pipe[1]);
+            handlers[i].pipe[0] = handlers[i].pipe[1] = -1;
+        }
+#endif
     }
 
     /* When deriving permissions, this thread is used to process inotify events,
      * otherwise it becomes one of the FUSE handlers. */
     i = (fuse->derive == DERIVE_NONE) ? 1 : 0;
     for (; i < num_threads; i++) {
-        pthread_t thread;
         int res = pthread_create(&thread, NULL, start_handler, &handlers[i]);
         if (res) {
             ERROR("failed to start thread #%d, error=%d\n", i, res);
@@ -1815,13 +2876,18 @@ static int usage()
             "    -d: derive file permissions based on path\n"
             "    -l: derive file permissions based on legacy internal layout\n"
             "    -s: split derived permissions for pics, av\n"
-            "\n", DEFAULT_NUM_THREADS);
+            "    -c: seconds the kernel may cache attributes and entries (default %s or %d)\n"
+            "    -W: let the kernel cache writes, if it can (default %s)\n"
+            "\n"
+            "Send SIGUSR1 to log per-request statistics.\n"
+            "\n", DEFAULT_NUM_THREADS, kCacheValidProperty, DEFAULT_CACHE_VALID,
+            kWritebackProperty);
     return 1;
 }
 
 static int run(const char* source_path, const char* dest_path, uid_t uid,
         gid_t gid, gid_t write_gid, int num_threads, derive_t derive,
-        bool split_perms) {
+        bool split_perms, int cache_valid, bool writeback) {
     int fd;
     char opts[256];
     int res;
@@ -1837,8 +2903,8 @@ static int run(const char* source_path, const char* dest_path, uid_t uid,
     }
 
     snprintf(opts, sizeof(opts),
-            "fd=%i,rootmode=40000,default_permissions,allow_other,user_id=%d,group_id=%d",
-            fd, uid, gid);
+            "fd=%i,rootmode=40000,default_permissions,allow_other,user_id=%d,group_id=%d,"
+            "max_read=%d", fd, uid, gid, MAX_READ);
 
     res = mount("/dev/fuse", dest_path, "fuse", MS_NOSUID | MS_NODEV | MS_NOEXEC, opts);
     if (res < 0) {
@@ -1864,7 +2930,8 @@ static int run(const char* source_path, const char* dest_path, uid_t uid,
         goto error;
     }
 
-    fuse_init(&fuse, fd, source_path, write_gid, derive, split_perms);
+    fuse_init(&fuse, fd, source_path, write_gid, derive, split_perms, cache_valid,
+            writeback);
 
     umask(0);
     res = ignite_fuse(&fuse, num_threads);
@@ -1888,12 +2955,14 @@ int main(int argc, char **argv)
     int num_threads = DEFAULT_NUM_THREADS;
     derive_t derive = DERIVE_NONE;
     bool split_perms = false;
+    int cache_valid = -1;
+    bool writeback = property_get_bool(kWritebackProperty, false);
     int i;
     struct rlimit rlim;
     int fs_version;
 
     int opt;
-    while ((opt = getopt(argc, argv, "u:g:w:t:dls")) != -1) {
+    while ((opt = getopt(argc, argv, "u:g:w:t:dlsc:W")) != -1) {
         switch (opt) {
             case 'u':
                 uid = strtoul(optarg, NULL, 10);
@@ -1916,6 +2985,22 @@ int main(int argc, char **argv)
             case 's':
                 split_perms = true;
                 break;
+            case 'c': {
+                char* end;
+                long secs;
+
+                errno = 0;
+                secs = strtol(optarg, &end, 10);
+                if (errno || end == optarg || *end || secs < 0 || secs > INT_MAX) {
+                    ERROR("invalid cache validity: %s\n", optarg);
+                    return usage();
+                }
+                cache_valid = secs;
+                break;
+            }
+            case 'W':
+                writeback = true;
+                break;
             case '?':
             default:
                 return usage();
@@ -1958,6 +3043,12 @@ int main(int argc, char **argv)
         ERROR("cannot split permissions without deriving\n");
         return usage();
     }
+    if (cache_valid < 0) {
+        cache_valid = property_get_int32(kCacheValidProperty, DEFAULT_CACHE_VALID);
+        if (cache_valid < 0) {
+            cache_valid = DEFAULT_CACHE_VALID;
+        }
+    }
 
     rlim.rlim_cur = 8192;
     rlim.rlim_max = 8192;
@@ -1970,6 +3061,7 @@ int main(int argc, char **argv)
         sleep(1);
     }
 
-    res = run(source_path, dest_path, uid, gid, write_gid, num_threads, derive, split_perms);
+    res = run(source_path, dest_path, uid, gid, write_gid, num_threads, derive, split_perms,
+            cache_valid, writeback);
     return res < 0 ? 1 : 0;
 }
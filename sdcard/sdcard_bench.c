@@ -0,0 +1,200 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Measures sequential throughput through the sdcard daemon against the
+ * backing filesystem it exports, e.g.
+ *
+ *   sdcard_bench /data/media/0 /storage/emulated/0
+ *
+ * Each directory gets a file written with fsync and then read back cold,
+ * after dropping the page cache (which needs root; without it the reads are
+ * warm and say more about the kernel's FUSE cache than about the daemon).
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_SIZE_MB 256
+#define DEFAULT_BLOCK_KB 256
+#define DEFAULT_RUNS 3
+
+static const char* const kBenchFile = "sdcard_bench.tmp";
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void drop_caches()
+{
+    int fd;
+
+    sync();
+    fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+    if (fd < 0 || write(fd, "3", 1) != 1) {
+        fprintf(stderr, "cannot drop caches: %s\n", strerror(errno));
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+/* Returns MB/s, or a negative number on failure. */
+static double bench_write(const char* path, char* buf, size_t block, size_t size)
+{
+    double start;
+    size_t done;
+    size_t len;
+    int fd;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0664);
+    if (fd < 0) {
+        fprintf(stderr, "cannot create %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    start = now();
+    for (done = 0; done < size; done += len) {
+        len = size - done < block ? size - done : block;
+        if (write(fd, buf, len) != (ssize_t) len) {
+            fprintf(stderr, "write to %s failed: %s\n", path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+    }
+    fsync(fd);
+    close(fd);
+    return size / (now() - start) / (1024 * 1024);
+}
+
+static double bench_read(const char* path, char* buf, size_t block, size_t size)
+{
+    double start;
+    size_t done = 0;
+    ssize_t res;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    start = now();
+    while ((res = read(fd, buf, block)) > 0) {
+        done += res;
+    }
+    close(fd);
+    if (res < 0 || done != size) {
+        fprintf(stderr, "read of %s failed: %s\n", path, res < 0 ? strerror(errno) : "short");
+        return -1;
+    }
+    return size / (now() - start) / (1024 * 1024);
+}
+
+static int bench_dir(const char* dir, size_t block, size_t size, int runs,
+        double* write_mbs, double* read_mbs)
+{
+    char path[PATH_MAX];
+    char* buf;
+    int i;
+
+    buf = malloc(block);
+    if (!buf) {
+        return -1;
+    }
+    memset(buf, 0x5a, block);
+    snprintf(path, sizeof(path), "%s/%s", dir, kBenchFile);
+
+    *write_mbs = *read_mbs = 0;
+    for (i = 0; i < runs; i++) {
+        double w, r;
+
+        drop_caches();
+        w = bench_write(path, buf, block, size);
+        drop_caches();
+        r = w < 0 ? -1 : bench_read(path, buf, block, size);
+        if (r < 0) {
+            unlink(path);
+            free(buf);
+            return -1;
+        }
+        *write_mbs += w / runs;
+        *read_mbs += r / runs;
+    }
+    unlink(path);
+    free(buf);
+    return 0;
+}
+
+static int usage()
+{
+    fprintf(stderr, "usage: sdcard_bench [OPTIONS] <backing_dir> <fuse_dir>\n"
+            "    -s: file size in MB (default %d)\n"
+            "    -b: block size in KB (default %d)\n"
+            "    -n: number of runs to average (default %d)\n"
+            "\n", DEFAULT_SIZE_MB, DEFAULT_BLOCK_KB, DEFAULT_RUNS);
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    size_t size = DEFAULT_SIZE_MB * 1024 * 1024;
+    size_t block = DEFAULT_BLOCK_KB * 1024;
+    int runs = DEFAULT_RUNS;
+    double backing_write, backing_read, fuse_write, fuse_read;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:b:n:")) != -1) {
+        switch (opt) {
+            case 's':
+                size = strtoul(optarg, NULL, 10) * 1024 * 1024;
+                break;
+            case 'b':
+                block = strtoul(optarg, NULL, 10) * 1024;
+                break;
+            case 'n':
+                runs = strtol(optarg, NULL, 10);
+                break;
+            default:
+                return usage();
+        }
+    }
+    if (argc - optind != 2 || !size || !block || runs < 1) {
+        return usage();
+    }
+
+    if (bench_dir(argv[optind], block, size, runs, &backing_write, &backing_read)
+            || bench_dir(argv[optind + 1], block, size, runs, &fuse_write, &fuse_read)) {
+        return 1;
+    }
+
+    printf("%zu MB in %zu KB blocks, %d runs\n", size >> 20, block >> 10, runs);
+    printf("%-10s %10s %10s %8s\n", "", "backing", "fuse", "ratio");
+    printf("write MB/s %10.1f %10.1f %7.0f%%\n",
+            backing_write, fuse_write, 100 * fuse_write / backing_write);
+    printf("read  MB/s %10.1f %10.1f %7.0f%%\n",
+            backing_read, fuse_read, 100 * fuse_read / backing_read);
+    return 0;
+}
@@ -1,18 +1,52 @@
 #include <stdio.h>
+#include <stdlib.h>
 
 #include <cutils/properties.h>
 
 int setprop_main(int argc, char *argv[])
 {
-    if(argc != 3) {
-        fprintf(stderr,"usage: setprop <key> <value>\n");
+    const char **keys, **values;
+    int *results;
+    int count, i;
+    int ret = 0;
+
+    if(argc < 3 || argc % 2 != 1) {
+        fprintf(stderr,"usage: setprop <key> <value> [<key> <value> ...]\n");
         return 1;
     }
 
-    if(property_set(argv[1], argv[2])){
-        fprintf(stderr,"could not set property\n");
+    if(argc == 3) {
+        if(property_set(argv[1], argv[2])){
+            fprintf(stderr,"could not set property\n");
+            return 1;
+        }
+        return 0;
+    }
+
+    /* several pairs go to init over one connection */
+    count = (argc - 1) / 2;
+    keys = malloc(count * sizeof(*keys));
+    values = malloc(count * sizeof(*values));
+    results = malloc(count * sizeof(*results));
+    if(!keys || !values || !results) {
+        fprintf(stderr,"out of memory\n");
         return 1;
     }
+    for(i = 0; i < count; i++) {
+        keys[i] = argv[1 + 2 * i];
+        values[i] = argv[2 + 2 * i];
+    }
+
+    if(property_set_batch(keys, values, count, results)) {
+        for(i = 0; i < count; i++) {
+            if(results[i] < 0)
+                fprintf(stderr,"could not set property %s\n", keys[i]);
+        }
+        ret = 1;
+    }
 
-    return 0;
+    free(keys);
+    free(values);
+    free(results);
+    return ret;
 }